@@ -19,6 +19,7 @@ sender = os.environ.get("sender")
 forum = os.environ.get("forum")
 text = os.environ.get("text")
 
+# Anything from IRC goes after "--", so "-n" is a key, not an option
 def factoids(*args):
     cmd = ["./factoids"]
     cmd.extend(args)
@@ -27,9 +28,27 @@ def factoids(*args):
         line = bline.decode('utf-8')[:-1]
         print("PRIVMSG %s :%s" % (forum, line))
 
+def mentioned(text):
+    """Keys appearing in text as whole words"""
+    btext = text.encode('utf-8')
+    found = []
+    p = Popen(["./factoids", "-S", "--", db, text], stdout=PIPE)
+    for bline in p.stdout:
+        off, length, key = bline.decode('utf-8')[:-1].split('\t', 2)
+        start = int(off)
+        end = start + int(length)
+        if start > 0 and btext[start-1:start].isalnum():
+            continue
+        if end < len(btext) and btext[end:end+1].isalnum():
+            continue
+        if key not in found:
+            found.append(key)
+    return found
+
 # Create db if it doesn't exist
 if not os.path.exists(db):
     factoids("-n", db)
+    factoids("-K", db)
 
 if command == "_INIT_":
     print("NICK infotest")
@@ -41,12 +60,15 @@ elif command == "PRIVMSG":
         txt = text[1:]
         if " += " in txt:
             key, val = txt.split(' += ', 1)
-            factoids("-a", val, db, key)
+            factoids("-a", val, "--", db, key)
         elif " -= " in txt:
             key, glob = txt.split(' -= ', 1)
-            factoids("-r", glob, db, key)
+            factoids("-r", glob, "--", db, key)
         else:
-            factoids("-l", db, txt)
+            factoids("-l", "--", db, txt)
+    elif os.path.exists(db + ".ac"):
+        for key in mentioned(text)[:3]:
+            factoids("--", db, key)
     else:
-        factoids(db, text)
+        factoids("--", db, text)
 
@@ -204,50 +204,24 @@ end
 -- Moderation
 --
 --
-require('lfs')
+-- The queue is a directory kept by the queue program, which any
+-- number of handlers can push to and pop from at once
+qdir = "queue"
 
-function queue()
-	ret = {}
-	for file in lfs.dir("queue") do
-		if file:sub(1, 1) ~= "." then
-			table.insert(ret, file)
-		end
-	end
-	return ret
+function queue_len()
+	return tonumber(system({"queue", qdir})[1]) or 0
 end
 
 function push(text)
-	now = os.time()
-	f = io.open(("queue/%d"):format(now), "w")
-	f:write(text)
-	f:close()
+	system({"queue", "-a", qdir, text})
 end
 
-function pop(q, peek)
-	if not q then
-		q = queue()
-	end
-	if #q == 0 then
-		return
-	end
-
-	table.sort(q)
-	fn = ("queue/%s"):format(q[1])
-
-	f = io.open(fn)
-	ret = f:read()
-	f:close()
-
-	if peek == nil then
-		os.remove(fn)
-		table.remove(q, 1)
-	end
-
-	return ret
+function pop(peek)
+	return system({"queue", peek and "-k" or "-p", qdir})[1]
 end
 
-function peek(q)
-	return pop(q, true)
+function peek()
+	return pop(true)
 end
 
 function bot:handle_notice()
@@ -268,22 +242,21 @@ end
 
 function bot:handle_public()
 	if self.forum:startswith("#mod-") then	
-		q = queue()
 		if self.text:startswith("!") then
 			if self.text:startswith("!n") then
-				question = pop(q)
+				question = pop()
 				if not question then
 					return self:msg("[Queue empty]")
 				else
 					self:raw("PRIVMSG " .. self.channels[1] .. " :" .. question)
 				end
 			elseif self.text:startswith("!d") then
-				pop(q)
+				pop()
 			end
 					
-			question = pop(q, true)
+			question = peek()
 			if question then
-				self:msg(("[1/%d] %s"):format(#q, question))
+				self:msg(("[1/%d] %s"):format(queue_len(), question))
 			else
 				self:msg("[End of Queue]")
 			end
@@ -303,12 +276,12 @@ function bot:handle_private()
 		return
 	end
 
-	q = queue()
+	n = queue_len()
 	question = ("<%s> %s"):format(self.prefix, self.text)
 	push(question)
-	self:msg("Your question has been enqueued.  There are approximately " .. #q .. " questions before yours.")
+	self:msg("Your question has been enqueued.  There are approximately " .. n .. " questions before yours.")
 	
-	if (#q == 0) then
+	if (n == 0) then
 		self:raw("PRIVMSG " .. self.channels[2] .. " :[1/1] " .. question)
 	end
 end
@@ -0,0 +1,33 @@
+/*
+ * newmont's strawberry check, as a plugin, so the commonest reply
+ * doesn't cost a fork and a Lua interpreter.  Everything else still
+ * goes to the handler:
+ *
+ *   make contrib/strawberry.so
+ *   tcpclient YOUR.IRC.SERVER 6667 ./bot -p contrib/strawberry.so contrib/newmont
+ */
+#include <stdio.h>
+#include <string.h>
+#include "plugin.h"
+
+static int
+on_message(const struct irc_msg *m, emit_fn emit, void *ctx)
+{
+    char line[512];
+
+    if (! m->text || ! m->forum || strcmp(m->command, "PRIVMSG")) {
+        return BOT_PASS;
+    }
+    if (! strstr(m->text, "strawberry")) {
+        return BOT_PASS;
+    }
+    snprintf(line, sizeof(line), "PRIVMSG %s :Strawberries are delicious.", m->forum);
+    emit(ctx, line);
+    return BOT_HANDLED;
+}
+
+const struct bot_plugin bot_plugin = {
+    .abi = BOT_PLUGIN_ABI,
+    .name = "strawberry",
+    .on_message = on_message,
+};
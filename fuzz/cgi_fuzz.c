@@ -0,0 +1,65 @@
+/* libFuzzer target for cgi_parse(): make fuzz, then
+ *
+ *   fuzz/cgi_fuzz -max_len=4096 CORPUS_DIR
+ *
+ * The first byte picks the kind of body, slash command form if even,
+ * Events API JSON if odd; the rest is the body, copied into a buffer
+ * with exactly the one byte of room cgi_parse() is allowed, so
+ * AddressSanitizer catches anything read or written past it.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cgi.h"
+
+static const char *names[] = {
+    "text", "user_name", "channel_name", "response_url", "token",
+    "type", "challenge", "event.text", "event.user", "event.channel",
+    "event.bot_id", NULL
+};
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static struct cgi_form form;
+    static int ready;
+    const char *content_type;
+    char *buf;
+    size_t i;
+
+    if (0 == size) {
+        return 0;
+    }
+    if (! ready) {
+        if (cgi_form_init(&form, NULL)) {
+            abort();
+        }
+        ready = 1;
+    }
+
+    content_type = (data[0] & 1) ? "application/json" : "application/x-www-form-urlencoded";
+    size -= 1;
+    if (! (buf = (char *)malloc(size + 1))) {
+        return 0;
+    }
+    memcpy(buf, data + 1, size);
+
+    if (0 == cgi_parse(&form, buf, size, content_type)) {
+        // Every pair has to lie within the body, NUL-terminated there
+        for (i = 0; i < form.npairs; i += 1) {
+            struct cgi_pair *p = &form.pairs[i];
+
+            if ((p->key < buf) || (p->key + p->keylen > buf + size) || p->key[p->keylen] ||
+                    (p->val < buf) || (p->val + p->vallen > buf + size) || p->val[p->vallen] ||
+                    (p->parent >= (int)i)) {
+                abort();
+            }
+        }
+        for (i = 0; names[i]; i += 1) {
+            cgi_get(&form, names[i]);
+        }
+    }
+
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,637 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cdb.h"
+#include "ac.h"
+
+/*
+ * Key automaton
+ *
+ * The trie of every key is stored as a double array: state s goes to
+ * state base[s] + c on byte c if check[base[s] + c] is s, and otherwise
+ * falls back to state fail[s], the longest proper suffix of s that is
+ * also in the trie, and tries again.  State 1 is the root, and state 0
+ * is never used, so a check of 0 marks a free slot.
+ *
+ * out[s] is 1 + the longest key ending at s, counting keys that are
+ * suffixes of s; each key then links to the next shorter one.  Keys are
+ * numbered in sorted order.
+ *
+ * File, little-endian:
+ *
+ *   0   u32 AC_MAGIC       4  u32 version
+ *   8   u32 states        12  u32 keys
+ *   16  u32 key bytes     20  12 bytes unused
+ *   32  states x (u32 base, u32 check, u32 fail, u32 out)
+ *       keys x (u32 offset, u32 length, u32 next)
+ *       every key, each followed by a NUL
+ */
+
+#define AC_VERSION 1
+#define HDR_SIZE 32
+#define STATE_SIZE 16
+#define KEY_SIZE 12
+#define ROOT 1
+
+/* States with one child fill the first free slot; states with more only
+ * look for room among the last this many slots, so building stays linear
+ */
+#define WINDOW 1024
+
+#ifndef min
+#define min(a,b) ((a)<(b)?(a):(b))
+#endif
+
+static void
+put_u32le(uint8_t *p, uint32_t val)
+{
+    p[0] = (val >> 0)  & 0xff;
+    p[1] = (val >> 8)  & 0xff;
+    p[2] = (val >> 16) & 0xff;
+    p[3] = (val >> 24) & 0xff;
+}
+
+static uint32_t
+get_u32le(const uint8_t *p)
+{
+    return ((p[0] << 0) |
+            (p[1] << 8) |
+            (p[2] << 16) |
+            ((uint32_t)p[3] << 24));
+}
+
+/*
+ * Building
+ */
+
+struct keylist {
+    char *arena;
+    size_t arenalen;
+    size_t arenasize;
+    uint32_t *offsets;
+    uint32_t *lens;
+    uint32_t n;
+    uint32_t size;
+};
+
+static struct keylist *sorting;
+
+static int
+cmp_ids(const void *a, const void *b)
+{
+    uint32_t ia = *(uint32_t *)a;
+    uint32_t ib = *(uint32_t *)b;
+    uint32_t alen = sorting->lens[ia];
+    uint32_t blen = sorting->lens[ib];
+    int r = memcmp(sorting->arena + sorting->offsets[ia],
+            sorting->arena + sorting->offsets[ib], min(alen, blen));
+
+    if (r) {
+        return r;
+    }
+    return (alen > blen) - (alen < blen);
+}
+
+static int
+keylist_add(struct keylist *kl, char *key, size_t keylen)
+{
+    if (kl->n == kl->size) {
+        uint32_t size = kl->size ? kl->size * 2 : 1024;
+        uint32_t *offsets = (uint32_t *)realloc(kl->offsets, size * sizeof(uint32_t));
+        uint32_t *lens;
+
+        if (! offsets) {
+            return -1;
+        }
+        kl->offsets = offsets;
+        if (! (lens = (uint32_t *)realloc(kl->lens, size * sizeof(uint32_t)))) {
+            return -1;
+        }
+        kl->lens = lens;
+        kl->size = size;
+    }
+    if (kl->arenalen + keylen + 1 > kl->arenasize) {
+        size_t arenasize = kl->arenasize ? kl->arenasize : 65536;
+        char *arena;
+
+        while (arenasize < kl->arenalen + keylen + 1) {
+            arenasize *= 2;
+        }
+        if (! (arena = (char *)realloc(kl->arena, arenasize))) {
+            return -1;
+        }
+        kl->arena = arena;
+        kl->arenasize = arenasize;
+    }
+
+    memcpy(kl->arena + kl->arenalen, key, keylen);
+    kl->arena[kl->arenalen + keylen] = '\0';
+    kl->offsets[kl->n] = kl->arenalen;
+    kl->lens[kl->n] = keylen;
+    kl->arenalen += keylen + 1;
+    kl->n += 1;
+
+    return 0;
+}
+
+/* A state still to be given children: the keys lo to hi, which share
+ * their first depth bytes
+ */
+struct pending {
+    uint32_t state;
+    uint32_t lo;
+    uint32_t hi;
+    uint32_t depth;
+};
+
+struct trie {
+    uint32_t *base;
+    uint32_t *check;
+    uint32_t *fail;
+    uint32_t *out;
+    uint64_t *used;     // Bitmap of slots taken
+    uint32_t size;
+    uint32_t nstates;   // One past the highest slot taken
+    uint32_t free;      // First free slot any byte fits in
+};
+
+static int
+trie_grow(struct trie *t, uint64_t need)
+{
+    uint64_t size = t->size ? t->size : 65536;
+    uint32_t **arrays[] = {&t->base, &t->check, &t->fail, &t->out, NULL};
+    uint32_t ***a;
+    uint64_t *used;
+
+    if (need <= t->size) {
+        return 0;
+    }
+    while (size < need) {
+        size *= 2;
+    }
+    if (size > UINT32_MAX - 256) {
+        errno = EFBIG;
+        return -1;
+    }
+    for (a = arrays; *a; a += 1) {
+        uint32_t *p = (uint32_t *)realloc(**a, size * sizeof(uint32_t));
+
+        if (! p) {
+            return -1;
+        }
+        memset(p + t->size, 0, (size - t->size) * sizeof(uint32_t));
+        **a = p;
+    }
+    if (! (used = (uint64_t *)realloc(t->used, size / 8))) {
+        return -1;
+    }
+    memset(used + t->size / 64, 0, (size - t->size) / 8);
+    t->used = used;
+    t->size = size;
+
+    return 0;
+}
+
+static int
+is_used(struct trie *t, uint32_t slot)
+{
+    return (slot < t->size) && (t->used[slot / 64] & (1ull << (slot % 64)));
+}
+
+/* The first free slot after slot */
+static uint32_t
+next_free(struct trie *t, uint32_t slot)
+{
+    uint32_t s = slot + 1;
+
+    for (;;) {
+        uint32_t i = s / 64;
+        uint64_t w;
+
+        if (i >= t->size / 64) {
+            return s;
+        }
+        if ((w = ~t->used[i] & (~0ull << (s % 64)))) {
+            return i * 64 + __builtin_ctzll(w);
+        }
+        s = (i + 1) * 64;
+    }
+}
+
+/* Find a base where every label fits, and take those slots */
+static int
+place(struct trie *t, uint32_t state, uint8_t *labels, size_t nlabels)
+{
+    uint32_t slot = t->free;
+    uint32_t b;
+    size_t i;
+
+    if ((nlabels > 1) && (t->nstates > slot + WINDOW)) {
+        slot = t->nstates - WINDOW;
+        if (is_used(t, slot)) {
+            slot = next_free(t, slot);
+        }
+    }
+
+    for (;;) {
+        if (slot > labels[0]) {
+            b = slot - labels[0];
+            if (trie_grow(t, (uint64_t)b + 256)) {
+                return -1;
+            }
+            for (i = 1; i < nlabels; i += 1) {
+                if (is_used(t, b + labels[i])) {
+                    break;
+                }
+            }
+            if (i == nlabels) {
+                break;
+            }
+        }
+        slot = next_free(t, slot);
+    }
+
+    t->base[state] = b;
+    for (i = 0; i < nlabels; i += 1) {
+        uint32_t s = b + labels[i];
+
+        t->used[s / 64] |= 1ull << (s % 64);
+        t->check[s] = state;
+        if (s >= t->nstates) {
+            t->nstates = s + 1;
+        }
+    }
+    if (is_used(t, t->free)) {
+        t->free = next_free(t, t->free);
+    }
+
+    return 0;
+}
+
+static void
+trie_free(struct trie *t)
+{
+    free(t->base);
+    free(t->check);
+    free(t->fail);
+    free(t->out);
+    free(t->used);
+}
+
+/* Lay the trie of the sorted keys out, breadth first, into t.  Leaves
+ * the states in the order they were made, which is breadth first, in
+ * *order, and out[s] set to 1 + the key ending right at s.
+ */
+static int
+build_trie(struct trie *t, struct keylist *kl, uint32_t *sorted,
+        struct pending **order, size_t *norder)
+{
+    struct pending *q = NULL;
+    size_t qlen = 0;
+    size_t qsize = 0;
+    size_t head;
+
+    if (trie_grow(t, 65536)) {
+        return -1;
+    }
+    t->used[0] |= 3;        // Nothing goes in 0, and 1 is the root
+    t->nstates = 2;
+    t->free = 256;          // Below that, not every byte fits
+
+    qsize = 1024;
+    if (! (q = (struct pending *)malloc(qsize * sizeof(*q)))) {
+        return -1;
+    }
+    q[qlen++] = (struct pending){ROOT, 0, kl->n, 0};
+
+    for (head = 0; head < qlen; head += 1) {
+        struct pending p = q[head];
+        uint8_t labels[256];
+        uint32_t starts[257];
+        size_t nlabels = 0;
+        uint32_t i = p.lo;
+        size_t j;
+
+        if ((i < p.hi) && (kl->lens[sorted[i]] == p.depth)) {
+            t->out[p.state] = i + 1;
+            i += 1;
+        }
+        for (; i < p.hi; i += 1) {
+            uint8_t c = kl->arena[kl->offsets[sorted[i]] + p.depth];
+
+            if (! nlabels || (labels[nlabels - 1] != c)) {
+                labels[nlabels] = c;
+                starts[nlabels] = i;
+                nlabels += 1;
+            }
+        }
+        starts[nlabels] = p.hi;
+        if (! nlabels) {
+            continue;
+        }
+
+        if (place(t, p.state, labels, nlabels)) {
+            free(q);
+            return -1;
+        }
+        if (qlen + nlabels > qsize) {
+            struct pending *nq;
+
+            qsize *= 2;
+            if (! (nq = (struct pending *)realloc(q, qsize * sizeof(*q)))) {
+                free(q);
+                return -1;
+            }
+            q = nq;
+        }
+        for (j = 0; j < nlabels; j += 1) {
+            q[qlen++] = (struct pending){
+                t->base[p.state] + labels[j], starts[j], starts[j + 1], p.depth + 1
+            };
+        }
+    }
+
+    *order = q;
+    *norder = qlen;
+    return 0;
+}
+
+/* Where state s goes on c, or 0 */
+static uint32_t
+go(struct trie *t, uint32_t s, uint8_t c)
+{
+    uint32_t n = t->base[s] + c;
+
+    return ((n < t->size) && (t->check[n] == s)) ? n : 0;
+}
+
+int
+ac_build(FILE *db, FILE *out)
+{
+    struct cdb_ctx inc;
+    struct keylist kl = {0};
+    struct trie t = {0};
+    struct pending *order = NULL;
+    size_t norder = 0;
+    uint32_t *sorted = NULL;
+    uint32_t *next = NULL;
+    uint32_t nkeys = 0;
+    uint32_t nstates;
+    uint32_t bloblen = 0;
+    uint32_t maxbase = 0;
+    char *dkey = NULL;
+    size_t dkeysize = 0;
+    char *dval = NULL;
+    size_t dvalsize = 0;
+    uint8_t hdr[HDR_SIZE] = {0};
+    uint32_t i;
+    size_t j;
+    int ret = -1;
+
+    if (cdb_init(&inc, db)) {
+        return -1;
+    }
+
+    // Gather every key once
+    for (;;) {
+        size_t keylen;
+        size_t vallen;
+
+        if (EOF == cdb_dump_full(&inc, &dkey, &dkeysize, &keylen, &dval, &dvalsize, &vallen)) {
+            break;
+        }
+        if (! keylen) {
+            continue;       // Would be found everywhere
+        }
+        if (kl.n &&
+                (kl.lens[kl.n - 1] == keylen) &&
+                (0 == memcmp(kl.arena + kl.offsets[kl.n - 1], dkey, keylen))) {
+            continue;
+        }
+        if (keylist_add(&kl, dkey, keylen)) {
+            perror("Building key list");
+            goto done;
+        }
+    }
+    if (kl.arenalen > UINT32_MAX) {
+        fprintf(stderr, "Keys too long for an automaton\n");
+        goto done;
+    }
+
+    // Sort, dropping the duplicates that weren't next to each other
+    if (! (sorted = (uint32_t *)malloc((kl.n + 1) * sizeof(uint32_t)))) {
+        perror("Sorting keys");
+        goto done;
+    }
+    for (i = 0; i < kl.n; i += 1) {
+        sorted[i] = i;
+    }
+    sorting = &kl;
+    qsort(sorted, kl.n, sizeof(uint32_t), cmp_ids);
+    for (i = 0; i < kl.n; i += 1) {
+        if (nkeys && (0 == cmp_ids(&sorted[nkeys - 1], &sorted[i]))) {
+            continue;
+        }
+        sorted[nkeys++] = sorted[i];
+    }
+    kl.n = nkeys;
+
+    if (build_trie(&t, &kl, sorted, &order, &norder)) {
+        perror("Building automaton");
+        goto done;
+    }
+
+    // Failure links and outputs, breadth first so every shorter state is done
+    if (! (next = (uint32_t *)calloc(nkeys + 1, sizeof(uint32_t)))) {
+        perror("Building automaton");
+        goto done;
+    }
+    t.fail[ROOT] = ROOT;
+    for (j = 1; j < norder; j += 1) {
+        uint32_t s = order[j].state;
+        uint32_t parent = t.check[s];
+        uint8_t c = s - t.base[parent];
+        uint32_t f = ROOT;
+
+        if (ROOT != parent) {
+            for (f = t.fail[parent]; ; f = t.fail[f]) {
+                uint32_t n = go(&t, f, c);
+
+                if (n) {
+                    f = n;
+                    break;
+                } else if (ROOT == f) {
+                    break;
+                }
+            }
+        }
+        t.fail[s] = f;
+        if (t.out[s]) {
+            next[t.out[s] - 1] = t.out[f];
+        } else {
+            t.out[s] = t.out[f];
+        }
+    }
+
+    // Room for every byte from every state, so scanning needn't check
+    for (i = 0; i < t.nstates; i += 1) {
+        if (t.base[i] > maxbase) {
+            maxbase = t.base[i];
+        }
+    }
+    nstates = (maxbase + 256 > t.nstates) ? maxbase + 256 : t.nstates;
+    if (trie_grow(&t, nstates)) {
+        perror("Building automaton");
+        goto done;
+    }
+
+    for (i = 0; i < nkeys; i += 1) {
+        bloblen += kl.lens[sorted[i]] + 1;
+    }
+    put_u32le(hdr, AC_MAGIC);
+    put_u32le(hdr + 4, AC_VERSION);
+    put_u32le(hdr + 8, nstates);
+    put_u32le(hdr + 12, nkeys);
+    put_u32le(hdr + 16, bloblen);
+    fwrite(hdr, HDR_SIZE, 1, out);
+    for (i = 0; i < nstates; i += 1) {
+        uint8_t st[STATE_SIZE];
+
+        put_u32le(st, t.base[i]);
+        put_u32le(st + 4, t.check[i]);
+        put_u32le(st + 8, t.fail[i]);
+        put_u32le(st + 12, t.out[i]);
+        fwrite(st, STATE_SIZE, 1, out);
+    }
+    bloblen = 0;
+    for (i = 0; i < nkeys; i += 1) {
+        uint8_t k[KEY_SIZE];
+
+        put_u32le(k, bloblen);
+        put_u32le(k + 4, kl.lens[sorted[i]]);
+        put_u32le(k + 8, next[i]);
+        fwrite(k, KEY_SIZE, 1, out);
+        bloblen += kl.lens[sorted[i]] + 1;
+    }
+    for (i = 0; i < nkeys; i += 1) {
+        fwrite(kl.arena + kl.offsets[sorted[i]], kl.lens[sorted[i]] + 1, 1, out);
+    }
+    if (fflush(out) || ferror(out)) {
+        perror("Writing automaton");
+        goto done;
+    }
+    ret = 0;
+
+  done:
+    cdb_fini(&inc);
+    trie_free(&t);
+    free(order);
+    free(next);
+    free(sorted);
+    free(dkey);
+    free(dval);
+    free(kl.arena);
+    free(kl.offsets);
+    free(kl.lens);
+
+    return ret;
+}
+
+/*
+ * Scanning
+ */
+
+int
+ac_open(struct ac *a, FILE *f)
+{
+    struct stat st;
+    void *map;
+
+    memset(a, 0, sizeof(*a));
+    if (fstat(fileno(f), &st)) {
+        return -1;
+    }
+    if (st.st_size < HDR_SIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(f), 0);
+    if (MAP_FAILED == map) {
+        return -1;
+    }
+    a->map = (const uint8_t *)map;
+    a->maplen = st.st_size;
+
+    a->nstates = get_u32le(a->map + 8);
+    a->nkeys = get_u32le(a->map + 12);
+    a->bloblen = get_u32le(a->map + 16);
+    if ((AC_MAGIC != get_u32le(a->map)) || (get_u32le(a->map + 4) > AC_VERSION) ||
+            (a->nstates <= ROOT) ||
+            (HDR_SIZE + (uint64_t)a->nstates * STATE_SIZE + (uint64_t)a->nkeys * KEY_SIZE +
+             a->bloblen != a->maplen)) {
+        ac_close(a);
+        errno = EINVAL;
+        return -1;
+    }
+    a->states = a->map + HDR_SIZE;
+    a->keys = a->states + (size_t)a->nstates * STATE_SIZE;
+    a->blob = (const char *)(a->keys + (size_t)a->nkeys * KEY_SIZE);
+
+    return 0;
+}
+
+void
+ac_close(struct ac *a)
+{
+    if (a->map) {
+        munmap((void *)a->map, a->maplen);
+    }
+    a->map = NULL;
+}
+
+/* Call fn for every key in text, in the order they end, longest first */
+void
+ac_scan(const struct ac *a, const char *text, size_t len, ac_fn fn, void *arg)
+{
+    const uint8_t *s = (const uint8_t *)text;
+    uint32_t state = ROOT;
+    size_t i;
+
+    for (i = 0; i < len; i += 1) {
+        const uint8_t *st;
+        uint32_t k;
+
+        for (;;) {
+            uint32_t n = get_u32le(a->states + (size_t)state * STATE_SIZE) + s[i];
+
+            if ((n < a->nstates) &&
+                    (get_u32le(a->states + (size_t)n * STATE_SIZE + 4) == state)) {
+                state = n;
+                break;
+            } else if (ROOT == state) {
+                break;
+            }
+            state = get_u32le(a->states + (size_t)state * STATE_SIZE + 8);
+            if (state >= a->nstates) {
+                return;
+            }
+        }
+
+        st = a->states + (size_t)state * STATE_SIZE;
+        for (k = get_u32le(st + 12); k && (k <= a->nkeys); ) {
+            const uint8_t *key = a->keys + (size_t)(k - 1) * KEY_SIZE;
+            uint32_t off = get_u32le(key);
+            uint32_t keylen = get_u32le(key + 4);
+
+            if (((uint64_t)off + keylen >= a->bloblen) || (keylen > i + 1)) {
+                return;
+            }
+            fn(i + 1 - keylen, a->blob + off, keylen, arg);
+            k = get_u32le(key + 8);
+        }
+    }
+}
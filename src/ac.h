@@ -0,0 +1,34 @@
+#ifndef __AC_H__
+#define __AC_H__
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * An Aho-Corasick automaton over every key of a database, for finding
+ * all the keys that appear anywhere in a piece of text in one pass.
+ * Built into a file of little-endian arrays that is used where it lies,
+ * mmap()ed, with nothing to load.
+ */
+#define AC_MAGIC 0x31304341     // "AC01"
+
+struct ac {
+    const uint8_t *map;
+    size_t maplen;
+    uint32_t nstates;
+    uint32_t nkeys;
+    uint32_t bloblen;
+    const uint8_t *states;
+    const uint8_t *keys;
+    const char *blob;
+};
+
+/* Called with each key found, and where it starts in the text */
+typedef void (*ac_fn)(size_t offset, const char *key, size_t keylen, void *arg);
+
+int ac_build(FILE *db, FILE *out);
+int ac_open(struct ac *a, FILE *f);
+void ac_close(struct ac *a);
+void ac_scan(const struct ac *a, const char *text, size_t len, ac_fn fn, void *arg);
+
+#endif
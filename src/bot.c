@@ -2,30 +2,180 @@
 #include <signal.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <ctype.h>
 #include <time.h>
 #include <errno.h>
 #include <sysexits.h>
+#include <stdint.h>
 #include <sys/wait.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <dirent.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <dlfcn.h>
+#include "plugin.h"
 
 #define MAX_ARGS 50
 #define MAX_SUBPROCS 50
+#define MAX_PENDING 256
+#define TRACE_SPANS 16384
+#define MAX_PLUGINS 8
 
 #define max(a,b) ((a)>(b)?(a):(b))
 
 bool running = true;
 char *handler = NULL;
 char *msgdir = NULL;
+char *sockpath = NULL;
+int listener = -1;
 struct timeval output_interval = {0};
 
+/* With lanes, messages with the same forum (or sender) are handled one
+ * at a time, in order
+ */
+enum {
+    LANE_NONE,
+    LANE_FORUM,
+    LANE_SENDER
+} lane_by = LANE_NONE;
+
+/* With -b, a run of lines from the server with the same one of these
+ * commands goes to one handler, on its stdin, so a netsplit or a NAMES
+ * reply costs one process instead of hundreds
+ */
+char *batch_cmds = NULL;
+int batch_max = 100;
+uint64_t batch_linger = 50000;  // Microseconds
+
+struct {
+    FILE *f;                    // NULL when there's no batch
+    char cmd[32];
+    char *first;
+    int n;
+    uint64_t trace;             // Of the first line
+    uint64_t received;
+} batch;
+
+/* Every message gets a trace ID, which handlers see as $trace.  With a
+ * trace file, what happens to each is also noted in a ring of spans,
+ * written out as Chrome trace events on SIGUSR1.
+ */
+char *trace_file = NULL;
+volatile sig_atomic_t trace_dump = 0;
+uint64_t next_trace = 0;
+uint64_t current_trace = 0;     // Of the lines being sent
+
+struct span {
+    const char *name;
+    uint64_t trace;
+    uint64_t start;             // Microseconds
+    uint64_t end;
+    int tid;                    // 0 for the main loop, else subproc slot + 1
+    bool async;                 // Overlaps others, so tid doesn't fit
+} spans[TRACE_SPANS];
+uint64_t nspans = 0;
+
+uint64_t
+now_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void
+trace_span(const char *name, uint64_t trace, uint64_t start, uint64_t end, int tid, bool async)
+{
+    struct span *sp = &spans[nspans % TRACE_SPANS];
+
+    if (! trace_file) {
+        return;
+    }
+    sp->name = name;
+    sp->trace = trace;
+    sp->start = start;
+    sp->end = end;
+    sp->tid = tid;
+    sp->async = async;
+    nspans += 1;
+}
+
+/* Write the ring out, oldest first, as a Chrome trace */
+void
+write_trace()
+{
+    char tmpfn[PATH_MAX];
+    uint64_t i = (nspans > TRACE_SPANS) ? nspans - TRACE_SPANS : 0;
+    const char *sep = "";
+    FILE *f;
+
+    if (! trace_file) {
+        return;
+    }
+    snprintf(tmpfn, sizeof(tmpfn), "%s.%d", trace_file, getpid());
+    if (! (f = fopen(tmpfn, "w"))) {
+        perror(tmpfn);
+        return;
+    }
+    fprintf(f, "{\"traceEvents\":[");
+    for (; i < nspans; i += 1) {
+        struct span *sp = &spans[i % TRACE_SPANS];
+        unsigned long long trace = sp->trace;
+
+        if (sp->async) {
+            fprintf(f, "%s\n{\"name\":\"%s\",\"cat\":\"bot\",\"ph\":\"b\",\"id\":\"0x%llx\","
+                    "\"ts\":%llu,\"pid\":%d,\"tid\":0,\"args\":{\"trace\":\"%016llx\"}}",
+                    sep, sp->name, trace, (unsigned long long)sp->start, getpid(), trace);
+            fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"bot\",\"ph\":\"e\",\"id\":\"0x%llx\","
+                    "\"ts\":%llu,\"pid\":%d,\"tid\":0}",
+                    sp->name, trace, (unsigned long long)sp->end, getpid());
+        } else {
+            fprintf(f, "%s\n{\"name\":\"%s\",\"cat\":\"bot\",\"ph\":\"X\",\"ts\":%llu,"
+                    "\"dur\":%llu,\"pid\":%d,\"tid\":%d,\"args\":{\"trace\":\"%016llx\"}}",
+                    sep, sp->name, (unsigned long long)sp->start,
+                    (unsigned long long)(sp->end - sp->start), getpid(), sp->tid, trace);
+        }
+        sep = ",";
+    }
+    fprintf(f, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    if (fclose(f)) {
+        perror(tmpfn);
+        remove(tmpfn);
+        return;
+    }
+    rename(tmpfn, trace_file);
+}
+
+void
+sigusr1(int signum)
+{
+    trace_dump = 1;
+}
+
+/* Plugins, loaded with -p and reloaded on SIGHUP */
+struct plugin {
+    char *path;
+    void *dl;
+    const struct bot_plugin *p;     // NULL if it didn't load
+    uint64_t next_timer;
+} plugins[MAX_PLUGINS];
+int nplugins = 0;
+volatile sig_atomic_t plugin_reload = 0;
+
+void
+sighup(int signum)
+{
+    plugin_reload = 1;
+}
+
 void
 maybe_setenv(char *key, char *val)
 {
@@ -34,37 +184,41 @@ maybe_setenv(char *key, char *val)
     }
 }
 
-void
-irc_filter(const char *str)
-{
+/* An IRC line, split up in place */
+struct irc_line {
     char buf[4096];
-    char *line = buf;
-    char *parts[20] = {0};
-    int   nparts;
-    char  snick[20];
+    char *parts[20];
+    int nparts;
+    char snick[64];
     char *cmd;
-    char *text = NULL;
-    char *prefix = NULL;
-    char *sender = NULL;
-    char *forum = NULL;
+    char *text;
+    char *prefix;
+    char *sender;
+    char *forum;
+};
+
+void
+irc_parse(const char *str, struct irc_line *m)
+{
+    char *line = m->buf;
     int   i;
 
-    strncpy(buf, str, sizeof buf);
+    memset(m, 0, sizeof(*m));
+    strncpy(m->buf, str, sizeof(m->buf) - 1);
     /* Tokenize IRC line */
-    nparts = 0;
     if (':' == *line) {
-        prefix = line + 1;
+        m->prefix = line + 1;
     } else {
-        parts[nparts++] = line;
+        m->parts[m->nparts++] = line;
     }
     while (*line) {
         if (' ' == *line) {
             *line++ = '\0';
             if (':' == *line) {
-                text = line+1;
+                m->text = line+1;
                 break;
-            } else {
-                parts[nparts++] = line;
+            } else if (m->nparts < (int)(sizeof(m->parts) / sizeof(*m->parts))) {
+                m->parts[m->nparts++] = line;
             }
         } else {
             line += 1;
@@ -73,62 +227,72 @@ irc_filter(const char *str)
 
     /* Strip trailing carriage return */
     while (*line) line += 1;
-    if ('\r' == *(line-1)) *(line-1) = '\0';
+    if ((line > m->buf) && ('\r' == *(line-1))) *(line-1) = '\0';
 
     /* Set command, converting to upper case */
-    cmd = parts[0];
-    for (i = 0; cmd[i]; i += 1) {
-        cmd[i] = toupper(cmd[i]);
+    m->cmd = m->parts[0] ? m->parts[0] : line;
+    for (i = 0; m->cmd[i]; i += 1) {
+        m->cmd[i] = toupper(m->cmd[i]);
     }
 
     /* Extract prefix nickname */
-    for (i = 0; prefix && (prefix[i] != '!'); i += 1) {
-        if (i == sizeof(snick) - 1) {
+    for (i = 0; m->prefix && (m->prefix[i] != '!'); i += 1) {
+        if (i == sizeof(m->snick) - 1) {
             i = 0;
             break;
         }
-        snick[i] = prefix[i];
+        m->snick[i] = m->prefix[i];
     }
-    snick[i] = '\0';
+    m->snick[i] = '\0';
     if (i) {
-        sender = snick;
+        m->sender = m->snick;
     }
 
     /* Determine forum */
-    if ((0 == strcmp(cmd, "PRIVMSG")) ||
-            (0 == strcmp(cmd, "NOTICE"))) {
+    if ((0 == strcmp(m->cmd, "PRIVMSG")) ||
+            (0 == strcmp(m->cmd, "NOTICE"))) {
         /* :neale!user@127.0.0.1 PRIVMSG #hydra :foo */
-        switch (parts[1][0]) {
+        switch (m->parts[1] ? m->parts[1][0] : '\0') {
             case '#':
             case '&':
             case '+': 
             case '!':
-                forum = parts[1];
+                m->forum = m->parts[1];
                 break;
             default:
-                forum = snick;
+                m->forum = m->snick;
                 break;
         }
-    } else if ((0 == strcmp(cmd, "PART")) ||
-            (0 == strcmp(cmd, "MODE")) ||
-            (0 == strcmp(cmd, "TOPIC")) ||
-            (0 == strcmp(cmd, "KICK"))) {
-        forum = parts[1];
-    } else if (0 == strcmp(cmd, "JOIN")) {
-        if (0 == nparts) {
-            forum = text;
-            text = NULL;
+    } else if ((0 == strcmp(m->cmd, "PART")) ||
+            (0 == strcmp(m->cmd, "MODE")) ||
+            (0 == strcmp(m->cmd, "TOPIC")) ||
+            (0 == strcmp(m->cmd, "KICK"))) {
+        m->forum = m->parts[1];
+    } else if (0 == strcmp(m->cmd, "JOIN")) {
+        if (0 == m->nparts) {
+            m->forum = m->text;
+            m->text = NULL;
         } else {
-            forum = parts[1];
-        }
-    } else if (0 == strcmp(cmd, "INVITE")) {
-        forum = text?text:parts[2];
-        text = NULL;
-    } else if (0 == strcmp(cmd, "NICK")) {
-        sender = parts[1];
-        forum = sender;
-    } else if (0 == strcmp(cmd, "PING")) {
-        printf("PONG :%s\r\n", text);
+            m->forum = m->parts[1];
+        }
+    } else if (0 == strcmp(m->cmd, "INVITE")) {
+        m->forum = m->text?m->text:m->parts[2];
+        m->text = NULL;
+    } else if (0 == strcmp(m->cmd, "NICK")) {
+        m->sender = m->parts[1];
+        m->forum = m->sender;
+    }
+}
+
+void
+irc_filter(const char *str)
+{
+    struct irc_line m;
+    int i;
+
+    irc_parse(str, &m);
+    if (0 == strcmp(m.cmd, "PING")) {
+        printf("PONG :%s\r\n", m.text);
         fflush(stdout);
     }
 
@@ -137,16 +301,16 @@ irc_filter(const char *str)
         char *_argv[MAX_ARGS + 1];
 
         maybe_setenv("handler", handler);
-        maybe_setenv("prefix", prefix);
-        maybe_setenv("command", cmd);
-        maybe_setenv("sender", sender);
-        maybe_setenv("forum", forum);
-        maybe_setenv("text", text);
+        maybe_setenv("prefix", m.prefix);
+        maybe_setenv("command", m.cmd);
+        maybe_setenv("sender", m.sender);
+        maybe_setenv("forum", m.forum);
+        maybe_setenv("text", m.text);
 
         _argc = 0;
         _argv[_argc++] = handler;
-        for (i = 1; (i < nparts) && (_argc < MAX_ARGS); i += 1) {
-            _argv[_argc++] = parts[i];
+        for (i = 1; (i < m.nparts) && (_argc < MAX_ARGS); i += 1) {
+            _argv[_argc++] = m.parts[i];
         }
         _argv[_argc] = NULL;
 
@@ -165,6 +329,42 @@ unblock(int fd)
 
 FILE *subprocs[MAX_SUBPROCS] = { 0 };
 
+/* Where each subproc's output goes: -1 for the server, or a client of
+ * the socket, which is closed once the subproc is done
+ */
+int replyto[MAX_SUBPROCS];
+
+/* Lane of each subproc, "" for none */
+char lanes[MAX_SUBPROCS][64];
+
+/* Each subproc's trace, when its message came in and it was forked, and
+ * with a trace file, a pipe that closes once it has exec'd
+ */
+uint64_t traces[MAX_SUBPROCS];
+uint64_t received[MAX_SUBPROCS];
+uint64_t forked[MAX_SUBPROCS];
+uint64_t execstart[MAX_SUBPROCS];
+int execfds[MAX_SUBPROCS];
+
+/* Messages waiting for their lane, oldest first */
+struct pending {
+    char *line;
+    int replyfd;
+    char lane[64];
+    uint64_t trace;
+    uint64_t received;
+    bool passed;                // Plugins have passed it on
+} pending[MAX_PENDING];
+int npending = 0;
+
+/* Clients of the socket still sending their line */
+struct client {
+    int fd;
+    size_t len;
+    char line[2048];
+} clients[MAX_SUBPROCS];
+int nclients = 0;
+
 void
 sigchld(int signum)
 {
@@ -172,25 +372,23 @@ sigchld(int signum)
 }
 
 
+/* Run the handler for text in subproc slot i, sending its output to
+ * replyfd, or the server if that's -1.  A batch of nbatch lines, text
+ * first, is on in; otherwise in is NULL.
+ */
 void
-dispatch(char *text)
+start_handler(int i, char *text, int replyfd, char *lane, uint64_t trace, uint64_t recv,
+              FILE *in, int nbatch)
 {
     int subout[2];
-    int i;
-
-    for (i = 0; i < MAX_SUBPROCS; i += 1) {
-        if (NULL == subprocs[i]) {
-            break;
-        }
-    }
-
-    if (MAX_SUBPROCS == i) {
-        fprintf(stderr, "warning: dropping message (too many children)\n");
-        return;
-    }
+    int execpipe[2] = {-1, -1};
+    uint64_t start;
 
     if (-1 == pipe(subout)) {
         perror("pipe");
+        if (-1 != replyfd) {
+            close(replyfd);
+        }
         return;
     }
 
@@ -199,26 +397,37 @@ dispatch(char *text)
         close(subout[0]);
         close(subout[1]);
         perror("fdopen");
+        if (-1 != replyfd) {
+            close(replyfd);
+        }
         return;
     }
+    replyto[i] = replyfd;
+    snprintf(lanes[i], sizeof(lanes[i]), "%s", lane);
+    if (trace_file && (0 == pipe(execpipe))) {
+        fcntl(execpipe[0], F_SETFD, FD_CLOEXEC);
+        fcntl(execpipe[1], F_SETFD, FD_CLOEXEC);
+    }
 
+    start = now_us();
     if (0 == fork()) {
         /*
          * Child 
          */
-        int null;
+        char id[20];
+        int infd = in ? fileno(in) : open("/dev/null", O_RDONLY);
 
-        if ((-1 == (null = open("/dev/null", O_RDONLY))) ||
-                (-1 == dup2(null, 0)) ||
+        if ((-1 == infd) ||
+                (-1 == dup2(infd, 0)) ||
                 (-1 == dup2(subout[1], 1))) {
             perror("fd setup");
             exit(EX_OSERR);
         }
 
         /*
-         * We'll be a good citizen and only close file descriptors we opened. 
+         * We'll be a good citizen and only close file descriptors we opened.
          */
-        close(null);
+        close(infd);
         close(subout[1]);
         for (i = 0; i < MAX_SUBPROCS; i += 1) {
             if (subprocs[i]) {
@@ -226,14 +435,422 @@ dispatch(char *text)
             }
         }
 
+        snprintf(id, sizeof(id), "%016llx", (unsigned long long)trace);
+        setenv("trace", id, 1);
+        if (nbatch) {
+            snprintf(id, sizeof(id), "%d", nbatch);
+            setenv("batch", id, 1);
+        }
         irc_filter(text);
         exit(0);
     }
 
+    traces[i] = trace;
+    received[i] = recv;
+    forked[i] = start;
+    execstart[i] = now_us();
+    execfds[i] = execpipe[0];
+    if (-1 != execpipe[1]) {
+        close(execpipe[1]);
+    }
+    trace_span("wait", trace, recv, start, 0, true);
+    trace_span("fork", trace, start, execstart[i], i + 1, false);
+
     unblock(subout[0]);
     close(subout[1]);
 }
 
+/* A free subproc slot, or -1 */
+int
+free_slot()
+{
+    int i;
+
+    for (i = 0; i < MAX_SUBPROCS; i += 1) {
+        if (NULL == subprocs[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Which lane text goes in, as a lower-cased forum or sender, or "" */
+void
+lane_of(char *text, char *lane, size_t lanelen)
+{
+    struct irc_line m;
+    char *key = NULL;
+    size_t i;
+
+    lane[0] = '\0';
+    if (LANE_NONE == lane_by) {
+        return;
+    }
+    irc_parse(text, &m);
+    key = (LANE_FORUM == lane_by) ? m.forum : m.sender;
+    for (i = 0; key && key[i] && (i < lanelen - 1); i += 1) {
+        lane[i] = tolower((unsigned char)key[i]);
+    }
+    lane[i] = '\0';
+}
+
+bool
+lane_busy(char *lane)
+{
+    int i;
+
+    for (i = 0; i < MAX_SUBPROCS; i += 1) {
+        if (subprocs[i] && (0 == strcmp(lanes[i], lane))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Hold text until its lane is free, and there's a slot for it */
+void
+hold(char *text, int replyfd, char *lane, uint64_t trace, uint64_t recv, bool passed)
+{
+    struct pending *p = &pending[npending];
+
+    if ((MAX_PENDING == npending) || ! (p->line = strdup(text))) {
+        fprintf(stderr, "warning: dropping message (too many waiting)\n");
+        if (-1 != replyfd) {
+            close(replyfd);
+        }
+        return;
+    }
+    p->replyfd = replyfd;
+    strcpy(p->lane, lane);
+    p->trace = trace;
+    p->received = recv;
+    p->passed = passed;
+    npending += 1;
+}
+
+bool run_plugins(char *text, int replyfd, uint64_t trace);
+
+/* Start whatever is waiting that can go now, oldest first.  Plugins
+ * get it first, once its lane is free.
+ */
+void
+run_pending()
+{
+    int i = 0;
+
+    while (i < npending) {
+        struct pending *p = &pending[i];
+        int slot;
+
+        if (lane_busy(p->lane)) {
+            i += 1;
+            continue;
+        }
+        if (! p->passed && run_plugins(p->line, p->replyfd, p->trace)) {
+            if (-1 != p->replyfd) {
+                close(p->replyfd);
+            }
+        } else {
+            p->passed = true;
+            if (-1 == (slot = free_slot())) {
+                break;
+            }
+            start_handler(slot, p->line, p->replyfd, p->lane, p->trace, p->received, NULL, 0);
+        }
+        free(p->line);
+        npending -= 1;
+        memmove(p, p + 1, (npending - i) * sizeof(*p));
+    }
+}
+
+void output(char *buf);
+void output_client(int fd, char *buf);
+
+/* Where a plugin's lines go */
+struct emit_ctx {
+    int replyfd;
+    uint64_t trace;
+};
+
+void
+emit_line(void *ctx, const char *line)
+{
+    struct emit_ctx *e = (struct emit_ctx *)ctx;
+    char buf[2048];
+
+    snprintf(buf, sizeof(buf) - 1, "%s", line);
+    current_trace = e->trace;
+    if (-1 == e->replyfd) {
+        output(buf);
+    } else {
+        output_client(e->replyfd, buf);
+    }
+}
+
+void
+load_plugin(struct plugin *pl)
+{
+    const struct bot_plugin *p;
+
+    pl->p = NULL;
+    if (! (pl->dl = dlopen(pl->path, RTLD_NOW | RTLD_LOCAL))) {
+        fprintf(stderr, "error: %s\n", dlerror());
+        return;
+    }
+    if (! (p = (const struct bot_plugin *)dlsym(pl->dl, "bot_plugin"))) {
+        fprintf(stderr, "error: %s: no bot_plugin\n", pl->path);
+    } else if (BOT_PLUGIN_ABI != p->abi) {
+        fprintf(stderr, "error: %s: ABI %d, not %d\n", pl->path, p->abi, BOT_PLUGIN_ABI);
+    } else if (p->init && p->init()) {
+        fprintf(stderr, "error: %s: init failed\n", pl->path);
+    } else {
+        pl->p = p;
+        pl->next_timer = now_us() + p->timer_ms * 1000ull;
+        return;
+    }
+    dlclose(pl->dl);
+    pl->dl = NULL;
+}
+
+void
+unload_plugin(struct plugin *pl)
+{
+    if (pl->p && pl->p->shutdown) {
+        pl->p->shutdown();
+    }
+    if (pl->dl) {
+        dlclose(pl->dl);
+    }
+    pl->p = NULL;
+    pl->dl = NULL;
+}
+
+/* Offer text to each plugin in turn, until one handles it */
+bool
+run_plugins(char *text, int replyfd, uint64_t trace)
+{
+    struct irc_line l;
+    struct irc_msg m;
+    struct emit_ctx ctx = {replyfd, trace};
+    int i;
+
+    if (! nplugins) {
+        return false;
+    }
+    irc_parse(text, &l);
+    m.line = text;
+    m.prefix = l.prefix;
+    m.command = l.cmd;
+    m.sender = l.sender;
+    m.forum = l.forum;
+    m.text = l.text;
+    m.argc = l.nparts ? l.nparts - 1 : 0;
+    m.argv = (const char *const *)l.parts + 1;
+    m.trace = trace;
+
+    for (i = 0; i < nplugins; i += 1) {
+        const struct bot_plugin *p = plugins[i].p;
+        uint64_t start = now_us();
+        int ret;
+
+        if (! p || ! p->on_message) {
+            continue;
+        }
+        ret = p->on_message(&m, emit_line, &ctx);
+        trace_span("plugin", trace, start, now_us(), 0, false);
+        if (BOT_HANDLED == ret) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Run plugin timers that are due, and return microseconds until the
+ * next one, or wait if that's sooner
+ */
+uint64_t
+run_timers(uint64_t wait)
+{
+    uint64_t now = now_us();
+    int i;
+
+    for (i = 0; i < nplugins; i += 1) {
+        struct plugin *pl = &plugins[i];
+
+        if (! pl->p || ! pl->p->on_timer || ! pl->p->timer_ms) {
+            continue;
+        }
+        if (now >= pl->next_timer) {
+            struct emit_ctx ctx = {-1, next_trace++};
+            uint64_t start = now;
+
+            pl->p->on_timer(emit_line, &ctx);
+            now = now_us();
+            trace_span("timer", ctx.trace, start, now, 0, false);
+            pl->next_timer = now + pl->p->timer_ms * 1000ull;
+        }
+        if (pl->next_timer - now < wait) {
+            wait = pl->next_timer - now;
+        }
+    }
+    return wait;
+}
+
+/* Whether cmd is in the -b list */
+bool
+batched(const char *cmd)
+{
+    size_t len = strlen(cmd);
+    const char *p = batch_cmds;
+
+    while (len && p) {
+        if ((0 == strncasecmp(p, cmd, len)) && ((',' == p[len]) || ('\0' == p[len]))) {
+            return true;
+        }
+        if ((p = strchr(p, ','))) {
+            p += 1;
+        }
+    }
+    return false;
+}
+
+/* Start a handler for the batch, if there is one */
+void
+flush_batch()
+{
+    int slot;
+
+    if (! batch.f) {
+        return;
+    }
+    if (-1 == (slot = free_slot())) {
+        fprintf(stderr, "warning: dropping %d messages (too many children)\n", batch.n);
+    } else if (fflush(batch.f) || (-1 == fseek(batch.f, 0, SEEK_SET))) {
+        perror("batch");
+    } else {
+        start_handler(slot, batch.first, -1, "", batch.trace, batch.received, batch.f, batch.n);
+    }
+    fclose(batch.f);
+    free(batch.first);
+    batch.f = NULL;
+}
+
+/* Add text, whose command is batched, to the batch, starting a new
+ * batch if it's not the same command as the last one
+ */
+bool
+batch_line(char *text, uint64_t trace, uint64_t recv)
+{
+    struct irc_line m;
+    size_t len = strlen(text);
+
+    irc_parse(text, &m);
+    if (batch.f && strcmp(batch.cmd, m.cmd)) {
+        flush_batch();
+    }
+    if (! batch.f) {
+        if (! (batch.f = tmpfile())) {
+            perror("tmpfile");
+            return false;
+        }
+        if (! (batch.first = strdup(text))) {
+            perror("strdup");
+            fclose(batch.f);
+            batch.f = NULL;
+            return false;
+        }
+        fcntl(fileno(batch.f), F_SETFD, FD_CLOEXEC);
+        snprintf(batch.cmd, sizeof(batch.cmd), "%s", m.cmd);
+        batch.n = 0;
+        batch.trace = trace;
+        batch.received = recv;
+    }
+
+    if (len && ('\r' == text[len - 1])) {
+        len -= 1;
+    }
+    fwrite(text, 1, len, batch.f);
+    fputc('\n', batch.f);
+    batch.n += 1;
+    if (batch.n == batch_max) {
+        flush_batch();
+    }
+    return true;
+}
+
+/* Run the handler for text, sending its output to replyfd, or the
+ * server if that's -1.  In a lane, wait for the lane's earlier
+ * messages first.  Then a plugin may handle it instead, or it may join
+ * a batch.
+ */
+void
+dispatch_to(char *text, int replyfd)
+{
+    char lane[sizeof(pending[0].lane)];
+    uint64_t trace = next_trace++;
+    uint64_t recv = now_us();
+    bool batching = false;
+    int slot;
+    int i;
+
+    if (batch_cmds && (-1 == replyfd)) {
+        struct irc_line m;
+
+        irc_parse(text, &m);
+        batching = batched(m.cmd);
+        if (! batching) {
+            // Whatever was batched came first
+            flush_batch();
+        }
+    }
+
+    // Batched lines don't wait for lanes
+    lane_of(text, lane, sizeof(lane));
+    if (batching) {
+        lane[0] = '\0';
+    }
+    if (lane[0]) {
+        bool wait = lane_busy(lane);
+
+        for (i = 0; (i < npending) && ! wait; i += 1) {
+            wait = (0 == strcmp(pending[i].lane, lane));
+        }
+        if (wait) {
+            hold(text, replyfd, lane, trace, recv, false);
+            return;
+        }
+    }
+
+    if (run_plugins(text, replyfd, trace)) {
+        if (-1 != replyfd) {
+            close(replyfd);
+        }
+        return;
+    }
+    if (batching && batch_line(text, trace, recv)) {
+        return;
+    }
+
+    if (-1 == (slot = free_slot())) {
+        if (lane[0]) {
+            hold(text, replyfd, lane, trace, recv, true);
+            return;
+        }
+        fprintf(stderr, "warning: dropping message (too many children)\n");
+        if (-1 != replyfd) {
+            close(replyfd);
+        }
+        return;
+    }
+    start_handler(slot, text, replyfd, lane, trace, recv, NULL, 0);
+}
+
+void
+dispatch(char *text)
+{
+    dispatch_to(text, -1);
+}
+
 void
 delay_output()
 {
@@ -248,6 +865,8 @@ delay_output()
         struct timespec ts;
         int ret;
 
+        uint64_t start = now_us();
+
         timersub(&output_interval, &diff, &delay);
 
         ts.tv_sec = (time_t) delay.tv_sec;
@@ -256,6 +875,7 @@ delay_output()
             ret = nanosleep(&ts, &ts);
         } while ((-1 == ret) && (EINTR == errno));
         gettimeofday(&output_last, NULL);
+        trace_span("ratelimit", current_trace, start, now_us(), 0, false);
     } else {
         output_last = now;
     }
@@ -266,11 +886,14 @@ delay_output()
 void
 output(char *buf)
 {
+    uint64_t start = now_us();
+
     if (timerisset(&output_interval)) {
         delay_output();
     }
 
     puts(buf);
+    trace_span("output", current_trace, start, now_us(), 0, false);
 }
 
 void
@@ -300,10 +923,126 @@ handle_input()
     }
 }
 
+/* Socket client that handle_subproc is sending lines to */
+int reply_client = -1;
+
+/* Send buf, which must have room for a newline, to socket client fd */
+void
+output_client(int fd, char *buf)
+{
+    size_t len = strlen(buf);
+    uint64_t start = now_us();
+
+    buf[len] = '\n';
+    if (-1 == send(fd, buf, len + 1, MSG_NOSIGNAL)) {
+        // It hung up; the handler can still finish
+    }
+    buf[len] = '\0';
+    trace_span("reply", current_trace, start, now_us(), 0, false);
+}
+
+void
+output_reply_client(char *buf)
+{
+    output_client(reply_client, buf);
+}
+
 void
-handle_subproc(FILE *s)
+handle_subproc(FILE *s, int replyfd, uint64_t trace)
 {
-    handle_file(s, output);
+    current_trace = trace;
+    if (-1 == replyfd) {
+        handle_file(s, output);
+    } else {
+        reply_client = replyfd;
+        handle_file(s, output_reply_client);
+    }
+}
+
+/* Take a new client of the socket */
+void
+handle_accept()
+{
+    int fd = accept(listener, NULL, NULL);
+
+    if (-1 == fd) {
+        return;
+    }
+    if (MAX_SUBPROCS == nclients) {
+        fprintf(stderr, "warning: dropping client (too many)\n");
+        close(fd);
+        return;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    unblock(fd);
+    clients[nclients].fd = fd;
+    clients[nclients].len = 0;
+    nclients += 1;
+}
+
+/* Read what a client has sent; once it's a whole line, dispatch it,
+ * sending the output back to the client.  Returns false once the
+ * client is done with.
+ */
+bool
+handle_client(struct client *c)
+{
+    char *nl;
+    ssize_t len = read(c->fd, c->line + c->len, sizeof(c->line) - 1 - c->len);
+
+    if ((-1 == len) && ((EAGAIN == errno) || (EINTR == errno))) {
+        return true;
+    }
+    if (len <= 0) {
+        close(c->fd);
+        return false;
+    }
+    c->len += len;
+    c->line[c->len] = '\0';
+
+    if ((nl = strchr(c->line, '\n'))) {
+        *nl = '\0';
+        dispatch_to(c->line, c->fd);
+        return false;
+    } else if (c->len == sizeof(c->line) - 1) {
+        fprintf(stderr, "warning: dropping client (line too long)\n");
+        close(c->fd);
+        return false;
+    }
+    return true;
+}
+
+/* Listen on a UNIX socket for lines to dispatch as if they came from
+ * the server, each on its own connection, which gets back whatever the
+ * handler prints
+ */
+int
+listen_socket(char *path)
+{
+    struct sockaddr_un addr = {0};
+    mode_t mask;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "error: socket path too long: %s\n", path);
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    unlink(path);
+    mask = umask(0117);
+    if ((-1 == (fd = socket(AF_UNIX, SOCK_STREAM, 0))) ||
+            (-1 == bind(fd, (struct sockaddr *)&addr, sizeof(addr))) ||
+            (-1 == listen(fd, 16))) {
+        perror(path);
+        umask(mask);
+        return -1;
+    }
+    umask(mask);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    unblock(fd);
+    return fd;
 }
 
 void
@@ -315,6 +1054,7 @@ loop()
     fd_set rfds;
     static time_t last_pulse = 0;
     time_t now;
+    bool done = false;
 
     // Look for messages in msgdir
     if (msgdir) {
@@ -333,10 +1073,14 @@ loop()
                 snprintf(fn, sizeof fn, "%s/%s", msgdir, ent->d_name);
                 f = fopen(fn, "r");
                 if (f) {
+                    uint64_t start = now_us();
+                    uint64_t trace = next_trace++;
+
                     // This one is blocking
-                    handle_subproc(f);
+                    handle_subproc(f, -1, trace);
                     fclose(f);
                     remove(fn);
+                    trace_span("msgdir", trace, start, now_us(), 0, false);
                 }
             }
         }
@@ -349,18 +1093,55 @@ loop()
     // Check subprocs for input
     FD_ZERO(&rfds);
     FD_SET(0, &rfds);
+    if (-1 != listener) {
+        FD_SET(listener, &rfds);
+        nfds = max(nfds, listener);
+    }
+    for (i = 0; i < nclients; i += 1) {
+        FD_SET(clients[i].fd, &rfds);
+        nfds = max(nfds, clients[i].fd);
+    }
     for (i = 0; i < MAX_SUBPROCS; i += 1) {
         if (subprocs[i]) {
             int fd = fileno(subprocs[i]);
 
             FD_SET(fd, &rfds);
             nfds = max(nfds, fd);
+            if (-1 != execfds[i]) {
+                FD_SET(execfds[i], &rfds);
+                nfds = max(nfds, execfds[i]);
+            }
         }
     }
 
     do {
-        struct timeval timeout = {1, 0};
+        uint64_t wait = run_timers(1000000);
+        struct timeval timeout;
 
+        // Don't keep a batch waiting past its linger time
+        if (batch.f) {
+            uint64_t age = now_us() - batch.received;
+
+            if (age >= batch_linger) {
+                wait = 0;
+            } else if (batch_linger - age < wait) {
+                wait = batch_linger - age;
+            }
+        }
+        timeout.tv_sec = wait / 1000000;
+        timeout.tv_usec = wait % 1000000;
+
+        if (trace_dump) {
+            trace_dump = 0;
+            write_trace();
+        }
+        if (plugin_reload) {
+            plugin_reload = 0;
+            for (i = 0; i < nplugins; i += 1) {
+                unload_plugin(&plugins[i]);
+                load_plugin(&plugins[i]);
+            }
+        }
         ret = select(nfds + 1, &rfds, NULL, NULL, &timeout);
     } while ((-1 == ret) && (EINTR == errno));
     if (-1 == ret) {
@@ -372,18 +1153,52 @@ loop()
     if (FD_ISSET(0, &rfds)) {
         handle_input();
     }
+    if (batch.f && (now_us() - batch.received >= batch_linger)) {
+        flush_batch();
+    }
 
     for (i = 0; i < MAX_SUBPROCS; i += 1) {
         FILE *f = subprocs[i];
 
+        // Nothing is ever written to these: they're readable once closed
+        if (f && (-1 != execfds[i]) && FD_ISSET(execfds[i], &rfds)) {
+            trace_span("exec", traces[i], execstart[i], now_us(), i + 1, false);
+            close(execfds[i]);
+            execfds[i] = -1;
+        }
         if (f && FD_ISSET(fileno(f), &rfds)) {
-            handle_subproc(f);
+            handle_subproc(f, replyto[i], traces[i]);
             if (feof(f)) {
+                uint64_t end = now_us();
+
+                trace_span("handler", traces[i], forked[i], end, i + 1, false);
+                trace_span("message", traces[i], received[i], end, 0, true);
+                if (-1 != execfds[i]) {
+                    close(execfds[i]);
+                    execfds[i] = -1;
+                }
                 fclose(f);
                 subprocs[i] = NULL;
+                if (-1 != replyto[i]) {
+                    close(replyto[i]);
+                }
+                done = true;
             }
         }
     }
+    if (done && npending) {
+        run_pending();
+    }
+
+    for (i = 0; i < nclients; i += 1) {
+        if (FD_ISSET(clients[i].fd, &rfds) && ! handle_client(&clients[i])) {
+            clients[i] = clients[--nclients];
+            i -= 1;
+        }
+    }
+    if ((-1 != listener) && FD_ISSET(listener, &rfds)) {
+        handle_accept();
+    }
 
     // Heartbeat
     now = time(NULL);
@@ -401,18 +1216,35 @@ usage(char *self)
     fprintf(stderr, "\n");
     fprintf(stderr, "-h           Display help.\n");
     fprintf(stderr, "-d DIR       Also dispatch messages from DIR, one per file.\n");
+    fprintf(stderr, "-s SOCKET    Also dispatch lines sent to UNIX socket SOCKET, one per\n");
+    fprintf(stderr, "             connection, and send the handler's output back on it.\n");
     fprintf(stderr, "-i INTERVAL  Wait at least INTERVAL microseconds between\n");
     fprintf(stderr, "             sending each line.\n");
+    fprintf(stderr, "-p PLUGIN    Load handler plugin PLUGIN (a .so), reloading it on\n");
+    fprintf(stderr, "             SIGHUP.  Plugins see each message first, and may\n");
+    fprintf(stderr, "             answer it instead of the handler.  Up to %d.\n", MAX_PLUGINS);
+    fprintf(stderr, "-T FILE      Note what happens to each message, and write the last\n");
+    fprintf(stderr, "             %d steps to FILE as a Chrome trace on SIGUSR1.\n", TRACE_SPANS);
+    fprintf(stderr, "-l LANE      Handle messages with the same LANE one at a time, in\n");
+    fprintf(stderr, "             order.  LANE is \"forum\" or \"sender\".\n");
+    fprintf(stderr, "-b CMDS      Send runs of server lines with the same one of the\n");
+    fprintf(stderr, "             comma-separated commands CMDS to one handler, on its\n");
+    fprintf(stderr, "             stdin, with $batch set to how many.\n");
+    fprintf(stderr, "-B MAX       At most MAX lines to a batch (default %d).\n", batch_max);
+    fprintf(stderr, "-L MS        Start a batch at most MS milliseconds after its first\n");
+    fprintf(stderr, "             line came in (default %d).\n", (int)(batch_linger / 1000));
 }
 
 int
 main(int argc, char *argv[])
 {
+    int i;
+
     /*
      * Parse command line 
      */
     while (!handler) {
-        switch (getopt(argc, argv, "hd:i:")) {
+        switch (getopt(argc, argv, "hd:s:i:l:T:p:b:B:L:")) {
             case -1:
                 if (optind >= argc) {
                     fprintf(stderr, "error: must specify event handler.\n");
@@ -424,6 +1256,56 @@ main(int argc, char *argv[])
             case 'd':
                 msgdir = optarg;
                 break;
+            case 's':
+                sockpath = optarg;
+                break;
+            case 'T':
+                trace_file = optarg;
+                break;
+            case 'p':
+                if (MAX_PLUGINS == nplugins) {
+                    fprintf(stderr, "error: too many plugins\n");
+                    return EX_USAGE;
+                }
+                plugins[nplugins++].path = optarg;
+                break;
+            case 'l':
+                if (0 == strcmp(optarg, "forum")) {
+                    lane_by = LANE_FORUM;
+                } else if (0 == strcmp(optarg, "sender")) {
+                    lane_by = LANE_SENDER;
+                } else {
+                    fprintf(stderr, "error: lane must be forum or sender: %s\n", optarg);
+                    return EX_USAGE;
+                }
+                break;
+            case 'b':
+                batch_cmds = optarg;
+                break;
+            case 'B':
+                {
+                    char *end;
+                    long int n = strtol(optarg, &end, 10);
+
+                    if (*end || (n < 1)) {
+                        fprintf(stderr, "error: not a positive integer: %s\n", optarg);
+                        return EX_USAGE;
+                    }
+                    batch_max = n;
+                }
+                break;
+            case 'L':
+                {
+                    char *end;
+                    long int n = strtol(optarg, &end, 10);
+
+                    if (*end || (n < 1)) {
+                        fprintf(stderr, "error: not a positive integer: %s\n", optarg);
+                        return EX_USAGE;
+                    }
+                    batch_linger = n * 1000;
+                }
+                break;
             case 'i':
                 {
                     char *end;
@@ -463,6 +1345,27 @@ main(int argc, char *argv[])
     setvbuf(stdout, NULL, _IOLBF, 0);
 
     signal(SIGCHLD, sigchld);
+    if (trace_file) {
+        signal(SIGUSR1, sigusr1);
+    }
+    next_trace = (uint64_t)time(NULL) << 32;
+    for (i = 0; i < MAX_SUBPROCS; i += 1) {
+        execfds[i] = -1;
+    }
+
+    if (sockpath && (-1 == (listener = listen_socket(sockpath)))) {
+        return EX_UNAVAILABLE;
+    }
+
+    for (i = 0; i < nplugins; i += 1) {
+        load_plugin(&plugins[i]);
+        if (! plugins[i].p) {
+            return EX_SOFTWARE;
+        }
+    }
+    if (nplugins) {
+        signal(SIGHUP, sighup);
+    }
 
     // Let handler know we're starting up
     dispatch("_INIT_");
@@ -473,6 +1376,13 @@ main(int argc, char *argv[])
 
     // Let handler know we're shutting down
     dispatch("_END_");
+    for (i = 0; i < nplugins; i += 1) {
+        unload_plugin(&plugins[i]);
+    }
+
+    if (sockpath) {
+        unlink(sockpath);
+    }
 
     return 0;
 }
@@ -0,0 +1,136 @@
+#include <stdint.h>
+#include <string.h>
+#include "casefold.h"
+#include "casefold_table.h"
+
+#define ONES  0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+
+/* Lowercase 8 ASCII bytes at once.
+ *
+ * With no high bits set, adding to a byte can't carry into the next one,
+ * so each byte's high bit ends up saying whether it was >= 'A', or > 'Z'.
+ */
+static uint64_t
+fold_ascii8(uint64_t w)
+{
+    uint64_t ge_a = w + ONES * (0x80 - 'A');
+    uint64_t gt_z = w + ONES * (0x80 - 'Z' - 1);
+    uint64_t upper = ge_a & ~gt_z & HIGHS;
+
+    return w | (upper >> 2);
+}
+
+static uint32_t
+fold_cp(uint32_t cp)
+{
+    return cp + casefold_stage2[casefold_stage1[cp / CASEFOLD_BLOCK]][cp % CASEFOLD_BLOCK];
+}
+
+/* Decode one UTF-8 character, returning its length, or 0 if it's not valid */
+static size_t
+decode(const uint8_t *s, size_t len, uint32_t *cp)
+{
+    size_t n;
+    uint32_t min;
+    size_t i;
+
+    if (s[0] < 0xc2) {
+        return 0;
+    } else if (s[0] < 0xe0) {
+        n = 2;
+        min = 0x80;
+        *cp = s[0] & 0x1f;
+    } else if (s[0] < 0xf0) {
+        n = 3;
+        min = 0x800;
+        *cp = s[0] & 0x0f;
+    } else if (s[0] < 0xf5) {
+        n = 4;
+        min = 0x10000;
+        *cp = s[0] & 0x07;
+    } else {
+        return 0;
+    }
+    if (n > len) {
+        return 0;
+    }
+    for (i = 1; i < n; i += 1) {
+        if ((s[i] & 0xc0) != 0x80) {
+            return 0;
+        }
+        *cp = (*cp << 6) | (s[i] & 0x3f);
+    }
+    if ((*cp < min) || (*cp > 0x10ffff) || ((*cp >= 0xd800) && (*cp < 0xe000))) {
+        return 0;
+    }
+
+    return n;
+}
+
+static size_t
+encode(uint8_t *d, uint32_t cp)
+{
+    if (cp < 0x80) {
+        d[0] = cp;
+        return 1;
+    } else if (cp < 0x800) {
+        d[0] = 0xc0 | (cp >> 6);
+        d[1] = 0x80 | (cp & 0x3f);
+        return 2;
+    } else if (cp < 0x10000) {
+        d[0] = 0xe0 | (cp >> 12);
+        d[1] = 0x80 | ((cp >> 6) & 0x3f);
+        d[2] = 0x80 | (cp & 0x3f);
+        return 3;
+    }
+    d[0] = 0xf0 | (cp >> 18);
+    d[1] = 0x80 | ((cp >> 12) & 0x3f);
+    d[2] = 0x80 | ((cp >> 6) & 0x3f);
+    d[3] = 0x80 | (cp & 0x3f);
+    return 4;
+}
+
+/* Apply Unicode simple case folding to the UTF-8 in src, into dst.
+ *
+ * dst must hold CASEFOLD_SIZE(len) bytes and not overlap src.  Bytes
+ * that aren't valid UTF-8 are copied as they are.  Returns the folded
+ * length.
+ */
+size_t
+casefold(char *dst, const char *src, size_t len)
+{
+    const uint8_t *s = (const uint8_t *)src;
+    uint8_t *d = (uint8_t *)dst;
+    size_t i = 0;
+    size_t o = 0;
+
+    while (i < len) {
+        uint32_t cp;
+        size_t n;
+
+        if (i + 8 <= len) {
+            uint64_t w;
+
+            memcpy(&w, s + i, 8);
+            if (0 == (w & HIGHS)) {
+                w = fold_ascii8(w);
+                memcpy(d + o, &w, 8);
+                i += 8;
+                o += 8;
+                continue;
+            }
+        }
+        if (s[i] < 0x80) {
+            d[o++] = s[i] | ((s[i] >= 'A') && (s[i] <= 'Z') ? 0x20 : 0);
+            i += 1;
+        } else if ((n = decode(s + i, len - i, &cp))) {
+            o += encode(d + o, fold_cp(cp));
+            i += n;
+        } else {
+            d[o++] = s[i++];
+        }
+    }
+
+    return o;
+}
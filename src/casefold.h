@@ -0,0 +1,13 @@
+#ifndef __CASEFOLD_H__
+#define __CASEFOLD_H__
+
+#include <stddef.h>
+
+/* Room casefold() may need for len bytes: folding never more than
+ * stretches a 2-byte character to 3.
+ */
+#define CASEFOLD_SIZE(len) ((len) + (len) / 2 + 1)
+
+size_t casefold(char *dst, const char *src, size_t len);
+
+#endif
@@ -1,7 +1,13 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "cdb.h"
+#include "siphash.h"
+#include "lz.h"
 
 /*
  *
@@ -18,171 +24,1038 @@
  * THE END
  */
 
+/* Reading through one FILE's position meant one reader at a time, so
+ * reads now go through the file mapping, or pread() if it can't be
+ * mapped.  The FILE interface is kept, on top.
+ */
+
 #ifndef min
 #define min(a,b) ((a)<(b)?(a):(b))
 #endif
 
 static uint32_t
-hash(char *s, size_t len)
+hash(const struct cdb *db, const char *s, size_t len)
 {
     uint32_t h = 5381;
     size_t i;
 
+    if (db->flags & CDB_F_SEEDED) {
+        return (uint32_t)siphash(db->seed, s, len);
+    }
     for (i = 0; i < len; i += 1) {
         h = ((h << 5) + h) ^ s[i];
     }
     return h;
 }
 
-static uint32_t
-read_u32le(FILE *f)
+/* Which bits of the bloom filter h sets: block, then a bit in it per probe.
+ * cdbmake.c uses this too, so readers and the writer agree.
+ */
+uint32_t
+cdb_bloom_bits(uint32_t h, uint32_t nblocks, uint16_t bits[CDB_BLOOM_K])
 {
-    uint8_t d[4];
+    uint32_t x = h;
+    uint32_t step;
+    int i;
 
-    if (0 == fread(d, 4, 1, f)) {
-        return 0;
+    // Block from the high bits; probes from a scrambled copy
+    x ^= x >> 16;
+    x *= 0x85ebca6b;
+    x ^= x >> 13;
+    x *= 0xc2b2ae35;
+    x ^= x >> 16;
+    step = (x >> 9) | 1;
+    for (i = 0; i < CDB_BLOOM_K; i += 1) {
+        bits[i] = (x + i * step) & 511;
     }
+    return ((uint64_t)h * nblocks) >> 32;
+}
+
+static uint32_t
+u32le(const uint8_t *d)
+{
     return ((d[0] << 0) |
             (d[1] << 8) |
             (d[2] << 16) |
-            (d[3] << 24));
+            ((uint32_t)d[3] << 24));
 }
 
-static uint32_t
-read_buf(FILE *f, uint32_t fieldlen, char *buf, size_t buflen)
+static uint64_t
+u64le(const uint8_t *d)
 {
+    return u32le(d) | ((uint64_t)u32le(d + 4) << 32);
+}
 
-    uint32_t size = min(buflen, fieldlen);
-    size_t r = fread(buf, 1, (size_t)size, f);
+/* Bytes in a table slot, or a block directory entry */
+#define SLOT_SIZE(db) (((db)->flags & CDB_F_WIDE) ? 16 : 8)
+#define DIR_SIZE(db) (((db)->flags & CDB_F_WIDE) ? 8 : 4)
 
-    // Slurp up the rest
-    for (fieldlen -= r; fieldlen > 0; fieldlen -= 1) {
-        getc(f);
+/* Hash and record position in a table slot */
+static uint64_t
+slot_pos(const struct cdb *db, const uint8_t *slot, uint32_t *h)
+{
+    *h = u32le(slot);
+    if (db->flags & CDB_F_WIDE) {
+        return u64le(slot + 8);
     }
+    return u32le(slot + 4);
+}
+
+/* Copy up to len bytes at pos into buf, returning how many there were */
+static size_t
+get(const struct cdb *db, uint64_t pos, void *buf, size_t len)
+{
+    size_t got = 0;
 
-    return size;
+    if (db->map) {
+        if (pos >= db->size) {
+            return 0;
+        }
+        len = min(len, db->size - pos);
+        memcpy(buf, db->map + pos, len);
+        return len;
+    }
+
+    while (got < len) {
+        ssize_t r = pread(db->fd, (char *)buf + got, len - got, (off_t)pos + got);
+
+        if (r <= 0) {
+            break;
+        }
+        got += r;
+    }
+    return got;
 }
 
-void
-cdb_init(struct cdb_ctx *ctx, FILE *f)
+static uint32_t
+get_u32le(const struct cdb *db, uint64_t pos)
 {
-    ctx->f = f;
-    ctx->key = NULL;
-    ctx->hash_len = 1;
+    uint8_t d[4];
+
+    if (4 != get(db, pos, d, 4)) {
+        return 0;
+    }
+    return u32le(d);
+}
+
+/* Does the file have key at pos? */
+static int
+key_at(const struct cdb *db, uint64_t pos, const char *key, uint32_t keylen)
+{
+    uint8_t buf[256];
+    uint32_t done;
+
+    if (db->map) {
+        return (pos + (size_t)keylen <= db->size) &&
+            (0 == memcmp(db->map + pos, key, keylen));
+    }
+    for (done = 0; done < keylen; ) {
+        size_t n = min(sizeof(buf), keylen - done);
+
+        if ((n != get(db, pos + done, buf, n)) || memcmp(buf, key + done, n)) {
+            return 0;
+        }
+        done += n;
+    }
+    return 1;
 }
 
+/* Set up db to read the cdb open on fd, which it doesn't take over */
 int
-cdb_dump(struct cdb_ctx *ctx,
-        char *key, size_t *keylen,
-        char *val, size_t *vallen)
+cdb_open(struct cdb *db, int fd)
 {
-    // Set hash_len to 0 to signal we're in position
-    if (ctx->hash_len != 0) {
-        // Find out where to stop reading
-        int i;
+    uint8_t hdr[CDB_HDRLEN];
+    uint8_t ptrs[256 * 8];
+    uint64_t dict_pos = 0;
+    uint32_t dict_len = 0;
+    struct stat st;
+    int i;
 
-        fseek(ctx->f, 0, SEEK_SET);
-        ctx->hash_len = 0;
-        ctx->hash_pos = 0xffffffff;
-        for (i = 0; i < 256; i += 1) {
-            uint32_t p;
+    db->fd = fd;
+    db->map = NULL;
+    db->size = 0;
+    db->flags = 0;
+    db->hdrlen = 0;
+    memset(db->seed, 0, sizeof(db->seed));
+    db->bloom_pos = 0;
+    db->bloom_blocks = 0;
+    db->block_dir = 0;
+    db->nblocks = 0;
+    db->dict = NULL;
+    db->dict_len = 0;
 
-            p = read_u32le(ctx->f);
-            read_u32le(ctx->f);
-            if (p < ctx->hash_pos) {
-                ctx->hash_pos = p;
+    if (fstat(fd, &st)) {
+        st.st_size = 0;
+    }
+    if ((st.st_size > 0) && ((uint64_t)st.st_size <= SIZE_MAX)) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+        if (MAP_FAILED != map) {
+            db->map = (uint8_t *)map;
+            db->size = st.st_size;
+        }
+    }
+
+    if ((sizeof(hdr) == get(db, 0, hdr, sizeof(hdr))) &&
+            (0 == u32le(hdr + 0)) && (CDB_MAGIC == u32le(hdr + 4))) {
+        uint32_t version = u32le(hdr + 8);
+
+        db->flags = u32le(hdr + 12);
+        db->hdrlen = u32le(hdr + 16);
+        memcpy(db->seed, hdr + 20, sizeof(db->seed));
+        if (db->flags & CDB_F_WIDE) {
+            db->bloom_pos = u64le(hdr + 36);
+            dict_pos = u64le(hdr + 44);
+            db->bloom_blocks = u32le(hdr + 52);
+            db->nblocks = u32le(hdr + 56);
+            dict_len = u32le(hdr + 60);
+            db->block_dir = st.st_size - (db->nblocks + 1) * (uint64_t)8;
+        } else {
+            db->bloom_pos = u32le(hdr + 36);
+            db->bloom_blocks = u32le(hdr + 40);
+            db->block_dir = u32le(hdr + 44);
+            db->nblocks = u32le(hdr + 48);
+            dict_pos = u32le(hdr + 52);
+            dict_len = u32le(hdr + 56);
+        }
+        if ((version > CDB_VERSION) || (db->flags & ~CDB_F_ALL) ||
+                ((db->flags & CDB_F_WIDE) && (st.st_size <= 0))) {
+            cdb_close(db);
+            return -1;
+        }
+        if ((db->flags & CDB_F_COMPRESSED) && dict_len) {
+            uint32_t len = dict_len;
+
+            if (db->map) {
+                db->dict = db->map + dict_pos;
+                len = (dict_pos + len <= db->size) ? len : 0;
+            } else if ((db->dict = (uint8_t *)malloc(len))) {
+                len = get(db, dict_pos, db->dict, len);
+            } else {
+                len = 0;
             }
+            db->dict_len = len;
         }
+    }
 
-        ctx->entry = 256 * 8;
-        fseek(ctx->f, ctx->entry, SEEK_SET);
-    } 
-    
-    // Stop if we've reached the end
-    if (ctx->entry >= ctx->hash_pos) {
-        return EOF;
+    memset(ptrs, 0, sizeof(ptrs));
+    get(db, db->hdrlen, ptrs, sizeof(ptrs));
+    if (db->flags & CDB_F_WIDE) {
+        uint64_t end = st.st_size;
+
+        // Each table runs up to the next thing in the file
+        if (db->bloom_pos) {
+            end = db->bloom_pos;
+        } else if (db->flags & CDB_F_COMPRESSED) {
+            end = dict_pos;
+        }
+        for (i = 255; i >= 0; i -= 1) {
+            uint64_t pos = u64le(ptrs + i*8);
+
+            db->tables[i][0] = pos;
+            db->tables[i][1] = (end > pos) ? (end - pos) / 16 : 0;
+            end = pos;
+        }
+        db->records_end = db->tables[0][0];
+    } else {
+        db->records_end = 0xffffffff;
+        for (i = 0; i < 256; i += 1) {
+            db->tables[i][0] = u32le(ptrs + i*8 + 0);
+            db->tables[i][1] = u32le(ptrs + i*8 + 4);
+            if (db->tables[i][0] < db->records_end) {
+                db->records_end = db->tables[i][0];
+            }
+        }
     }
 
-    // Read the two buffers
-    {
-       uint32_t klen = read_u32le(ctx->f);
-       uint32_t vlen = read_u32le(ctx->f);
+    return 0;
+}
 
-       *keylen = read_buf(ctx->f, klen, key, *keylen);
-       *vallen = read_buf(ctx->f, vlen, val, *vallen);
+void
+cdb_close(struct cdb *db)
+{
+    if (db->map) {
+        munmap(db->map, db->size);
+        db->map = NULL;
+    } else {
+        free(db->dict);
+    }
+    db->dict = NULL;
+}
+
+/* Could the key with hash h be in here? */
+static int
+maybe_present(const struct cdb *db, uint32_t h)
+{
+    uint8_t block[64];
+    uint16_t bits[CDB_BLOOM_K];
+    uint32_t b;
+    int i;
+
+    if (! (db->flags & CDB_F_BLOOM)) {
+        return 1;
+    }
+    if (0 == db->bloom_blocks) {
+        // No filter was written after all: can't rule anything out
+        return 1;
+    }
+    b = cdb_bloom_bits(h, db->bloom_blocks, bits);
+    if (sizeof(block) != get(db, db->bloom_pos + (uint64_t)b * 64, block, sizeof(block))) {
+        return 1;
+    }
+    for (i = 0; i < CDB_BLOOM_K; i += 1) {
+        if (! (block[bits[i] / 8] & (1 << (bits[i] % 8)))) {
+            return 0;
+        }
+    }
 
-        ctx->entry += 4 + 4 + klen + vlen;
+    return 1;
+}
+
+/* Decompress block n into the cursor, unless it's already there */
+static int
+load_block(struct cdb_cursor *cur, uint32_t n)
+{
+    const struct cdb *db = cur->db;
+    uint8_t d[16];
+    uint64_t pos;
+    uint64_t end;
+    uint8_t *z;
+    uint32_t zlen;
+    uint32_t rawlen;
+    size_t got;
+
+    if (cur->block && (cur->block_no == n)) {
+        return 0;
+    }
+    if ((n >= db->nblocks) ||
+            (2 * DIR_SIZE(db) != get(db, db->block_dir + (uint64_t)n * DIR_SIZE(db), d, 2 * DIR_SIZE(db)))) {
+        return -1;
     }
+    if (db->flags & CDB_F_WIDE) {
+        pos = u64le(d);
+        end = u64le(d + 8);
+    } else {
+        pos = u32le(d);
+        end = u32le(d + 4);
+    }
+    if ((end < pos + 4) || (end - pos > 0xffffffff)) {
+        return -1;
+    }
+    zlen = end - pos - 4;
+    rawlen = get_u32le(db, pos);
+
+    if (rawlen > cur->block_size) {
+        uint8_t *p = (uint8_t *)realloc(cur->block, rawlen);
+
+        if (! p) {
+            return -1;
+        }
+        cur->block = p;
+        cur->block_size = rawlen;
+    }
+    cur->block_no = 0xffffffff;
+
+    if (db->map && (end <= db->size)) {
+        got = lz_decompress(db->dict, db->dict_len,
+                db->map + pos + 4, zlen, cur->block, rawlen);
+    } else {
+        if (! (z = (uint8_t *)malloc(zlen + 1))) {
+            return -1;
+        }
+        got = get(db, pos + 4, z, zlen);
+        got = lz_decompress(db->dict, db->dict_len, z, got, cur->block, rawlen);
+        free(z);
+    }
+    if (got != rawlen) {
+        return -1;
+    }
+    cur->block_no = n;
+    cur->block_len = rawlen;
 
     return 0;
 }
 
+/* Point the cursor at the data of the record at pos.  A compressed
+ * record's block isn't decompressed until something reads from it.
+ */
+static int
+load_data(struct cdb_cursor *cur, uint64_t pos, uint32_t klen, uint32_t dlen)
+{
+    uint8_t stub[12];
+
+    cur->data_pos = pos + 8 + klen;
+    cur->data_len = dlen;
+    if (! (cur->db->flags & CDB_F_COMPRESSED)) {
+        return 0;
+    }
+
+    if ((sizeof(stub) != dlen) ||
+            (sizeof(stub) != get(cur->db, cur->data_pos, stub, sizeof(stub)))) {
+        cur->data_len = 0;
+        return -1;
+    }
+    cur->data_block = u32le(stub);
+    cur->data_pos = u32le(stub + 4);
+    cur->data_len = u32le(stub + 8);
+
+    return 0;
+}
+
+/* Copy up to len bytes from offset off in the cursor's record data */
+static uint32_t
+data_get(struct cdb_cursor *cur, uint32_t off, void *buf, size_t len)
+{
+    if (off >= cur->data_len) {
+        return 0;
+    }
+    len = min(len, cur->data_len - off);
+    if (cur->db->flags & CDB_F_COMPRESSED) {
+        if (load_block(cur, cur->data_block) ||
+                ((uint64_t)cur->data_pos + cur->data_len > cur->block_len)) {
+            return 0;
+        }
+        memcpy(buf, cur->block + cur->data_pos + off, len);
+        return len;
+    }
+    return get(cur->db, cur->data_pos + off, buf, len);
+}
+
+static uint32_t
+data_u32le(struct cdb_cursor *cur, uint32_t off)
+{
+    uint8_t d[4];
+
+    if (4 != data_get(cur, off, d, 4)) {
+        return 0;
+    }
+    return u32le(d);
+}
+
+/* Offset and length of member n of the group in the cursor's record data */
+static uint32_t
+member(struct cdb_cursor *cur, uint32_t n, uint32_t *len)
+{
+    uint8_t d[8];
+
+    if (8 != data_get(cur, 4 + (n * 4), d, 8)) {
+        *len = 0;
+        return 0;
+    }
+    *len = u32le(d + 4) - u32le(d);
+    return u32le(d);
+}
+
 void
-cdb_find(struct cdb_ctx *ctx, char *key, size_t keylen)
+cdb_cursor_init(struct cdb_cursor *cur, const struct cdb *db)
 {
-    ctx->key = key;
-    ctx->keylen = keylen;
+    memset(cur, 0, sizeof(*cur));
+    cur->db = db;
+}
 
-    ctx->hash_val = hash(key, keylen);
+/* Free the cursor's block buffer, if it grew one */
+void
+cdb_cursor_fini(struct cdb_cursor *cur)
+{
+    free(cur->block);
+    cur->block = NULL;
+    cur->block_size = 0;
+}
 
-    // Read pointer
-    fseek(ctx->f, (ctx->hash_val % 256) * 8, SEEK_SET);
-    ctx->hash_pos = read_u32le(ctx->f);
-    ctx->hash_len = read_u32le(ctx->f);
+void
+cdb_cursor_find(struct cdb_cursor *cur, const char *key, size_t keylen)
+{
+    const struct cdb *db = cur->db;
+
+    cur->key = key;
+    cur->keylen = keylen;
+    cur->group_count = 0;
+    cur->group_idx = 0;
+    cur->probes = 0;
+    cur->hash_len = 0;
+
+    cur->hash_val = hash(db, key, keylen);
+    if (! maybe_present(db, cur->hash_val)) {
+        return;
+    }
 
-    if (ctx->hash_len > 0) {
-        ctx->entry = (ctx->hash_val / 256) % ctx->hash_len;
+    cur->hash_pos = db->tables[cur->hash_val % 256][0];
+    cur->hash_len = db->tables[cur->hash_val % 256][1];
+    if (cur->hash_len > 0) {
+        cur->entry = (cur->hash_val / 256) % cur->hash_len;
     }
 }
 
-uint32_t
-cdb_next(struct cdb_ctx *ctx, char *buf, size_t buflen)
+/* Advance to the next record for our key, and load its data */
+static int
+next_record(struct cdb_cursor *cur)
 {
-    uint32_t hashval;
-    uint32_t entry_pos;
-    uint32_t klen;
-    uint32_t dlen;
+    const struct cdb *db = cur->db;
 
-    for (; ctx->hash_len > 0;) {
-        fseek(ctx->f, ctx->hash_pos + (ctx->entry * 8), SEEK_SET);
-        ctx->entry = (ctx->entry + 1) % ctx->hash_len;
+    for (; cur->probes < cur->hash_len; cur->probes += 1) {
+        uint8_t slot[16];
+        uint8_t rec[8];
+        uint64_t entry_pos;
+        uint32_t h;
 
-        hashval = read_u32le(ctx->f);
-        entry_pos = read_u32le(ctx->f);
+        if (SLOT_SIZE(db) != get(db, cur->hash_pos + (uint64_t)cur->entry * SLOT_SIZE(db), slot, SLOT_SIZE(db))) {
+            break;
+        }
+        cur->entry = (cur->entry + 1) % cur->hash_len;
+
+        entry_pos = slot_pos(db, slot, &h);
         if (entry_pos == 0) {
             break;
         }
-        if (hashval != ctx->hash_val) {
+        if (h != cur->hash_val) {
+            continue;
+        }
+
+        if ((8 != get(db, entry_pos, rec, 8)) || (u32le(rec) != cur->keylen)) {
             continue;
         }
+        if (key_at(db, entry_pos + 8, cur->key, cur->keylen)) {
+            cur->probes += 1;
+            load_data(cur, entry_pos, cur->keylen, u32le(rec + 4));
+            return 1;
+        }
+    }
+    cur->probes = cur->hash_len;
 
-        fseek(ctx->f, entry_pos, SEEK_SET);
-        klen = read_u32le(ctx->f);
-        dlen = read_u32le(ctx->f);
+    return 0;
+}
 
-        if (klen == ctx->keylen) {
-            uint32_t i;
+/* Step into the next group for our key */
+static int
+next_group(struct cdb_cursor *cur)
+{
+    if (! next_record(cur)) {
+        return 0;
+    }
+    cur->group_count = data_u32le(cur, 0);
+    cur->group_idx = 0;
 
-            for (i = 0; i < klen; i += 1) {
-                int c = fgetc(ctx->f);
+    return 1;
+}
 
-                if (c != ctx->key[i]) {
-                    break;
-                }
+uint32_t
+cdb_cursor_next(struct cdb_cursor *cur, char *buf, size_t buflen)
+{
+    uint32_t off = 0;
+    uint32_t len;
+
+    if (cur->db->flags & CDB_F_GROUPED) {
+        while (cur->group_idx >= cur->group_count) {
+            if (! next_group(cur)) {
+                return 0;
+            }
+        }
+        off = member(cur, cur->group_idx++, &len);
+    } else if (next_record(cur)) {
+        len = cur->data_len;
+    } else {
+        return 0;
+    }
+
+    if (buf) {
+        return data_get(cur, off, buf, min(buflen, len));
+    } else {
+        return len;
+    }
+}
+
+/* How many values the cursor's key has.
+ *
+ * Grouped files keep one record per key, so this is a single probe.
+ * Leaves the cursor back at the first value.
+ */
+uint32_t
+cdb_cursor_count(struct cdb_cursor *cur)
+{
+    uint32_t n = 0;
+
+    if (cur->db->flags & CDB_F_GROUPED) {
+        while (next_group(cur)) {
+            n += cur->group_count;
+        }
+    } else {
+        while (next_record(cur)) {
+            n += 1;
+        }
+    }
+    cdb_cursor_find(cur, cur->key, cur->keylen);
+
+    return n;
+}
+
+/* Read value n (from 0) of the cursor's key.
+ *
+ * cdb_cursor_next() carries on from the value after it.
+ */
+uint32_t
+cdb_cursor_nth(struct cdb_cursor *cur, uint32_t n, char *buf, size_t buflen)
+{
+    cdb_cursor_find(cur, cur->key, cur->keylen);
+
+    if (cur->db->flags & CDB_F_GROUPED) {
+        while (next_group(cur)) {
+            if (n < cur->group_count) {
+                uint32_t off;
+                uint32_t len;
+
+                cur->group_idx = n + 1;
+                off = member(cur, n, &len);
+                return buf ? data_get(cur, off, buf, min(buflen, len)) : len;
+            }
+            n -= cur->group_count;
+        }
+        cur->group_idx = cur->group_count;
+        return 0;
+    }
+
+    for (; n > 0; n -= 1) {
+        if (! next_record(cur)) {
+            return 0;
+        }
+    }
+    return cdb_cursor_next(cur, buf, buflen);
+}
+
+/*
+ * Batch lookup
+ *
+ * Probes are done in table order and records read in file order, so
+ * a batch of keys sweeps through the file once instead of seeking all
+ * over it.  A key that appears twice is looked up twice.
+ */
+
+struct many_probe {
+    size_t which;
+    uint32_t hash_val;
+    uint64_t slot_pos;
+};
+
+struct many_hit {
+    size_t which;
+    uint32_t seq;               // Order among which's records
+    uint64_t pos;               // Record, then value
+    uint32_t len;
+    uint32_t member;
+};
+
+static int
+cmp_probes(const void *a, const void *b)
+{
+    const struct many_probe *pa = (const struct many_probe *)a;
+    const struct many_probe *pb = (const struct many_probe *)b;
+
+    return (pa->slot_pos > pb->slot_pos) - (pa->slot_pos < pb->slot_pos);
+}
+
+static int
+cmp_hit_pos(const void *a, const void *b)
+{
+    const struct many_hit *ha = (const struct many_hit *)a;
+    const struct many_hit *hb = (const struct many_hit *)b;
+
+    return (ha->pos > hb->pos) - (ha->pos < hb->pos);
+}
+
+static int
+cmp_hit_order(const void *a, const void *b)
+{
+    const struct many_hit *ha = (const struct many_hit *)a;
+    const struct many_hit *hb = (const struct many_hit *)b;
+
+    if (ha->which != hb->which) {
+        return (ha->which > hb->which) - (ha->which < hb->which);
+    }
+    if (ha->seq != hb->seq) {
+        return (ha->seq > hb->seq) - (ha->seq < hb->seq);
+    }
+    return (ha->member > hb->member) - (ha->member < hb->member);
+}
+
+/* Make room for one more hit */
+static int
+more_hits(struct many_hit **hits, size_t n, size_t *size)
+{
+    if (n == *size) {
+        size_t newsize = *size ? *size * 2 : 64;
+        struct many_hit *p = (struct many_hit *)realloc(*hits, newsize * sizeof(struct many_hit));
+
+        if (! p) {
+            return -1;
+        }
+        *hits = p;
+        *size = newsize;
+    }
+    return 0;
+}
+
+/* Every record whose slot matches p's hash, in probe order */
+static int
+probe_slots(const struct cdb *db, struct many_probe *p,
+        struct many_hit **hits, size_t *nhits, size_t *size)
+{
+    const uint64_t *table = db->tables[p->hash_val % 256];
+    uint32_t slotsize = SLOT_SIZE(db);
+    uint32_t entry = (p->slot_pos - table[0]) / slotsize;
+    uint8_t slots[16 * 16];
+    uint32_t base = 0;
+    uint32_t have = 0;
+    uint32_t seq = 0;
+    uint32_t i;
+
+    for (i = 0; i < table[1]; i += 1) {
+        uint8_t *slot;
+        uint64_t pos;
+        uint32_t h;
+
+        if ((entry < base) || (entry >= base + have)) {
+            base = entry;
+            have = get(db, table[0] + (uint64_t)entry * slotsize, slots,
+                    min(16 * (size_t)slotsize, (size_t)(table[1] - entry) * slotsize)) / slotsize;
+            if (0 == have) {
+                return 0;
             }
+        }
+        slot = slots + (entry - base) * slotsize;
+        entry = (entry + 1) % table[1];
+
+        if (0 == (pos = slot_pos(db, slot, &h))) {
+            break;
+        }
+        if (h != p->hash_val) {
+            continue;
+        }
+        if (more_hits(hits, *nhits, size)) {
+            return -1;
+        }
+        (*hits)[*nhits].which = p->which;
+        (*hits)[*nhits].seq = seq++;
+        (*hits)[*nhits].pos = pos;
+        (*hits)[*nhits].member = 0;
+        *nhits += 1;
+    }
+    return 0;
+}
+
+/* Look up keys[0] through keys[nkeys - 1] all at once.
+ *
+ * fn gets every value, grouped by key in the order keys were given, and
+ * each key's values in the order cdb_cursor_next() would return them.
+ * Returns -1 if it ran out of memory.
+ */
+int
+cdb_find_many(const struct cdb *db, size_t nkeys,
+        char **keys, size_t *keylens,
+        cdb_many_fn fn, void *arg)
+{
+    struct cdb_cursor cur;
+    struct many_probe *probes;
+    struct many_hit *hits = NULL;
+    size_t nhits = 0;
+    size_t hitsize = 0;
+    struct many_hit *vals = NULL;
+    size_t nvals = 0;
+    size_t valsize = 0;
+    char *buf = NULL;
+    size_t bufsize = 0;
+    size_t buflen = 0;
+    int copy = (! db->map) || (db->flags & CDB_F_COMPRESSED);
+    size_t nprobes = 0;
+    uint32_t n = 0;
+    size_t i;
+    int ret = -1;
+
+    if (! (probes = (struct many_probe *)malloc((nkeys + 1) * sizeof(struct many_probe)))) {
+        return -1;
+    }
+    cdb_cursor_init(&cur, db);
+
+    for (i = 0; i < nkeys; i += 1) {
+        uint32_t h = hash(db, keys[i], keylens[i]);
+        const uint64_t *table = db->tables[h % 256];
+
+        if ((0 == table[1]) || ! maybe_present(db, h)) {
+            continue;
+        }
+        probes[nprobes].which = i;
+        probes[nprobes].hash_val = h;
+        probes[nprobes].slot_pos = table[0] + ((h / 256) % table[1]) * SLOT_SIZE(db);
+        nprobes += 1;
+    }
+    qsort(probes, nprobes, sizeof(struct many_probe), cmp_probes);
 
-            if (i < klen) {
+    for (i = 0; i < nprobes; i += 1) {
+        if (probe_slots(db, &probes[i], &hits, &nhits, &hitsize)) {
+            goto done;
+        }
+    }
+    qsort(hits, nhits, sizeof(struct many_hit), cmp_hit_pos);
+
+    // Check keys and find values, in file order.  Values that aren't
+    // sitting in the map get copied into buf, while their block is loaded.
+    for (i = 0; i < nhits; i += 1) {
+        struct many_hit *h = &hits[i];
+        uint8_t rec[8];
+        uint32_t count = 1;
+        uint32_t m;
+
+        if ((8 != get(db, h->pos, rec, 8)) ||
+                (u32le(rec) != keylens[h->which]) ||
+                ! key_at(db, h->pos + 8, keys[h->which], keylens[h->which]) ||
+                load_data(&cur, h->pos, u32le(rec), u32le(rec + 4))) {
+            continue;
+        }
+        if (db->flags & CDB_F_GROUPED) {
+            count = data_u32le(&cur, 0);
+        }
+        for (m = 0; m < count; m += 1) {
+            struct many_hit *v;
+            uint32_t off = 0;
+            uint32_t len = cur.data_len;
+
+            if (more_hits(&vals, nvals, &valsize)) {
+                goto done;
+            }
+            if (db->flags & CDB_F_GROUPED) {
+                off = member(&cur, m, &len);
+            }
+            v = &vals[nvals++];
+            *v = *h;
+            v->member = m;
+            v->len = len;
+            if (! copy) {
+                v->pos = cur.data_pos + off;
                 continue;
             }
 
-            if (buf) {
-                return read_buf(ctx->f, dlen, buf, buflen);
-            } else {
-                return dlen;
+            if (buflen + len > bufsize) {
+                size_t newsize = bufsize ? bufsize : 4096;
+                char *p;
+
+                while (newsize < buflen + len) {
+                    newsize *= 2;
+                }
+                if (! (p = (char *)realloc(buf, newsize))) {
+                    goto done;
+                }
+                buf = p;
+                bufsize = newsize;
             }
+            v->pos = buflen;
+            v->len = data_get(&cur, off, buf + buflen, len);
+            buflen += v->len;
         }
     }
+    qsort(vals, nvals, sizeof(struct many_hit), cmp_hit_order);
+
+    for (i = 0; i < nvals; i += 1) {
+        struct many_hit *v = &vals[i];
+        const char *val;
+
+        n = (i && (vals[i - 1].which == v->which)) ? n + 1 : 0;
+        if (copy) {
+            val = buf + v->pos;
+        } else {
+            val = (const char *)db->map + v->pos;
+        }
+        fn(v->which, n, val, v->len, arg);
+    }
+    ret = 0;
+
+  done:
+    cdb_cursor_fini(&cur);
+    free(buf);
+    free(vals);
+    free(hits);
+    free(probes);
+
+    return ret;
+}
+
+/*
+ * FILE interface
+ */
+
+int
+cdb_init(struct cdb_ctx *ctx, FILE *f)
+{
+    ctx->f = f;
+    ctx->dump_end = 0;
+    if (cdb_open(&ctx->db, fileno(f))) {
+        return -1;
+    }
+    cdb_cursor_init(&ctx->cur, &ctx->db);
+    cdb_cursor_init(&ctx->dump, &ctx->db);
 
     return 0;
 }
 
+/* Let go of what cdb_init() set up; f is still the caller's */
+void
+cdb_fini(struct cdb_ctx *ctx)
+{
+    cdb_cursor_fini(&ctx->cur);
+    cdb_cursor_fini(&ctx->dump);
+    cdb_close(&ctx->db);
+}
+
+/* Find the next key/value pair to dump, without moving past it.
+ * The value is at voff in the dump cursor's record data.
+ */
+static int
+dump_peek(struct cdb_ctx *ctx, uint32_t *klen, uint32_t *voff, uint32_t *vlen)
+{
+    const struct cdb *db = &ctx->db;
+
+    // dump_end is 0 until we're in position
+    if (ctx->dump_end == 0) {
+        ctx->dump_end = db->records_end;
+        ctx->dump_pos = db->hdrlen + 256 * 8;
+        ctx->dump_idx = 0;
+    }
+
+    for (;;) {
+        uint8_t rec[8];
+        uint32_t dlen;
+
+        // Stop if we've reached the end
+        if ((ctx->dump_pos >= ctx->dump_end) || (8 != get(db, ctx->dump_pos, rec, 8))) {
+            return EOF;
+        }
+        *klen = u32le(rec);
+        dlen = u32le(rec + 4);
+        ctx->dump_next = ctx->dump_pos + 4 + 4 + *klen + dlen;
+        load_data(&ctx->dump, ctx->dump_pos, *klen, dlen);
+
+        if (! (db->flags & CDB_F_GROUPED)) {
+            *voff = 0;
+            *vlen = ctx->dump.data_len;
+            return 0;
+        }
+
+        // Groups hand out one value per call
+        ctx->dump.group_count = data_u32le(&ctx->dump, 0);
+        if (ctx->dump_idx < ctx->dump.group_count) {
+            *voff = member(&ctx->dump, ctx->dump_idx, vlen);
+            return 0;
+        }
+
+        ctx->dump_pos = ctx->dump_next;
+        ctx->dump_idx = 0;
+    }
+}
+
+static void
+dump_advance(struct cdb_ctx *ctx)
+{
+    if (ctx->db.flags & CDB_F_GROUPED) {
+        ctx->dump_idx += 1;
+        if (ctx->dump_idx < ctx->dump.group_count) {
+            return;
+        }
+    }
+    ctx->dump_pos = ctx->dump_next;
+    ctx->dump_idx = 0;
+}
+
+int
+cdb_dump(struct cdb_ctx *ctx,
+        char *key, size_t *keylen,
+        char *val, size_t *vallen)
+{
+    uint32_t klen;
+    uint32_t voff;
+    uint32_t vlen;
+
+    if (EOF == dump_peek(ctx, &klen, &voff, &vlen)) {
+        return EOF;
+    }
+
+    // Read the two buffers
+    *keylen = get(&ctx->db, ctx->dump_pos + 8, key, min(*keylen, klen));
+    *vallen = data_get(&ctx->dump, voff, val, min(*vallen, vlen));
+
+    dump_advance(ctx);
+
+    return 0;
+}
+
+/* Make sure *buf can hold len bytes */
+static int
+grow(char **buf, size_t *size, size_t len)
+{
+    if (len > *size) {
+        size_t newsize = *size ? *size : 256;
+        char *p;
+
+        while (newsize < len) {
+            newsize *= 2;
+        }
+        if (! (p = (char *)realloc(*buf, newsize))) {
+            return -1;
+        }
+        *buf = p;
+        *size = newsize;
+    }
+    return 0;
+}
+
+/* Like cdb_dump(), but never truncates.
+ *
+ * *key and *val are grown as needed, getline() style, and are
+ * NUL-terminated for convenience.
+ */
+int
+cdb_dump_full(struct cdb_ctx *ctx,
+        char **key, size_t *keysize, size_t *keylen,
+        char **val, size_t *valsize, size_t *vallen)
+{
+    uint32_t klen;
+    uint32_t voff;
+    uint32_t vlen;
+
+    if (EOF == dump_peek(ctx, &klen, &voff, &vlen)) {
+        return EOF;
+    }
+    if (grow(key, keysize, (size_t)klen + 1) || grow(val, valsize, (size_t)vlen + 1)) {
+        return EOF;
+    }
+
+    *keylen = get(&ctx->db, ctx->dump_pos + 8, *key, klen);
+    *vallen = data_get(&ctx->dump, voff, *val, vlen);
+    (*key)[*keylen] = '\0';
+    (*val)[*vallen] = '\0';
+
+    dump_advance(ctx);
+
+    return 0;
+}
+
+void
+cdb_find(struct cdb_ctx *ctx, char *key, size_t keylen)
+{
+    ctx->dump_end = 0;
+    cdb_cursor_find(&ctx->cur, key, keylen);
+}
+
+uint32_t
+cdb_next(struct cdb_ctx *ctx, char *buf, size_t buflen)
+{
+    return cdb_cursor_next(&ctx->cur, buf, buflen);
+}
+
+uint32_t
+cdb_count(struct cdb_ctx *ctx)
+{
+    return cdb_cursor_count(&ctx->cur);
+}
+
+uint32_t
+cdb_nth(struct cdb_ctx *ctx, uint32_t n, char *buf, size_t buflen)
+{
+    return cdb_cursor_nth(&ctx->cur, n, buf, buflen);
+}
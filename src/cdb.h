@@ -4,24 +4,182 @@
 #include <stdio.h>
 #include <stdint.h>
 
-struct cdb_ctx {
-    FILE *f;
+/*
+ * Extended format
+ *
+ * A classic cdb starts with 256 table pointers, the first of which is
+ * never less than 2048.  An extended file starts with a zero word
+ * instead, followed by this header; the table pointers begin at hdrlen.
+ *
+ *   0   u32  0
+ *   4   u32  CDB_MAGIC
+ *   8   u32  version
+ *   12  u32  flags
+ *   16  u32  hdrlen
+ *   20  u8   seed[16]          (CDB_F_SEEDED)
+ *   36  u32  bloom_pos         (CDB_F_BLOOM)
+ *   40  u32  bloom_blocks
+ *   44  u32  block_dir         (CDB_F_COMPRESSED)
+ *   48  u32  nblocks
+ *   52  u32  dict_pos
+ *   56  u32  dict_len
+ *
+ * CDB_F_WIDE files lay the same 64 bytes out differently, below.
+ */
+#define CDB_MAGIC 0x62646366        // "fcdb"
+#define CDB_VERSION 1
+#define CDB_HDRLEN 64
+
+/* Values for each key are stored together in one record, whose data is
+ *
+ *   u32 count
+ *   u32 offset[count + 1]      (from the start of the data)
+ *   values
+ */
+#define CDB_F_GROUPED 0x0001
+
+/* Keys are hashed with SipHash-2-4, keyed by the header's seed, instead
+ * of the classic unkeyed hash.  Since nobody outside can know the seed,
+ * nobody can pick keys that pile into one bucket and probe run.
+ */
+#define CDB_F_SEEDED 0x0002
+
+/* A blocked Bloom filter over every key's hash follows the tables.  Each
+ * key sets CDB_BLOOM_K bits in one 64-byte block, so a miss can usually
+ * be told from one cache line, without touching the tables.
+ */
+#define CDB_F_BLOOM 0x0004
+#define CDB_BLOOM_K 7
+
+/* Record data is a stub, pointing into a compressed block of values:
+ *
+ *   u32 block
+ *   u32 offset                 (in the decompressed block)
+ *   u32 length
+ *
+ * Blocks follow the tables (and bloom filter) and a dictionary trained
+ * on the first values written, and are found through a directory of
+ * nblocks + 1 positions at block_dir.  Each block is a u32 decompressed
+ * length, then the output of lz_compress() against the dictionary.
+ */
+#define CDB_F_COMPRESSED 0x0008
+
+/* Every position in the file is 64 bits, for files past 4GB:
+ *
+ *   36  u64  bloom_pos
+ *   44  u64  dict_pos
+ *   52  u32  bloom_blocks
+ *   56  u32  nblocks
+ *   60  u32  dict_len
+ *
+ * The 256 table pointers are just u64 positions, and each slot is a u64
+ * hash and a u64 position.  Tables are laid out one after another, so
+ * each one runs up to the next, and the last up to the bloom filter,
+ * dictionary, or end of file, whichever comes first.  The block
+ * directory is the last thing in the file, with u64 entries.  Record
+ * headers are still u32, so no one key or value can pass 4GB.
+ *
+ * Since that's the same size as a narrow header, cdbmake writes records
+ * the same way either way, and only goes wide if the file ends up past
+ * 4GB.
+ */
+#define CDB_F_WIDE 0x0010
+
+#define CDB_F_ALL (CDB_F_GROUPED | CDB_F_SEEDED | CDB_F_BLOOM | CDB_F_COMPRESSED | CDB_F_WIDE)
+
+/*
+ * Reentrant interface
+ *
+ * A struct cdb doesn't change after cdb_open(), so any number of threads
+ * can share one.  Each lookup keeps its place in its own cursor.
+ */
+struct cdb {
+    int fd;
+    uint8_t *map;               // Whole file, or NULL to use pread()
+    size_t size;
+
+    uint32_t flags;
+    uint32_t hdrlen;
+    uint8_t seed[16];
+    uint64_t bloom_pos;
+    uint32_t bloom_blocks;
+    uint64_t block_dir;
+    uint32_t nblocks;
+    uint8_t *dict;              // In the map, or our own copy
+    uint32_t dict_len;
+    uint64_t tables[256][2];    // Position and length of each table
+    uint64_t records_end;
+};
 
-    char *key;
+struct cdb_cursor {
+    const struct cdb *db;
+    const char *key;
     uint32_t keylen;
 
     uint32_t hash_val;
-    uint32_t hash_pos;
+    uint64_t hash_pos;
     uint32_t hash_len;
-
     uint32_t entry;
+    uint32_t probes;
+
+    // Current record's data: file position, or block and offset into it
+    uint32_t data_block;
+    uint64_t data_pos;
+    uint32_t data_len;
+
+    uint32_t group_count;
+    uint32_t group_idx;
+
+    // Last block decompressed, for CDB_F_COMPRESSED
+    uint8_t *block;
+    size_t block_size;
+    uint32_t block_no;
+    uint32_t block_len;
+};
+
+/* Called by cdb_find_many() for value n of keys[which] */
+typedef void (*cdb_many_fn)(size_t which, uint32_t n,
+        const char *val, uint32_t vallen, void *arg);
+
+int cdb_open(struct cdb *db, int fd);
+void cdb_close(struct cdb *db);
+void cdb_cursor_init(struct cdb_cursor *cur, const struct cdb *db);
+void cdb_cursor_fini(struct cdb_cursor *cur);
+void cdb_cursor_find(struct cdb_cursor *cur, const char *key, size_t keylen);
+uint32_t cdb_cursor_next(struct cdb_cursor *cur, char *buf, size_t buflen);
+uint32_t cdb_cursor_count(struct cdb_cursor *cur);
+uint32_t cdb_cursor_nth(struct cdb_cursor *cur, uint32_t n, char *buf, size_t buflen);
+uint32_t cdb_bloom_bits(uint32_t h, uint32_t nblocks, uint16_t bits[CDB_BLOOM_K]);
+int cdb_find_many(const struct cdb *db, size_t nkeys,
+        char **keys, size_t *keylens,
+        cdb_many_fn fn, void *arg);
+
+/*
+ * One-at-a-time interface, on a FILE
+ */
+struct cdb_ctx {
+    FILE *f;
+    struct cdb db;
+    struct cdb_cursor cur;
+    struct cdb_cursor dump;
+
+    uint64_t dump_pos;
+    uint64_t dump_end;          // 0 until the first cdb_dump()
+    uint64_t dump_next;
+    uint32_t dump_idx;
 };
 
-void cdb_init(struct cdb_ctx *ctx, FILE *f);
+int cdb_init(struct cdb_ctx *ctx, FILE *f);
+void cdb_fini(struct cdb_ctx *ctx);
 int cdb_dump(struct cdb_ctx *ctx,
         char *key, size_t *keylen,
         char *val, size_t *vallen);
+int cdb_dump_full(struct cdb_ctx *ctx,
+        char **key, size_t *keysize, size_t *keylen,
+        char **val, size_t *valsize, size_t *vallen);
 void cdb_find(struct cdb_ctx *ctx, char *key, size_t keylen);
 uint32_t cdb_next(struct cdb_ctx *ctx, char *buf, size_t buflen);
+uint32_t cdb_count(struct cdb_ctx *ctx);
+uint32_t cdb_nth(struct cdb_ctx *ctx, uint32_t n, char *buf, size_t buflen);
 
 #endif
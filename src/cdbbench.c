@@ -0,0 +1,752 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sysexits.h>
+#include "cdb.h"
+#include "cdbmake.h"
+
+int
+usage(char *self)
+{
+    fprintf(stderr, "Usage: %s [OPTIONS] FILE\n", self);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Build a throwaway database in FILE and report how fast that went,\n");
+    fprintf(stderr, "then how fast looking things up in it is.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "-n RECORDS  Number of records to add (default 1000000)\n");
+    fprintf(stderr, "-k KEYS     Number of distinct keys (default RECORDS / 4)\n");
+    fprintf(stderr, "-v BYTES    Length of each value (default 40)\n");
+    fprintf(stderr, "-V BYTES    Make values anywhere from -v to this long\n");
+    fprintf(stderr, "-C S        Spread values over keys Zipf-style, with exponent S\n");
+    fprintf(stderr, "-Z S        Look keys up Zipf-style, with exponent S\n");
+    fprintf(stderr, "-g          Build a grouped database\n");
+    fprintf(stderr, "-s          Hash keys with a random seed\n");
+    fprintf(stderr, "-z          Compress values\n");
+    fprintf(stderr, "-m KB       Spill record metadata to disk past KB kilobytes\n");
+    fprintf(stderr, "-o          Build with the original cdbmake writer, to compare against\n");
+    fprintf(stderr, "            (standard cdb format only, so not with -g, -s, -z or -m)\n");
+    fprintf(stderr, "-e          Use the database already in FILE instead of building one\n");
+    fprintf(stderr, "-l COUNT    Time COUNT lookups of each kind (default 100000, 0 for none)\n");
+    fprintf(stderr, "-r KEYS     Time lookups of the keys in this file, one per line,\n");
+    fprintf(stderr, "            instead of made-up ones\n");
+    fprintf(stderr, "-b KEYS     Then time lookups of KEYS keys at a time, one by one\n");
+    fprintf(stderr, "            and with cdb_find_many() (half of them misses)\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Results are one line per phase, of NAME=VALUE pairs.\n");
+
+    return EX_USAGE;
+}
+
+/* What to build and look up */
+struct workload {
+    unsigned long nrecords;
+    unsigned long nkeys;
+    size_t vallen;
+    size_t vallen_max;
+    double *counts;             // Share of values key n has is counts[n] - counts[n - 1]
+    double *cdf;                // Likewise for lookups
+    char *pool;                 // Values are cut from this
+    size_t poollen;
+    uint64_t rng;
+};
+
+static double
+elapsed(struct timeval *start)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) + (now.tv_usec - start->tv_usec) / 1e6;
+}
+
+static double
+now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static long
+peak_rss_kb(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+/* xorshift64*, so runs are repeatable everywhere */
+static uint64_t
+next_rand(struct workload *w)
+{
+    w->rng ^= w->rng >> 12;
+    w->rng ^= w->rng << 25;
+    w->rng ^= w->rng >> 27;
+    return w->rng * 0x2545f4914f6cdd1dull;
+}
+
+/* Cumulative shares of n keys: uniform when s is 0, else Zipf with
+ * exponent s, key 0 first
+ */
+static double *
+make_cdf(unsigned long n, double s)
+{
+    double *cdf = (double *)malloc(n * sizeof(double));
+    double total = 0;
+    unsigned long k;
+
+    if (! cdf) {
+        return NULL;
+    }
+    for (k = 0; k < n; k += 1) {
+        total += (s > 0) ? pow(k + 1, -s) : 1;
+        cdf[k] = total;
+    }
+    for (k = 0; k < n; k += 1) {
+        cdf[k] /= total;
+    }
+    cdf[n - 1] = 1;
+
+    return cdf;
+}
+
+static unsigned long
+pick_key(struct workload *w)
+{
+    double r = (next_rand(w) >> 11) / 9007199254740992.0;
+    unsigned long lo = 0;
+    unsigned long hi = w->nkeys - 1;
+
+    while (lo < hi) {
+        unsigned long mid = lo + (hi - lo) / 2;
+
+        if (w->cdf[mid] <= r) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Text made of words, so compressed databases see something like factoids */
+static int
+make_pool(struct workload *w)
+{
+    static const char *words[] = {
+        "the", "a", "is", "of", "and", "to", "in", "it", "you", "that",
+        "bot", "factoid", "database", "key", "value", "lookup", "channel",
+        "reply", "http://example.com/", "forget", "remember", "never",
+        "probably", "something", "everyone", "because", "really", "<reply>",
+        "<action>", "$who", "server", "network", "42", "2019", "!",
+    };
+    size_t nwords = sizeof(words) / sizeof(words[0]);
+    size_t len = 0;
+
+    w->poollen = 65536;
+    if (w->poollen < w->vallen_max * 2) {
+        w->poollen = w->vallen_max * 2;
+    }
+    if (! (w->pool = (char *)malloc(w->poollen + 32))) {
+        return -1;
+    }
+    while (len < w->poollen) {
+        const char *word = words[next_rand(w) % nwords];
+
+        len += sprintf(w->pool + len, "%s ", word);
+    }
+
+    return 0;
+}
+
+/*
+ * The original writer, before cdbmake was sped up: a realloc() for every
+ * record, a byte at a time through stdio, and one table after another.
+ * It writes the same file as cdbmake with no flags.
+ */
+struct old_record {
+    uint32_t hashval;
+    uint32_t offset;
+};
+
+struct old_cdbmake {
+    FILE *f;
+    struct old_record *records[256];
+    uint32_t nrecords[256];
+    long where;
+    int err;
+};
+
+static uint32_t
+old_hash(char *s, size_t len)
+{
+    uint32_t h = 5381;
+    size_t i;
+
+    for (i = 0; i < len; i += 1) {
+        h = ((h << 5) + h) ^ s[i];
+    }
+    return h;
+}
+
+static void
+old_write_u32le(FILE *f, uint32_t val)
+{
+    fputc((val >> 0)  & 0xff, f);
+    fputc((val >> 8)  & 0xff, f);
+    fputc((val >> 16) & 0xff, f);
+    fputc((val >> 24) & 0xff, f);
+}
+
+static void
+old_init(struct old_cdbmake *ctx, FILE *f)
+{
+    int i;
+
+    ctx->f = f;
+    for (i = 0; i < 256; i += 1) {
+        ctx->records[i] = NULL;
+        ctx->nrecords[i] = 0;
+    }
+    ctx->err = 0;
+    ctx->where = 256 * 8;
+    fseek(f, ctx->where, SEEK_SET);
+}
+
+static void
+old_add(struct old_cdbmake *ctx, char *key, size_t keylen, char *val, size_t vallen)
+{
+    uint32_t hashval = old_hash(key, keylen);
+    int idx = hashval % 256;
+    uint32_t n = ctx->nrecords[idx];
+    struct old_record *r;
+
+    r = (struct old_record *)realloc(ctx->records[idx], (n + 1) * sizeof(struct old_record));
+    if (! r) {
+        perror("realloc records");
+        ctx->err = 1;
+        return;
+    }
+    ctx->records[idx] = r;
+    ctx->nrecords[idx] = n + 1;
+    r[n].hashval = hashval;
+    r[n].offset = (uint32_t)ctx->where;
+
+    old_write_u32le(ctx->f, keylen);
+    old_write_u32le(ctx->f, vallen);
+    fwrite(key, 1, keylen, ctx->f);
+    fwrite(val, 1, vallen, ctx->f);
+
+    ctx->where += 4 + 4 + keylen + vallen;
+}
+
+static int
+old_finalize(struct old_cdbmake *ctx)
+{
+    int idx;
+
+    for (idx = 0; (idx < 256) && ! ctx->err; idx += 1) {
+        uint32_t tlen = ctx->nrecords[idx] * 2;
+        uint32_t *buf;
+        uint32_t r;
+        long offset;
+
+        offset = ftell(ctx->f);
+        fseek(ctx->f, idx * 8, SEEK_SET);
+        old_write_u32le(ctx->f, (uint32_t)offset);
+        old_write_u32le(ctx->f, tlen);
+        fseek(ctx->f, offset, SEEK_SET);
+
+        if (! (buf = (uint32_t *)calloc(tlen * 2 + 1, sizeof(uint32_t)))) {
+            perror("Allocating hash table");
+            ctx->err = 1;
+            break;
+        }
+        for (r = 0; r < ctx->nrecords[idx]; r += 1) {
+            uint32_t slot = (ctx->records[idx][r].hashval / 256) % tlen;
+
+            while (buf[slot * 2 + 1] > 0) {
+                slot = (slot + 1) % tlen;
+            }
+            buf[slot * 2 + 0] = ctx->records[idx][r].hashval;
+            buf[slot * 2 + 1] = ctx->records[idx][r].offset;
+        }
+        for (r = 0; r < tlen; r += 1) {
+            old_write_u32le(ctx->f, buf[r * 2 + 0]);
+            old_write_u32le(ctx->f, buf[r * 2 + 1]);
+        }
+        free(buf);
+    }
+    if (fflush(ctx->f) || ferror(ctx->f)) {
+        perror("Writing database");
+        ctx->err = 1;
+    }
+
+    for (idx = 0; idx < 256; idx += 1) {
+        free(ctx->records[idx]);
+        ctx->records[idx] = NULL;
+    }
+
+    return ctx->err ? -1 : 0;
+}
+
+/* Build the database, one key's values after another, with the original
+ * writer if old is set
+ */
+static int
+build(char *filename, struct workload *w, uint32_t flags, size_t budget, int old)
+{
+    unsigned long spread = w->nrecords - w->nkeys;
+    unsigned long before = 0;
+    struct cdbmake_ctx c;
+    struct old_cdbmake oc;
+    struct timeval start;
+    struct stat st;
+    double secs;
+    size_t bytes = 0;
+    unsigned long k;
+    int ret;
+    FILE *f;
+
+    f = fopen(filename, "wb");
+    if (! f) {
+        perror("Creating database");
+        return EX_CANTCREAT;
+    }
+
+    gettimeofday(&start, NULL);
+    if (old) {
+        old_init(&oc, f);
+    } else {
+        cdbmake_init(&c, f, flags);
+        if (budget) {
+            cdbmake_set_budget(&c, budget);
+        }
+    }
+    for (k = 0; k < w->nkeys; k += 1) {
+        // Every key gets one value, and the rest are shared out
+        unsigned long upto = k + 1 + (unsigned long)(spread * w->counts[k]);
+        char key[40];
+        int keylen;
+
+        keylen = snprintf(key, sizeof(key), "key %lu", k);
+        for (; before < upto; before += 1) {
+            size_t len = w->vallen;
+
+            if (w->vallen_max > w->vallen) {
+                len += next_rand(w) % (w->vallen_max - w->vallen + 1);
+            }
+            char *val = w->pool + next_rand(w) % (w->poollen - len + 1);
+
+            if (old) {
+                old_add(&oc, key, keylen, val, len);
+            } else {
+                cdbmake_add(&c, key, keylen, val, len);
+            }
+            bytes += 8 + keylen + len;
+        }
+    }
+    ret = old ? old_finalize(&oc) : cdbmake_finalize(&c);
+    if (fclose(f)) {
+        perror("Closing database");
+        ret = -1;
+    }
+    secs = elapsed(&start);
+    if (ret) {
+        fprintf(stderr, "Building database failed\n");
+        return EX_IOERR;
+    }
+
+    if (stat(filename, &st)) {
+        st.st_size = 0;
+    }
+    printf("phase=build writer=%s records=%lu keys=%lu vallen=%lu vallen_max=%lu seconds=%.3f "
+            "records_per_sec=%.0f mb_per_sec=%.1f file_bytes=%lu peak_rss_kb=%ld\n",
+            old ? "old" : "new", w->nrecords, w->nkeys, (unsigned long)w->vallen, (unsigned long)w->vallen_max,
+            secs, w->nrecords / secs, bytes / secs / (1 << 20),
+            (unsigned long)st.st_size, peak_rss_kb());
+
+    return 0;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+    double da = *(const double *)a;
+    double db = *(const double *)b;
+
+    return (da > db) - (da < db);
+}
+
+/* Print the distribution of n lookup times */
+static void
+report(const char *kind, double *us, size_t n)
+{
+    double total = 0;
+    size_t i;
+
+    if (0 == n) {
+        printf("phase=%s n=0\n", kind);
+        return;
+    }
+    qsort(us, n, sizeof(double), cmp_double);
+    for (i = 0; i < n; i += 1) {
+        total += us[i];
+    }
+    printf("phase=%s n=%lu mean_us=%.2f p50_us=%.2f p99_us=%.2f max_us=%.2f\n",
+            kind, (unsigned long)n, total / n,
+            us[n / 2], us[n * 99 / 100], us[n - 1]);
+}
+
+/* Read keys to replay, one per line */
+static char **
+read_keys(char *filename, size_t *nkeys)
+{
+    FILE *f = fopen(filename, "r");
+    char **keys = NULL;
+    size_t size = 0;
+    char *line = NULL;
+    size_t linesize = 0;
+    ssize_t len;
+
+    *nkeys = 0;
+    if (! f) {
+        perror("Opening replay keys");
+        return NULL;
+    }
+    while ((len = getline(&line, &linesize, f)) > 0) {
+        if ('\n' == line[len - 1]) {
+            line[len - 1] = '\0';
+        }
+        if (*nkeys == size) {
+            char **k;
+
+            size = size ? size * 2 : 1024;
+            if (! (k = (char **)realloc(keys, size * sizeof(char *)))) {
+                break;
+            }
+            keys = k;
+        }
+        keys[(*nkeys)++] = strdup(line);
+    }
+    free(line);
+    fclose(f);
+
+    return keys;
+}
+
+/* Time count lookups of each kind: every value of a key that's there,
+ * a key that isn't, and one randomly-picked value the way factoids does.
+ */
+static int
+latency(char *filename, struct workload *w, unsigned long count,
+        char **replay, size_t nreplay)
+{
+    struct cdb db;
+    struct cdb_cursor cur;
+    double *times[3];
+    size_t n[3] = {0, 0, 0};
+    unsigned long i;
+    int fd;
+    int kind;
+
+    if (-1 == (fd = open(filename, O_RDONLY))) {
+        perror("Opening database");
+        return EX_NOINPUT;
+    }
+    if (cdb_open(&db, fd)) {
+        fprintf(stderr, "%s: unsupported database format\n", filename);
+        close(fd);
+        return EX_DATAERR;
+    }
+    cdb_cursor_init(&cur, &db);
+    for (kind = 0; kind < 3; kind += 1) {
+        if (! (times[kind] = (double *)malloc(count * sizeof(double)))) {
+            perror("Allocating samples");
+            return EX_OSERR;
+        }
+    }
+
+    for (i = 0; i < count; i += 1) {
+        char key[40];
+        char *k = key;
+        size_t keylen;
+        char val[8192];
+        uint32_t found = 0;
+        uint32_t values;
+        double start;
+
+        // Every value of one key; replayed keys count as hits or misses
+        // depending on what they turn up
+        if (replay) {
+            k = replay[i % nreplay];
+            keylen = strlen(k);
+        } else {
+            keylen = snprintf(key, sizeof(key), "key %lu", pick_key(w));
+        }
+        start = now_us();
+        cdb_cursor_find(&cur, k, keylen);
+        while (cdb_cursor_next(&cur, val, sizeof(val))) {
+            found += 1;
+        }
+        kind = found ? 0 : 1;
+        times[kind][n[kind]++] = now_us() - start;
+
+        if (! replay) {
+            keylen = snprintf(key, sizeof(key), "nokey %lu", pick_key(w));
+            start = now_us();
+            cdb_cursor_find(&cur, key, keylen);
+            while (cdb_cursor_next(&cur, val, sizeof(val))) {
+                found += 1;
+            }
+            times[1][n[1]++] = now_us() - start;
+            keylen = snprintf(key, sizeof(key), "key %lu", pick_key(w));
+        } else if (! found) {
+            continue;
+        }
+
+        start = now_us();
+        cdb_cursor_find(&cur, k, keylen);
+        if ((values = cdb_cursor_count(&cur))) {
+            cdb_cursor_nth(&cur, next_rand(w) % values, val, sizeof(val));
+        }
+        times[2][n[2]++] = now_us() - start;
+    }
+
+    report("hit", times[0], n[0]);
+    report("miss", times[1], n[1]);
+    report("random", times[2], n[2]);
+
+    for (kind = 0; kind < 3; kind += 1) {
+        free(times[kind]);
+    }
+    cdb_cursor_fini(&cur);
+    cdb_close(&db);
+    close(fd);
+
+    return 0;
+}
+
+static void
+count_value(size_t which, uint32_t n, const char *val, uint32_t vallen, void *arg)
+{
+    *(unsigned long *)arg += 1;
+}
+
+/* Look up nbatches batches of batch keys, both ways */
+static int
+lookups(char *filename, struct workload *w, unsigned long batch, unsigned long nbatches)
+{
+    struct cdb db;
+    struct cdb_cursor cur;
+    struct timeval start;
+    char **keys;
+    size_t *keylens;
+    unsigned long found[2] = {0, 0};
+    double secs[2];
+    unsigned long b;
+    unsigned long i;
+    int fd;
+
+    if (-1 == (fd = open(filename, O_RDONLY))) {
+        perror("Opening database");
+        return EX_NOINPUT;
+    }
+    if (cdb_open(&db, fd)) {
+        fprintf(stderr, "%s: unsupported database format\n", filename);
+        close(fd);
+        return EX_DATAERR;
+    }
+    cdb_cursor_init(&cur, &db);
+    keys = (char **)malloc(batch * sizeof(char *));
+    keylens = (size_t *)malloc(batch * sizeof(size_t));
+    if (! keys || ! keylens) {
+        perror("Allocating keys");
+        return EX_OSERR;
+    }
+    for (i = 0; i < batch; i += 1) {
+        keys[i] = (char *)malloc(40);
+    }
+
+    secs[0] = secs[1] = 0;
+    for (b = 0; b < nbatches; b += 1) {
+        for (i = 0; i < batch; i += 1) {
+            keylens[i] = snprintf(keys[i], 40, "%s %lu",
+                    (i % 2) ? "nokey" : "key", pick_key(w));
+        }
+
+        gettimeofday(&start, NULL);
+        for (i = 0; i < batch; i += 1) {
+            char val[8192];
+
+            cdb_cursor_find(&cur, keys[i], keylens[i]);
+            while (cdb_cursor_next(&cur, val, sizeof(val))) {
+                found[0] += 1;
+            }
+        }
+        secs[0] += elapsed(&start);
+
+        gettimeofday(&start, NULL);
+        cdb_find_many(&db, batch, keys, keylens, count_value, &found[1]);
+        secs[1] += elapsed(&start);
+    }
+
+    printf("phase=batch batch=%lu batches=%lu values=%lu single_us=%.2f many_us=%.2f speedup=%.2f\n",
+            batch, nbatches, found[0],
+            secs[0] * 1e6 / nbatches, secs[1] * 1e6 / nbatches, secs[0] / secs[1]);
+    if (found[0] != found[1]) {
+        fprintf(stderr, "cdb_find_many() found %lu values, not %lu\n", found[1], found[0]);
+        return EX_SOFTWARE;
+    }
+
+    for (i = 0; i < batch; i += 1) {
+        free(keys[i]);
+    }
+    free(keys);
+    free(keylens);
+    cdb_cursor_fini(&cur);
+    cdb_close(&db);
+    close(fd);
+
+    return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct workload w;
+    double skew = 0;
+    double zipf = 0;
+    size_t budget = 0;
+    unsigned long count = 100000;
+    unsigned long batch = 0;
+    uint32_t flags = 0;
+    int existing = 0;
+    int old = 0;
+    char *replayfile = NULL;
+    char **replay = NULL;
+    size_t nreplay = 0;
+    char *filename;
+    int ret = 0;
+
+    w.nrecords = 1000000;
+    w.nkeys = 0;
+    w.vallen = 40;
+    w.vallen_max = 0;
+    w.rng = 0x9e3779b97f4a7c15ull;
+
+    for (;;) {
+        int opt = getopt(argc, argv, "hgszeon:k:v:V:C:Z:m:l:r:b:");
+
+        if (-1 == opt) {
+            break;
+        }
+        switch (opt) {
+            case 'n':
+                w.nrecords = strtoul(optarg, NULL, 0);
+                break;
+            case 'k':
+                w.nkeys = strtoul(optarg, NULL, 0);
+                break;
+            case 'v':
+                w.vallen = strtoul(optarg, NULL, 0);
+                break;
+            case 'V':
+                w.vallen_max = strtoul(optarg, NULL, 0);
+                break;
+            case 'C':
+                skew = strtod(optarg, NULL);
+                break;
+            case 'Z':
+                zipf = strtod(optarg, NULL);
+                break;
+            case 'm':
+                budget = strtoul(optarg, NULL, 0) << 10;
+                break;
+            case 'e':
+                existing = 1;
+                break;
+            case 'o':
+                old = 1;
+                break;
+            case 'l':
+                count = strtoul(optarg, NULL, 0);
+                break;
+            case 'r':
+                replayfile = optarg;
+                break;
+            case 'b':
+                batch = strtoul(optarg, NULL, 0);
+                break;
+            case 'g':
+                flags |= CDB_F_GROUPED;
+                break;
+            case 's':
+                flags |= CDB_F_SEEDED;
+                break;
+            case 'z':
+                flags |= CDB_F_COMPRESSED;
+                break;
+            default:
+                return usage(argv[0]);
+        }
+    }
+    if (! (filename = argv[optind])) {
+        return usage(argv[0]);
+    }
+    if (old && (flags || budget)) {
+        return usage(argv[0]);
+    }
+    if (0 == w.nrecords) {
+        w.nrecords = 1;
+    }
+    if (0 == w.nkeys) {
+        w.nkeys = w.nrecords / 4 + 1;
+    }
+    if (w.nkeys > w.nrecords) {
+        w.nkeys = w.nrecords;
+    }
+    if (w.vallen_max < w.vallen) {
+        w.vallen_max = w.vallen;
+    }
+    w.counts = make_cdf(w.nkeys, skew);
+    w.cdf = make_cdf(w.nkeys, zipf);
+    if (! w.counts || ! w.cdf || make_pool(&w)) {
+        perror("Setting up workload");
+        return EX_OSERR;
+    }
+    if (replayfile && ! (replay = read_keys(replayfile, &nreplay))) {
+        return EX_NOINPUT;
+    }
+
+    if (! existing) {
+        ret = build(filename, &w, flags, budget, old);
+    }
+    if ((0 == ret) && count) {
+        ret = latency(filename, &w, count, replay, nreplay);
+    }
+    if ((0 == ret) && batch) {
+        ret = lookups(filename, &w, batch, 200000 / batch + 1);
+    }
+    printf("phase=done peak_rss_kb=%ld\n", peak_rss_kb());
+
+    while (nreplay > 0) {
+        free(replay[--nreplay]);
+    }
+    free(replay);
+    free(w.counts);
+    free(w.cdf);
+    free(w.pool);
+
+    return ret;
+}
@@ -1,122 +1,984 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
-#include <stdlib.h>     // XXX: remove if malloc() is gone
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
 #include "cdbmake.h"
+#include "siphash.h"
+#include "lz.h"
+
+/* Records are written through our own buffer so that one fwrite() moves
+ * a megabyte at a time, instead of stdio's idea of a good block size.
+ */
+#define CDBMAKE_BUFSIZE (1 << 20)
+
+/* Record metadata held in memory before spilling to a temporary file */
+#define CDBMAKE_BUDGET (64 << 20)
+
+/* Bloom filter size, for CDB_F_BLOOM.  About 1% false positives. */
+#define CDBMAKE_BLOOM_BITS 10
+
+/* Values are compressed this many bytes at a time, for CDB_F_COMPRESSED.
+ * Bigger blocks compress better, but every lookup decompresses one.
+ */
+#define CDBMAKE_BLOCKSIZE 2048
+
+/* The first this many bytes of values train a dictionary of at most
+ * CDBMAKE_DICTSIZE, which every block can refer back into.
+ */
+#define CDBMAKE_SAMPLE (1 << 20)
+#define CDBMAKE_DICTSIZE (32 << 10)
+
+/* Upper bound on table-building threads.  There are only 256 tables. */
+#define CDBMAKE_MAX_THREADS 16
+
+/* Files that would end past here are written with CDB_F_WIDE */
+#ifndef CDBMAKE_NARROW_MAX
+#define CDBMAKE_NARROW_MAX 0xffffffff
+#endif
 
 static uint32_t
-hash(char *s, size_t len)
+hash(struct cdbmake_ctx *ctx, char *s, size_t len)
 {
     uint32_t h = 5381;
     size_t i;
 
+    if (ctx->flags & CDB_F_SEEDED) {
+        return (uint32_t)siphash(ctx->seed, s, len);
+    }
     for (i = 0; i < len; i += 1) {
         h = ((h << 5) + h) ^ s[i];
     }
     return h;
 }
 
+/* Pick a fresh seed for every file we write */
+static void
+make_seed(uint8_t seed[16])
+{
+    FILE *f = fopen("/dev/urandom", "rb");
+    struct timeval tv;
+    uint8_t key[16] = {0};
+    uint64_t h;
+    int i;
+
+    if (f) {
+        size_t r = fread(seed, 1, 16, f);
+
+        fclose(f);
+        if (16 == r) {
+            return;
+        }
+    }
+
+    // No urandom?  Then at least don't be the same twice.
+    gettimeofday(&tv, NULL);
+    h = ((uint64_t)tv.tv_sec << 32) ^ tv.tv_usec ^ ((uint64_t)getpid() << 16);
+    for (i = 0; i < 16; i += 1) {
+        h = siphash(key, &h, sizeof(h));
+        seed[i] = h & 0xff;
+    }
+}
+
+/* Set the filter bits for every record in buckets first through last - 1 */
 static void
-write_u32le(FILE *f, uint32_t val)
+bloom_add(struct cdbmake_ctx *ctx, uint8_t *bloom, uint32_t nblocks, int first, int last)
 {
-    fputc((val >> 0)  & 0xff, f);
-    fputc((val >> 8)  & 0xff, f);
-    fputc((val >> 16) & 0xff, f);
-    fputc((val >> 24) & 0xff, f);
+    int idx;
+
+    for (idx = first; idx < last; idx += 1) {
+        uint32_t r;
+
+        for (r = 0; r < ctx->nrecords[idx]; r += 1) {
+            uint16_t bits[CDB_BLOOM_K];
+            uint8_t *block = bloom + cdb_bloom_bits(ctx->records[idx][r].hashval, nblocks, bits) * 64;
+            int i;
+
+            for (i = 0; i < CDB_BLOOM_K; i += 1) {
+                block[bits[i] / 8] |= 1 << (bits[i] % 8);
+            }
+        }
+    }
+}
+
+static void
+put_u32le(uint8_t *p, uint32_t val)
+{
+    p[0] = (val >> 0)  & 0xff;
+    p[1] = (val >> 8)  & 0xff;
+    p[2] = (val >> 16) & 0xff;
+    p[3] = (val >> 24) & 0xff;
+}
+
+static void
+put_u64le(uint8_t *p, uint64_t val)
+{
+    put_u32le(p, val & 0xffffffff);
+    put_u32le(p + 4, val >> 32);
+}
+
+static void
+flush_buf(struct cdbmake_ctx *ctx)
+{
+    if (ctx->buflen > 0) {
+        fwrite(ctx->buf, 1, ctx->buflen, ctx->f);
+        ctx->buflen = 0;
+    }
+}
+
+static void
+emit(struct cdbmake_ctx *ctx, const void *data, size_t len)
+{
+    if (! ctx->buf) {
+        fwrite(data, 1, len, ctx->f);
+        return;
+    }
+    if (ctx->buflen + len > CDBMAKE_BUFSIZE) {
+        flush_buf(ctx);
+    }
+    if (len >= CDBMAKE_BUFSIZE) {
+        fwrite(data, 1, len, ctx->f);
+    } else {
+        memcpy(ctx->buf + ctx->buflen, data, len);
+        ctx->buflen += len;
+    }
 }
 
 void
-cdbmake_init(struct cdbmake_ctx *ctx, FILE *f)
+cdbmake_init(struct cdbmake_ctx *ctx, FILE *f, uint32_t flags)
 {
     int i;
 
     ctx->f = f;
+    ctx->flags = flags;
+    ctx->hdrlen = flags ? CDB_HDRLEN : 0;
+    memset(ctx->seed, 0, sizeof(ctx->seed));
+    if (flags & CDB_F_SEEDED) {
+        make_seed(ctx->seed);
+    }
     for (i = 0; i < 256; i += 1) {
         ctx->records[i] = NULL;
         ctx->nrecords[i] = 0;
+        ctx->allocated[i] = 0;
+    }
+
+    ctx->buf = (char *)malloc(CDBMAKE_BUFSIZE);
+    ctx->buflen = 0;
+
+    ctx->gkey = NULL;
+    ctx->gkeylen = 0;
+    ctx->gvals = NULL;
+    ctx->gvalslen = 0;
+    ctx->gvalssize = 0;
+    ctx->goffsets = NULL;
+    ctx->gcount = 0;
+    ctx->gsize = 0;
+
+    ctx->budget = CDBMAKE_BUDGET;
+    ctx->inmem = 0;
+    ctx->spill = NULL;
+    ctx->runs = NULL;
+    ctx->nruns = 0;
+
+    ctx->cblock = NULL;
+    ctx->cblocklen = 0;
+    ctx->cblocksize = 0;
+    ctx->blocks = NULL;
+    ctx->blockslen = 0;
+    ctx->blockpos = NULL;
+    ctx->nblocks = 0;
+    ctx->blocksalloc = 0;
+    ctx->dict = NULL;
+    ctx->dictlen = 0;
+    ctx->sample = NULL;
+    ctx->samplelen = 0;
+    ctx->nwritten = 0;
+    if (flags & CDB_F_COMPRESSED) {
+        ctx->cblock = (char *)malloc(CDBMAKE_BLOCKSIZE);
+        ctx->cblocksize = ctx->cblock ? CDBMAKE_BLOCKSIZE : 0;
+        ctx->sample = (uint8_t *)malloc(CDBMAKE_SAMPLE);
+        if (! (ctx->blocks = tmpfile())) {
+            perror("Creating block file");
+        }
     }
-    
-    ctx->where = 256 * 8;
+
+    ctx->err = 0;
+    ctx->where = ctx->hdrlen + 256 * 8;
     fseek(f, ctx->where, SEEK_SET);
 }
 
+/* Hold at most this many bytes of record metadata in memory */
 void
-cdbmake_add(struct cdbmake_ctx *ctx,
+cdbmake_set_budget(struct cdbmake_ctx *ctx, size_t bytes)
+{
+    ctx->budget = bytes;
+}
+
+/* Move every record in memory out to a new run in the spill file */
+static void
+spill(struct cdbmake_ctx *ctx)
+{
+    struct cdbmake_run *run;
+    int idx;
+
+    if (! ctx->spill && ! (ctx->spill = tmpfile())) {
+        perror("Creating spill file");
+        ctx->budget = (size_t)-1;
+        return;
+    }
+    run = (struct cdbmake_run *)realloc(ctx->runs, (ctx->nruns + 1) * sizeof(struct cdbmake_run));
+    if (! run) {
+        perror("realloc runs");
+        ctx->budget = (size_t)-1;
+        return;
+    }
+    ctx->runs = run;
+    run += ctx->nruns;
+
+    fseek(ctx->spill, 0, SEEK_END);
+    run->offset = ftell(ctx->spill);
+    for (idx = 0; idx < 256; idx += 1) {
+        uint32_t n = ctx->nrecords[idx];
+
+        if (n != fwrite(ctx->records[idx], sizeof(struct cdbmake_record), n, ctx->spill)) {
+            perror("Writing spill file");
+            ctx->budget = (size_t)-1;
+            return;
+        }
+        run->counts[idx] = n;
+    }
+
+    ctx->nruns += 1;
+    for (idx = 0; idx < 256; idx += 1) {
+        ctx->nrecords[idx] = 0;
+    }
+    ctx->inmem = 0;
+}
+
+/* Write one record whose data is the concatenation of nparts pieces */
+/* Compress one block out to the block file */
+static void
+write_block(struct cdbmake_ctx *ctx, uint8_t *data, size_t len)
+{
+    uint8_t *z;
+    uint8_t rawlen[4];
+    size_t zlen;
+
+    if (! (z = (uint8_t *)malloc(LZ_BOUND(len)))) {
+        perror("Compressing block");
+        return;
+    }
+    zlen = lz_compress(ctx->dict, ctx->dictlen, data, len, z);
+
+    put_u32le(rawlen, len);
+    ctx->blockpos[ctx->nwritten++] = ctx->blockslen;
+    if (ctx->blocks) {
+        fwrite(rawlen, 1, 4, ctx->blocks);
+        fwrite(z, 1, zlen, ctx->blocks);
+    }
+    ctx->blockslen += 4 + zlen;
+    free(z);
+}
+
+/* Train the dictionary on the sample, then compress the blocks in it */
+static void
+train(struct cdbmake_ctx *ctx)
+{
+    uint8_t *p = ctx->sample;
+
+    if (! ctx->sample) {
+        return;
+    }
+    if ((ctx->dict = (uint8_t *)malloc(CDBMAKE_DICTSIZE))) {
+        ctx->dictlen = lz_train(ctx->sample, ctx->samplelen, ctx->dict, CDBMAKE_DICTSIZE);
+    }
+    while (ctx->nwritten < ctx->nblocks) {
+        size_t len = ctx->blockpos[ctx->nwritten];
+
+        write_block(ctx, p, len);
+        p += len;
+    }
+    free(ctx->sample);
+    ctx->sample = NULL;
+}
+
+/* Finish the pending block */
+static void
+flush_block(struct cdbmake_ctx *ctx)
+{
+    if (0 == ctx->cblocklen) {
+        return;
+    }
+    if (ctx->nblocks + 1 >= ctx->blocksalloc) {
+        uint32_t blocksalloc = ctx->blocksalloc ? ctx->blocksalloc * 2 : 256;
+        uint64_t *blockpos = (uint64_t *)realloc(ctx->blockpos, blocksalloc * sizeof(uint64_t));
+
+        if (! blockpos) {
+            perror("realloc blocks");
+            return;
+        }
+        ctx->blockpos = blockpos;
+        ctx->blocksalloc = blocksalloc;
+    }
+
+    if (ctx->sample && (ctx->samplelen + ctx->cblocklen > CDBMAKE_SAMPLE)) {
+        train(ctx);
+    }
+    if (ctx->sample) {
+        memcpy(ctx->sample + ctx->samplelen, ctx->cblock, ctx->cblocklen);
+        ctx->samplelen += ctx->cblocklen;
+        ctx->blockpos[ctx->nblocks++] = ctx->cblocklen;
+    } else {
+        ctx->nblocks += 1;
+        write_block(ctx, (uint8_t *)ctx->cblock, ctx->cblocklen);
+    }
+    ctx->cblocklen = 0;
+}
+
+/* Move data into the pending block, leaving a stub in its place */
+static void
+stash(struct cdbmake_ctx *ctx, int nparts, void **parts, size_t *partlens,
+        uint8_t stub[12])
+{
+    size_t dlen = 0;
+    int i;
+
+    for (i = 0; i < nparts; i += 1) {
+        dlen += partlens[i];
+    }
+
+    // Big values end up with a block to themselves
+    if (ctx->cblocklen + dlen > CDBMAKE_BLOCKSIZE) {
+        flush_block(ctx);
+    }
+    if (dlen > ctx->cblocksize) {
+        char *big = (char *)realloc(ctx->cblock, dlen);
+
+        if (! big) {
+            perror("realloc block");
+            return;
+        }
+        ctx->cblock = big;
+        ctx->cblocksize = dlen;
+    }
+
+    put_u32le(stub + 0, ctx->nblocks);
+    put_u32le(stub + 4, ctx->cblocklen);
+    put_u32le(stub + 8, dlen);
+    for (i = 0; i < nparts; i += 1) {
+        memcpy(ctx->cblock + ctx->cblocklen, parts[i], partlens[i]);
+        ctx->cblocklen += partlens[i];
+    }
+}
+
+static void
+write_record(struct cdbmake_ctx *ctx,
         char *key, size_t keylen,
-        char *val, size_t vallen)
+        int nparts, void **parts, size_t *partlens)
 {
-    uint32_t hashval = hash(key, keylen);
+    uint32_t hashval = hash(ctx, key, keylen);
     int idx = hashval % 256;
     uint32_t n = ctx->nrecords[idx];
+    size_t dlen = 0;
+    uint8_t hdr[8];
+    uint8_t stub[12];
+    void *stubparts[1] = { stub };
+    size_t stublens[1] = { sizeof(stub) };
+    int i;
 
-    ctx->nrecords[idx] += 1;
-    ctx->records[idx] = (struct cdbmake_record *)realloc(ctx->records[idx],
-            ctx->nrecords[idx] * sizeof(struct cdbmake_record));
-    if (NULL == ctx->records[idx]) {
-        perror("realloc records");
+    // Record headers are u32, even in wide files
+    for (i = 0; i < nparts; i += 1) {
+        dlen += partlens[i];
+    }
+    if ((keylen > 0xffffffff) || (dlen > 0xffffffff)) {
+        fprintf(stderr, "Skipping record over 4GB\n");
+        ctx->err = 1;
         return;
     }
+
+    if (ctx->flags & CDB_F_COMPRESSED) {
+        stash(ctx, nparts, parts, partlens, stub);
+        nparts = 1;
+        parts = stubparts;
+        partlens = stublens;
+    }
+
+    // Grow geometrically, so a big build does a few dozen reallocs, not millions
+    if (n == ctx->allocated[idx]) {
+        uint32_t allocated = ctx->allocated[idx] ? ctx->allocated[idx] * 2 : 64;
+        struct cdbmake_record *records;
+
+        records = (struct cdbmake_record *)realloc(ctx->records[idx],
+                allocated * sizeof(struct cdbmake_record));
+        if (NULL == records) {
+            perror("realloc records");
+            return;
+        }
+        ctx->records[idx] = records;
+        ctx->allocated[idx] = allocated;
+    }
     ctx->records[idx][n].hashval = hashval;
-    ctx->records[idx][n].offset = (uint32_t)ctx->where;
+    ctx->records[idx][n].offset = ctx->where;
+    ctx->nrecords[idx] += 1;
+    ctx->inmem += 1;
+
+    dlen = 0;
+    for (i = 0; i < nparts; i += 1) {
+        dlen += partlens[i];
+    }
 
     // Write it out
-    write_u32le(ctx->f, keylen);
-    write_u32le(ctx->f, vallen);
-    fwrite(key, 1, keylen, ctx->f);
-    fwrite(val, 1, vallen, ctx->f);
+    put_u32le(hdr + 0, keylen);
+    put_u32le(hdr + 4, dlen);
+    emit(ctx, hdr, sizeof(hdr));
+    emit(ctx, key, keylen);
+    for (i = 0; i < nparts; i += 1) {
+        emit(ctx, parts[i], partlens[i]);
+    }
+
+    ctx->where += 4 + 4 + keylen + dlen;
+
+    if (ctx->inmem * sizeof(struct cdbmake_record) > ctx->budget) {
+        spill(ctx);
+    }
+}
 
-    ctx->where += 4 + 4 + keylen + vallen;
+/* Write out the pending group as one record */
+static void
+flush_group(struct cdbmake_ctx *ctx)
+{
+    uint32_t base = 4 + (ctx->gcount + 1) * 4;
+    void *parts[3];
+    size_t partlens[3];
+    uint32_t i;
+
+    if (! ctx->gkey) {
+        return;
+    }
+
+    // Turn value offsets into data offsets, in place
+    ctx->goffsets[ctx->gcount + 1] = ctx->gvalslen;
+    for (i = ctx->gcount + 1; i > 0; i -= 1) {
+        put_u32le((uint8_t *)(ctx->goffsets + i), base + ctx->goffsets[i]);
+    }
+    put_u32le((uint8_t *)ctx->goffsets, ctx->gcount);
+
+    parts[0] = ctx->goffsets;
+    partlens[0] = base;
+    parts[1] = ctx->gvals;
+    partlens[1] = ctx->gvalslen;
+    write_record(ctx, ctx->gkey, ctx->gkeylen, 2, parts, partlens);
+
+    free(ctx->gkey);
+    ctx->gkey = NULL;
+    ctx->gvalslen = 0;
+    ctx->gcount = 0;
+}
+
+/* Add a value to the pending group, starting a new one if the key changed.
+ *
+ * Values for one key must be added one after another; a key that shows
+ * up again later gets a second group.
+ */
+static void
+add_grouped(struct cdbmake_ctx *ctx,
+        char *key, size_t keylen,
+        char *val, size_t vallen)
+{
+    if (ctx->gkey &&
+            ((keylen != ctx->gkeylen) || memcmp(key, ctx->gkey, keylen))) {
+        flush_group(ctx);
+    }
+    if (! ctx->gkey) {
+        ctx->gkey = (char *)malloc(keylen + 1);
+        if (! ctx->gkey) {
+            perror("Allocating group key");
+            return;
+        }
+        memcpy(ctx->gkey, key, keylen);
+        ctx->gkeylen = keylen;
+    }
+
+    // Room for offsets[gcount + 2]: the count, every start, and the end
+    if (ctx->gcount + 2 >= ctx->gsize) {
+        uint32_t gsize = ctx->gsize ? ctx->gsize * 2 : 16;
+        uint32_t *goffsets = (uint32_t *)realloc(ctx->goffsets, gsize * sizeof(uint32_t));
+
+        if (! goffsets) {
+            perror("realloc group");
+            return;
+        }
+        ctx->goffsets = goffsets;
+        ctx->gsize = gsize;
+    }
+    if (ctx->gvalslen + vallen > ctx->gvalssize) {
+        size_t gvalssize = ctx->gvalssize ? ctx->gvalssize : 4096;
+        char *gvals;
+
+        while (gvalssize < ctx->gvalslen + vallen) {
+            gvalssize *= 2;
+        }
+        gvals = (char *)realloc(ctx->gvals, gvalssize);
+        if (! gvals) {
+            perror("realloc group");
+            return;
+        }
+        ctx->gvals = gvals;
+        ctx->gvalssize = gvalssize;
+    }
+
+    ctx->goffsets[ctx->gcount + 1] = ctx->gvalslen;
+    memcpy(ctx->gvals + ctx->gvalslen, val, vallen);
+    ctx->gvalslen += vallen;
+    ctx->gcount += 1;
 }
 
 void
+cdbmake_add(struct cdbmake_ctx *ctx,
+        char *key, size_t keylen,
+        char *val, size_t vallen)
+{
+    if (ctx->flags & CDB_F_GROUPED) {
+        add_grouped(ctx, key, keylen, val, vallen);
+    } else {
+        void *parts[1] = { val };
+        size_t partlens[1] = { vallen };
+
+        write_record(ctx, key, keylen, 1, parts, partlens);
+    }
+}
+
+struct table_job {
+    struct cdbmake_ctx *ctx;
+    int fd;
+    uint64_t pos[256];
+
+    pthread_mutex_t lock;
+    int next;
+    int last;
+    int err;
+};
+
+/* Build one bucket's table in memory and write it at its final position. */
+static int
+write_table(struct cdbmake_ctx *ctx, int fd, int idx, uint64_t pos)
+{
+    struct cdbmake_record *records = ctx->records[idx];
+    uint32_t nrecords = ctx->nrecords[idx];
+    uint32_t tlen = nrecords * 2;
+    int wide = ctx->flags & CDB_F_WIDE;
+    uint64_t *buf;
+    uint8_t *p;
+    size_t left;
+    uint32_t r;
+
+    if (0 == tlen) {
+        return 0;
+    }
+
+    buf = (uint64_t *)calloc(tlen * 2, sizeof(uint64_t));
+    if (! buf) {
+        perror("Allocating hash table");
+        return -1;
+    }
+    for (r = 0; r < nrecords; r += 1) {
+        uint32_t slot = (records[r].hashval / 256) % tlen;
+
+        // Offsets are never 0, so they mark an occupied slot
+        while (buf[slot * 2 + 1] > 0) {
+            slot = (slot + 1) % tlen;
+        }
+        buf[slot*2 + 0] = records[r].hashval;
+        buf[slot*2 + 1] = records[r].offset;
+    }
+
+    // Pack slots down in place; none lands past where it was read from
+    p = (uint8_t *)buf;
+    for (r = 0; r < tlen; r += 1) {
+        uint64_t h = buf[r*2 + 0];
+        uint64_t offset = buf[r*2 + 1];
+
+        if (wide) {
+            put_u64le(p + r*16 + 0, h);
+            put_u64le(p + r*16 + 8, offset);
+        } else {
+            put_u32le(p + r*8 + 0, h);
+            put_u32le(p + r*8 + 4, offset);
+        }
+    }
+
+    // Write it out
+    left = (size_t)tlen * (wide ? 16 : 8);
+    while (left > 0) {
+        ssize_t ret = pwrite(fd, p, left, pos);
+
+        if (ret <= 0) {
+            perror("Writing hash table");
+            free(buf);
+            return -1;
+        }
+        p += ret;
+        pos += ret;
+        left -= ret;
+    }
+    free(buf);
+
+    return 0;
+}
+
+static void *
+table_worker(void *arg)
+{
+    struct table_job *job = (struct table_job *)arg;
+
+    for (;;) {
+        int idx;
+
+        pthread_mutex_lock(&job->lock);
+        idx = job->next++;
+        pthread_mutex_unlock(&job->lock);
+
+        if (idx >= job->last) {
+            break;
+        }
+        if (write_table(job->ctx, job->fd, idx, job->pos[idx])) {
+            pthread_mutex_lock(&job->lock);
+            job->err = 1;
+            pthread_mutex_unlock(&job->lock);
+        }
+    }
+
+    return NULL;
+}
+
+/* Build and write tables first through last - 1, from as many threads as we have cores */
+static int
+write_tables(struct table_job *job, int first, int last)
+{
+    pthread_t threads[CDBMAKE_MAX_THREADS];
+    int nthreads = 0;
+    long ncpus;
+    int i;
+
+    job->next = first;
+    job->last = last;
+
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (; (nthreads < ncpus - 1) && (nthreads < CDBMAKE_MAX_THREADS); nthreads += 1) {
+        if (pthread_create(&threads[nthreads], NULL, table_worker, job)) {
+            break;
+        }
+    }
+    table_worker(job);
+    for (i = 0; i < nthreads; i += 1) {
+        pthread_join(threads[i], NULL);
+    }
+
+    return job->err;
+}
+
+/* Gather every record for buckets first through last - 1 back into memory.
+ *
+ * Runs come back in the order they were spilled, followed by whatever was
+ * still in memory, so records keep their insertion order.
+ */
+static int
+load_buckets(struct cdbmake_ctx *ctx, uint32_t *total, int first, int last)
+{
+    uint32_t filled[256] = {0};
+    size_t r;
+    int idx;
+
+    for (idx = first; idx < last; idx += 1) {
+        struct cdbmake_record *records;
+
+        if (! (records = (struct cdbmake_record *)malloc((total[idx] + 1) * sizeof(struct cdbmake_record)))) {
+            perror("Allocating records");
+            return -1;
+        }
+        for (r = 0; r < ctx->nruns; r += 1) {
+            filled[idx] += ctx->runs[r].counts[idx];
+        }
+        memcpy(records + filled[idx], ctx->records[idx],
+                ctx->nrecords[idx] * sizeof(struct cdbmake_record));
+        free(ctx->records[idx]);
+        ctx->records[idx] = records;
+        ctx->nrecords[idx] = total[idx];
+        ctx->allocated[idx] = total[idx] + 1;
+        filled[idx] = 0;
+    }
+
+    for (r = 0; r < ctx->nruns; r += 1) {
+        struct cdbmake_run *run = &ctx->runs[r];
+        long offset = run->offset;
+
+        for (idx = 0; idx < first; idx += 1) {
+            offset += run->counts[idx] * sizeof(struct cdbmake_record);
+        }
+        fseek(ctx->spill, offset, SEEK_SET);
+        for (idx = first; idx < last; idx += 1) {
+            uint32_t n = run->counts[idx];
+
+            if (n != fread(ctx->records[idx] + filled[idx], sizeof(struct cdbmake_record), n, ctx->spill)) {
+                perror("Reading spill file");
+                return -1;
+            }
+            filled[idx] += n;
+        }
+    }
+
+    return 0;
+}
+
+/* Copy the dictionary, the compressed blocks, then their directory, to
+ * pos.  Returns the new end of the file.
+ */
+static uint64_t
+write_blocks(struct cdbmake_ctx *ctx, uint64_t pos)
+{
+    size_t dirsize = (ctx->flags & CDB_F_WIDE) ? 8 : 4;
+    char buf[65536];
+    size_t r;
+    uint32_t i;
+
+    fseek(ctx->f, pos, SEEK_SET);
+    fwrite(ctx->dict, 1, ctx->dictlen, ctx->f);
+    pos += ctx->dictlen;
+    if (ctx->blocks) {
+        rewind(ctx->blocks);
+        while ((r = fread(buf, 1, sizeof(buf), ctx->blocks)) > 0) {
+            fwrite(buf, 1, r, ctx->f);
+        }
+    }
+
+    // Positions of every block, and of the end of the last one
+    for (i = 0; i <= ctx->nblocks; i += 1) {
+        uint8_t p[8];
+
+        put_u64le(p, pos + ((i < ctx->nblocks) ? ctx->blockpos[i] : ctx->blockslen));
+        fwrite(p, 1, dirsize, ctx->f);
+    }
+
+    return pos + ctx->blockslen + (ctx->nblocks + 1) * dirsize;
+}
+
+/* Returns -1 if anything couldn't be written */
+int
 cdbmake_finalize(struct cdbmake_ctx *ctx)
 {
+    struct table_job job;
+    uint8_t hdr[CDB_HDRLEN + 256 * 8] = {0};
+    uint8_t *ptrs = hdr + ctx->hdrlen;
+    uint32_t total[256];
+    uint64_t end;
+    uint8_t *bloom = NULL;
+    uint32_t bloomblocks = 0;
+    uint64_t nkeys = 0;
+    size_t r;
     int idx;
 
-    // Write out tables
+    flush_group(ctx);
+    flush_block(ctx);
+    train(ctx);
+    flush_buf(ctx);
+    fflush(ctx->f);
+
+    job.ctx = ctx;
+    job.fd = fileno(ctx->f);
+    job.err = ctx->err;
+
     for (idx = 0; idx < 256; idx += 1) {
-        uint32_t r;
-        long offset;
-        uint32_t tlen = ctx->nrecords[idx] * 2;
-        uint32_t *buf;
-
-        // Pointer
-        offset = ftell(ctx->f);
-        fseek(ctx->f, idx * 8, SEEK_SET);
-        write_u32le(ctx->f, (uint32_t)offset);
-        write_u32le(ctx->f, tlen);
-        fseek(ctx->f, offset, SEEK_SET);
-
-        // Build table in memory
-        buf = (uint32_t *)calloc(tlen * 2, sizeof(uint32_t));
-        if (! buf) {
-            perror("Allocating hash table");
-            return;
+        total[idx] = ctx->nrecords[idx];
+        for (r = 0; r < ctx->nruns; r += 1) {
+            total[idx] += ctx->runs[r].counts[idx];
         }
-        for (r = 0; r < ctx->nrecords[idx]; r += 1) {
-            uint32_t slot = (ctx->records[idx][r].hashval / 256) % tlen;
+        nkeys += total[idx];
+    }
+
+    // Sized by records, which is at least the number of keys
+    if (ctx->flags & CDB_F_BLOOM) {
+        bloomblocks = (nkeys * CDBMAKE_BLOOM_BITS + 511) / 512;
+        if (0 == bloomblocks) {
+            bloomblocks = 1;
+        }
+    }
+
+    // Go wide if 32 bits can't reach the end of the file
+    end = ctx->where + nkeys * 2 * 8 + (uint64_t)bloomblocks * 64;
+    if (ctx->flags & CDB_F_COMPRESSED) {
+        end += ctx->dictlen + ctx->blockslen + (ctx->nblocks + 1) * 4;
+    }
+    if (end > CDBMAKE_NARROW_MAX) {
+        if (ctx->hdrlen) {
+            ctx->flags |= CDB_F_WIDE;
+        } else {
+            fprintf(stderr, "Database would pass 4GB, too big for the standard cdb format\n");
+            job.err = 1;
+        }
+    }
+
+    if (bloomblocks && ! job.err) {
+        if (! (bloom = (uint8_t *)calloc(bloomblocks, 64))) {
+            perror("Allocating bloom filter");
+            bloomblocks = 0;
+            ctx->flags &= ~CDB_F_BLOOM;
+        }
+    }
+
+    // Lay out every table up front, so they can be written in any order
+    end = ctx->where;
+    for (idx = 0; idx < 256; idx += 1) {
+        uint32_t tlen = total[idx] * 2;
+
+        job.pos[idx] = end;
+        if (ctx->flags & CDB_F_WIDE) {
+            put_u64le(ptrs + idx*8, end);
+            end += tlen * (uint64_t)16;
+        } else {
+            put_u32le(ptrs + idx*8 + 0, end);
+            put_u32le(ptrs + idx*8 + 4, tlen);
+            end += tlen * 8;
+        }
+    }
+
+    pthread_mutex_init(&job.lock, NULL);
+
+    if (job.err) {
+        // Nothing more worth writing
+    } else if (0 == ctx->nruns) {
+        write_tables(&job, 0, 256);
+        if (bloom) {
+            bloom_add(ctx, bloom, bloomblocks, 0, 256);
+        }
+    } else {
+        int first;
+        int last;
 
-            while (buf[slot * 2] > 0) {
-                slot = (slot + 1) % tlen;
+        // As many buckets at a time as fit in the budget
+        for (first = 0; (first < 256) && ! job.err; first = last) {
+            size_t size = 0;
+
+            for (last = first; last < 256; last += 1) {
+                size_t more = total[last] * sizeof(struct cdbmake_record);
+
+                if ((last > first) && (size + more > ctx->budget)) {
+                    break;
+                }
+                size += more;
+            }
+            if (load_buckets(ctx, total, first, last)) {
+                job.err = 1;
+                break;
+            }
+            write_tables(&job, first, last);
+            if (bloom) {
+                bloom_add(ctx, bloom, bloomblocks, first, last);
+            }
+            for (idx = first; idx < last; idx += 1) {
+                free(ctx->records[idx]);
+                ctx->records[idx] = NULL;
+                ctx->nrecords[idx] = 0;
+                ctx->allocated[idx] = 0;
+            }
+        }
+    }
+    pthread_mutex_destroy(&job.lock);
+    if (ctx->hdrlen) {
+        put_u32le(hdr + 0, 0);
+        put_u32le(hdr + 4, CDB_MAGIC);
+        put_u32le(hdr + 8, CDB_VERSION);
+        put_u32le(hdr + 12, ctx->flags);
+        put_u32le(hdr + 16, ctx->hdrlen);
+        memcpy(hdr + 20, ctx->seed, sizeof(ctx->seed));
+    }
+
+    // Header goes out once, now that every pointer is known
+    if (! job.err) {
+        int wide = ctx->flags & CDB_F_WIDE;
+        uint64_t bloom_pos = bloom ? end : 0;
+
+        if (bloom) {
+            fseek(ctx->f, end, SEEK_SET);
+            fwrite(bloom, 64, bloomblocks, ctx->f);
+            end += bloomblocks * (uint64_t)64;
+        }
+        if (wide) {
+            put_u64le(hdr + 36, bloom_pos);
+            put_u32le(hdr + 52, bloomblocks);
+        } else if (ctx->hdrlen) {
+            put_u32le(hdr + 36, bloom_pos);
+            put_u32le(hdr + 40, bloomblocks);
+        }
+        if (ctx->flags & CDB_F_COMPRESSED) {
+            uint64_t dict_pos = end;
+
+            end = write_blocks(ctx, end);
+            if (wide) {
+                put_u64le(hdr + 44, dict_pos);
+                put_u32le(hdr + 56, ctx->nblocks);
+                put_u32le(hdr + 60, ctx->dictlen);
+            } else {
+                put_u32le(hdr + 44, end - (ctx->nblocks + 1) * 4);
+                put_u32le(hdr + 48, ctx->nblocks);
+                put_u32le(hdr + 52, dict_pos);
+                put_u32le(hdr + 56, ctx->dictlen);
             }
-            buf[slot*2 + 0] = ctx->records[idx][r].hashval;
-            buf[slot*2 + 1] = ctx->records[idx][r].offset;
         }
-        // Write it out
-        for (r = 0; r < tlen; r += 1) {
-            write_u32le(ctx->f, buf[r*2 + 0]);
-            write_u32le(ctx->f, buf[r*2 + 1]);
+        fseek(ctx->f, 0, SEEK_SET);
+        fwrite(hdr, 1, ctx->hdrlen + 256 * 8, ctx->f);
+        fseek(ctx->f, end, SEEK_SET);
+        if (fflush(ctx->f) || ferror(ctx->f)) {
+            perror("Writing database");
+            job.err = 1;
         }
-        free(buf);
+    } else {
+        fprintf(stderr, "Not writing database header, after the errors above\n");
     }
 
     ctx->f = NULL;
-    
+    free(bloom);
+    free(ctx->buf);
+    free(ctx->cblock);
+    ctx->cblock = NULL;
+    free(ctx->blockpos);
+    ctx->blockpos = NULL;
+    ctx->nblocks = 0;
+    ctx->blocksalloc = 0;
+    free(ctx->dict);
+    ctx->dict = NULL;
+    ctx->dictlen = 0;
+    free(ctx->sample);
+    ctx->sample = NULL;
+    if (ctx->blocks) {
+        fclose(ctx->blocks);
+        ctx->blocks = NULL;
+    }
+    ctx->buf = NULL;
+    free(ctx->gvals);
+    ctx->gvals = NULL;
+    ctx->gvalssize = 0;
+    free(ctx->goffsets);
+    ctx->goffsets = NULL;
+    ctx->gsize = 0;
+    if (ctx->spill) {
+        fclose(ctx->spill);
+        ctx->spill = NULL;
+    }
+    free(ctx->runs);
+    ctx->runs = NULL;
+    ctx->nruns = 0;
+    ctx->inmem = 0;
+
     for (idx = 0; idx < 256; idx += 1) {
         if (ctx->records[idx]) {
             free(ctx->records[idx]);
         }
         ctx->records[idx] = NULL;
         ctx->nrecords[idx] = 0;
+        ctx->allocated[idx] = 0;
     }
+
+    return job.err ? -1 : 0;
 }
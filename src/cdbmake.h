@@ -4,24 +4,73 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include "cdb.h"
 
 struct cdbmake_record {
-    FILE *f;
     uint32_t hashval;
-    uint32_t offset;
+    uint64_t offset;
+};
+
+/* Records spilled to disk, bucket by bucket */
+struct cdbmake_run {
+    long offset;
+    uint32_t counts[256];
 };
 
 struct cdbmake_ctx {
     FILE *f;
+    uint32_t flags;
+    uint32_t hdrlen;
+    uint8_t seed[16];
     struct cdbmake_record *records[256];
     uint32_t nrecords[256];
+    uint32_t allocated[256];
     long where;
+    int err;                    // Something couldn't be written
+
+    size_t budget;
+    size_t inmem;
+    FILE *spill;
+    struct cdbmake_run *runs;
+    size_t nruns;
+
+    char *buf;
+    size_t buflen;
+
+    // Pending group, for CDB_F_GROUPED
+    char *gkey;
+    size_t gkeylen;
+    char *gvals;
+    size_t gvalslen;
+    size_t gvalssize;
+    uint32_t *goffsets;
+    uint32_t gcount;
+    uint32_t gsize;
+
+    // Pending value block, for CDB_F_COMPRESSED
+    char *cblock;
+    size_t cblocklen;
+    size_t cblocksize;
+    FILE *blocks;
+    long blockslen;
+    uint64_t *blockpos;
+    uint32_t nblocks;
+    uint32_t blocksalloc;
+
+    // Blocks from nwritten on wait in sample, blockpos holding their
+    // lengths, until there's enough to train the dictionary
+    uint8_t *dict;
+    size_t dictlen;
+    uint8_t *sample;
+    size_t samplelen;
+    uint32_t nwritten;
 };
 
-void cdbmake_init(struct cdbmake_ctx *ctx, FILE *f);
+void cdbmake_init(struct cdbmake_ctx *ctx, FILE *f, uint32_t flags);
+void cdbmake_set_budget(struct cdbmake_ctx *ctx, size_t bytes);
 void cdbmake_add(struct cdbmake_ctx *ctx,
         char *key, size_t keylen,
         char *val, size_t vallen);
-void cdbmake_finalize(struct cdbmake_ctx *ctx);
+int cdbmake_finalize(struct cdbmake_ctx *ctx);
 
 #endif
@@ -0,0 +1,473 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "cdb.h"
+#include "cdbstats.h"
+#include "siphash.h"
+
+/*
+ * Database statistics
+ *
+ * One pass over the records, then one over the tables, the bloom filter
+ * and the block directory: enough to tell how full the tables are, how
+ * much reading a lookup costs, and where the bytes went.
+ */
+
+#ifndef min
+#define min(a,b) ((a)<(b)?(a):(b))
+#endif
+
+static uint32_t
+u32le(const uint8_t *d)
+{
+    return ((d[0] << 0) |
+            (d[1] << 8) |
+            (d[2] << 16) |
+            ((uint32_t)d[3] << 24));
+}
+
+static uint64_t
+u64le(const uint8_t *d)
+{
+    return u32le(d) | ((uint64_t)u32le(d + 4) << 32);
+}
+
+static size_t
+get(const struct cdb *db, uint64_t pos, void *buf, size_t len)
+{
+    size_t got = 0;
+
+    if (db->map) {
+        if (pos >= db->size) {
+            return 0;
+        }
+        len = min(len, db->size - pos);
+        memcpy(buf, db->map + pos, len);
+        return len;
+    }
+    while (got < len) {
+        ssize_t r = pread(db->fd, (char *)buf + got, len - got, (off_t)pos + got);
+
+        if (r <= 0) {
+            break;
+        }
+        got += r;
+    }
+    return got;
+}
+
+static int
+bucket(uint64_t v)
+{
+    int b = 0;
+
+    for (; v; v >>= 1) {
+        b += 1;
+    }
+    return b;
+}
+
+/* Values and records of each key, by a fingerprint of the key */
+struct key_count {
+    uint64_t fp;                // 0 for an empty slot
+    uint64_t values;
+    uint64_t records;
+};
+
+struct key_counts {
+    struct key_count *slots;
+    size_t size;                // A power of two
+    size_t n;
+};
+
+static struct key_count *
+key_slot(struct key_counts *kc, uint64_t fp)
+{
+    size_t i;
+
+    for (i = fp & (kc->size - 1); kc->slots[i].fp; i = (i + 1) & (kc->size - 1)) {
+        if (kc->slots[i].fp == fp) {
+            break;
+        }
+    }
+    return &kc->slots[i];
+}
+
+static struct key_count *
+key_add(struct key_counts *kc, char *key, size_t keylen)
+{
+    static const uint8_t zero[16];
+    uint64_t fp = siphash(zero, key, keylen);
+    struct key_count *k;
+
+    fp = fp ? fp : 1;
+    if ((kc->n + 1) * 2 > kc->size) {
+        struct key_counts bigger = {NULL, kc->size ? kc->size * 2 : 4096, kc->n};
+        size_t i;
+
+        if (! (bigger.slots = (struct key_count *)calloc(bigger.size, sizeof(struct key_count)))) {
+            return NULL;
+        }
+        for (i = 0; i < kc->size; i += 1) {
+            if (kc->slots[i].fp) {
+                *key_slot(&bigger, kc->slots[i].fp) = kc->slots[i];
+            }
+        }
+        free(kc->slots);
+        *kc = bigger;
+    }
+
+    k = key_slot(kc, fp);
+    if (! k->fp) {
+        k->fp = fp;
+        kc->n += 1;
+    }
+    return k;
+}
+
+/* Count records, keys and values, dumping everything once */
+static int
+record_stats(struct cdb_ctx *ctx, struct cdb_stats *st)
+{
+    struct key_counts kc = {NULL, 0, 0};
+    struct key_count *k = NULL;
+    char *key = NULL;
+    size_t keysize = 0;
+    size_t keylen;
+    char *val = NULL;
+    size_t valsize = 0;
+    size_t vallen;
+    uint64_t last = UINT64_MAX;
+    size_t i;
+    int ret = 0;
+
+    for (;;) {
+        // The dump sits on a record until its last value is out, and
+        // starts at the first one, right after the table pointers
+        uint64_t pos = ctx->dump_end ? ctx->dump_pos : ctx->db.hdrlen + 256 * 8;
+
+        if (EOF == cdb_dump_full(ctx, &key, &keysize, &keylen, &val, &valsize, &vallen)) {
+            break;
+        }
+        if (pos != last) {
+            if (! (k = key_add(&kc, key, keylen))) {
+                perror("Counting keys");
+                ret = -1;
+                break;
+            }
+            if (0 == k->records) {
+                st->keylen[bucket(keylen)] += 1;
+            }
+            k->records += 1;
+            st->records += 1;
+            st->key_bytes += keylen;
+            last = pos;
+        }
+        k->values += 1;
+        st->values += 1;
+        st->value_bytes += vallen;
+        st->vallen[bucket(vallen)] += 1;
+    }
+
+    st->keys = kc.n;
+    for (i = 0; i < kc.size; i += 1) {
+        struct key_count *c = &kc.slots[i];
+
+        if (c->fp) {
+            st->per_key[bucket(c->values)] += 1;
+            st->split_keys += (c->records > 1);
+            if (c->values > st->max_values) {
+                st->max_values = c->values;
+            }
+        }
+    }
+
+    free(kc.slots);
+    free(key);
+    free(val);
+
+    return ret;
+}
+
+/* Probe costs, from where every record sits against where it hashed to */
+static int
+table_stats(const struct cdb *db, struct cdb_stats *st)
+{
+    size_t slotsize = (db->flags & CDB_F_WIDE) ? 16 : 8;
+    double hit_total = 0;
+    double miss_total = 0;
+    uint64_t records = 0;
+    int i;
+
+    st->table_min = UINT64_MAX;
+    for (i = 0; i < 256; i += 1) {
+        uint64_t pos = db->tables[i][0];
+        uint64_t tlen = db->tables[i][1];
+        uint64_t used = 0;
+        uint64_t empty = tlen;
+        uint64_t run = 0;
+        uint64_t misses = 0;
+        uint8_t *table;
+        uint64_t s;
+
+        st->slots += tlen;
+        st->table_bytes += tlen * slotsize;
+        if (0 == tlen) {
+            st->table_min = 0;
+            continue;
+        }
+        if (! (table = (uint8_t *)malloc(tlen * slotsize))) {
+            perror("Reading table");
+            return -1;
+        }
+        if (tlen * slotsize != get(db, pos, table, tlen * slotsize)) {
+            free(table);
+            return -1;
+        }
+
+        for (s = 0; s < tlen; s += 1) {
+            uint8_t *slot = table + s * slotsize;
+            uint32_t h = u32le(slot);
+            uint64_t off = (slotsize == 16) ? u64le(slot + 8) : u32le(slot + 4);
+            uint64_t probes;
+
+            if (0 == off) {
+                empty = s;
+                continue;
+            }
+            used += 1;
+            probes = (s + tlen - (h / 256) % tlen) % tlen + 1;
+            hit_total += probes;
+            if (probes > st->hit_probes_max) {
+                st->hit_probes_max = probes;
+            }
+        }
+
+        // A miss reads the rest of the run it hashes into, then an empty
+        // slot.  Go round once, starting after an empty one.
+        for (s = 1; (empty < tlen) && (s <= tlen); s += 1) {
+            uint64_t e = (empty + s) % tlen;
+            uint8_t *slot = table + e * slotsize;
+            uint64_t off = (slotsize == 16) ? u64le(slot + 8) : u32le(slot + 4);
+
+            if (off) {
+                run += 1;
+                continue;
+            }
+            misses += 1 + run * (run + 3) / 2;
+            if (run) {
+                st->runs[bucket(run)] += 1;
+            }
+            if (run > st->run_max) {
+                st->run_max = run;
+            }
+            run = 0;
+        }
+        miss_total += (double)misses / tlen;
+        st->empty_slot_bytes += (tlen - used) * slotsize;
+        free(table);
+
+        records += used;
+        if (used < st->table_min) {
+            st->table_min = used;
+        }
+        if (used > st->table_max) {
+            st->table_max = used;
+        }
+    }
+
+    st->hit_probes = records ? hit_total / records : 0;
+    st->miss_probes = miss_total / 256;
+    st->miss_probes_max = st->run_max + 1;
+
+    return 0;
+}
+
+static void
+bloom_stats(const struct cdb *db, struct cdb_stats *st)
+{
+    uint64_t bits = 0;
+    double fp = 0;
+    uint32_t b;
+
+    st->bloom_bytes = (uint64_t)db->bloom_blocks * 64;
+    if (! (db->flags & CDB_F_BLOOM) || (0 == db->bloom_blocks)) {
+        st->bloom_fp = 1;
+        return;
+    }
+    for (b = 0; b < db->bloom_blocks; b += 1) {
+        uint8_t block[64];
+        double p = 1;
+        int set = 0;
+        int i;
+
+        if (sizeof(block) != get(db, db->bloom_pos + (uint64_t)b * 64, block, sizeof(block))) {
+            break;
+        }
+        for (i = 0; i < 512; i += 1) {
+            set += (block[i / 8] >> (i % 8)) & 1;
+        }
+        for (i = 0; i < CDB_BLOOM_K; i += 1) {
+            p *= set / 512.0;
+        }
+        bits += set;
+        fp += p;
+    }
+    if (db->bloom_blocks) {
+        st->bloom_fill = (double)bits / (st->bloom_bytes * 8);
+        st->bloom_fp = fp / db->bloom_blocks;
+    }
+}
+
+static void
+block_stats(const struct cdb *db, struct cdb_stats *st)
+{
+    size_t dirsize = (db->flags & CDB_F_WIDE) ? 8 : 4;
+    uint64_t first = 0;
+    uint64_t last = 0;
+    uint32_t n;
+
+    if (! (db->flags & CDB_F_COMPRESSED)) {
+        return;
+    }
+    st->dict_bytes = db->dict_len;
+    st->blocks = db->nblocks;
+    for (n = 0; n <= db->nblocks; n += 1) {
+        uint8_t d[8];
+        uint8_t raw[4];
+        uint64_t pos;
+
+        if (dirsize != get(db, db->block_dir + n * dirsize, d, dirsize)) {
+            return;
+        }
+        pos = (8 == dirsize) ? u64le(d) : u32le(d);
+        if (0 == n) {
+            first = pos;
+        }
+        last = pos;
+        if ((n < db->nblocks) && (4 == get(db, pos, raw, 4))) {
+            st->block_raw_bytes += u32le(raw);
+        }
+    }
+    st->block_bytes = last - first + (db->nblocks + 1) * dirsize;
+}
+
+/* Walk the database open in ctx, filling in st */
+int
+cdb_stats(struct cdb_ctx *ctx, struct cdb_stats *st)
+{
+    const struct cdb *db = &ctx->db;
+    uint64_t start = db->hdrlen + 256 * 8;
+
+    memset(st, 0, sizeof(*st));
+    st->flags = db->flags;
+    st->file_bytes = db->size;
+    if (! db->map) {
+        st->file_bytes = lseek(db->fd, 0, SEEK_END);
+    }
+    st->header_bytes = start;
+    st->record_bytes = (db->records_end > start) ? db->records_end - start : 0;
+
+    if (record_stats(ctx, st) || table_stats(db, st)) {
+        return -1;
+    }
+    bloom_stats(db, st);
+    block_stats(db, st);
+
+    return 0;
+}
+
+static void
+print_hist(FILE *f, const char *name, uint64_t *hist, int kv)
+{
+    int b;
+
+    if (! kv) {
+        fprintf(f, "%s:\n", name);
+    }
+    for (b = 0; b < CDBSTATS_BUCKETS; b += 1) {
+        uint64_t lo = b ? (uint64_t)1 << (b - 1) : 0;
+        uint64_t hi = b ? ((uint64_t)1 << b) - 1 : 0;
+
+        if (! hist[b]) {
+            continue;
+        }
+        if (kv) {
+            fprintf(f, "%s_%lu_%lu=%lu\n", name, (unsigned long)lo, (unsigned long)hi, (unsigned long)hist[b]);
+        } else {
+            fprintf(f, "  %10lu-%-10lu %lu\n", (unsigned long)lo, (unsigned long)hi, (unsigned long)hist[b]);
+        }
+    }
+}
+
+/* Name/value pairs, for people (kv = 0) or programs (kv = 1) */
+#define PRINT(name, fmt, val) \
+    fprintf(f, kv ? "%s=" fmt "\n" : "%-22s " fmt "\n", name, val)
+
+void
+cdb_stats_print(FILE *f, struct cdb_stats *st, int kv)
+{
+    unsigned long payload = st->key_bytes + st->value_bytes;
+    char format[64] = "";
+
+    if (st->flags & CDB_F_GROUPED) {
+        strcat(format, ",grouped");
+    }
+    if (st->flags & CDB_F_SEEDED) {
+        strcat(format, ",seeded");
+    }
+    if (st->flags & CDB_F_BLOOM) {
+        strcat(format, ",bloom");
+    }
+    if (st->flags & CDB_F_COMPRESSED) {
+        strcat(format, ",compressed");
+    }
+    if (st->flags & CDB_F_WIDE) {
+        strcat(format, ",wide");
+    }
+
+    PRINT("format", "%s", format[0] ? format + 1 : "standard");
+    PRINT("file_bytes", "%lu", (unsigned long)st->file_bytes);
+    PRINT("header_bytes", "%lu", (unsigned long)st->header_bytes);
+    PRINT("record_bytes", "%lu", (unsigned long)st->record_bytes);
+    PRINT("table_bytes", "%lu", (unsigned long)st->table_bytes);
+    PRINT("empty_slot_bytes", "%lu", (unsigned long)st->empty_slot_bytes);
+    PRINT("bloom_bytes", "%lu", (unsigned long)st->bloom_bytes);
+    if (st->flags & CDB_F_COMPRESSED) {
+        PRINT("dict_bytes", "%lu", (unsigned long)st->dict_bytes);
+        PRINT("blocks", "%lu", (unsigned long)st->blocks);
+        PRINT("block_bytes", "%lu", (unsigned long)st->block_bytes);
+        PRINT("block_raw_bytes", "%lu", (unsigned long)st->block_raw_bytes);
+    }
+    PRINT("key_bytes", "%lu", (unsigned long)st->key_bytes);
+    PRINT("value_bytes", "%lu", (unsigned long)st->value_bytes);
+    PRINT("payload_ratio", "%.3f", st->file_bytes ? (double)payload / st->file_bytes : 0);
+
+    PRINT("records", "%lu", (unsigned long)st->records);
+    PRINT("keys", "%lu", (unsigned long)st->keys);
+    PRINT("values", "%lu", (unsigned long)st->values);
+    PRINT("split_keys", "%lu", (unsigned long)st->split_keys);
+    PRINT("max_values", "%lu", (unsigned long)st->max_values);
+
+    PRINT("slots", "%lu", (unsigned long)st->slots);
+    PRINT("load_factor", "%.3f", st->slots ? (double)st->records / st->slots : 0);
+    PRINT("table_records_min", "%lu", (unsigned long)st->table_min);
+    PRINT("table_records_max", "%lu", (unsigned long)st->table_max);
+    PRINT("run_max", "%lu", (unsigned long)st->run_max);
+    PRINT("hit_probes_mean", "%.3f", st->hit_probes);
+    PRINT("hit_probes_max", "%lu", (unsigned long)st->hit_probes_max);
+    PRINT("miss_probes_mean", "%.3f", st->miss_probes);
+    PRINT("miss_probes_max", "%lu", (unsigned long)st->miss_probes_max);
+    if (st->flags & CDB_F_BLOOM) {
+        PRINT("bloom_fill", "%.3f", st->bloom_fill);
+        PRINT("bloom_fp", "%.4f", st->bloom_fp);
+        PRINT("miss_probes_bloom_mean", "%.3f", st->bloom_fp * st->miss_probes);
+    }
+
+    print_hist(f, "keylen", st->keylen, kv);
+    print_hist(f, "vallen", st->vallen, kv);
+    print_hist(f, "values_per_key", st->per_key, kv);
+    print_hist(f, "probe_runs", st->runs, kv);
+}
@@ -0,0 +1,59 @@
+#ifndef __CDBSTATS_H__
+#define __CDBSTATS_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include "cdb.h"
+
+/* Histogram bucket n counts things from 2^(n-1) up to 2^n - 1; bucket 0
+ * counts zeroes
+ */
+#define CDBSTATS_BUCKETS 33
+
+struct cdb_stats {
+    uint32_t flags;
+    uint64_t file_bytes;
+    uint64_t header_bytes;
+
+    // Records
+    uint64_t records;
+    uint64_t keys;
+    uint64_t values;
+    uint64_t record_bytes;      // Headers, keys and data
+    uint64_t key_bytes;
+    uint64_t value_bytes;       // Before compression
+    uint64_t split_keys;        // Keys in more than one record
+    uint64_t max_values;        // Values of the busiest key
+    uint64_t keylen[CDBSTATS_BUCKETS];
+    uint64_t vallen[CDBSTATS_BUCKETS];
+    uint64_t per_key[CDBSTATS_BUCKETS];
+
+    // Tables
+    uint64_t table_bytes;
+    uint64_t empty_slot_bytes;
+    uint64_t slots;
+    uint64_t table_min;         // Records in the emptiest table
+    uint64_t table_max;
+    uint64_t runs[CDBSTATS_BUCKETS];    // Lengths of runs of full slots
+    uint64_t run_max;
+    double hit_probes;          // Slots read per lookup, on average
+    uint64_t hit_probes_max;
+    double miss_probes;         // Without the bloom filter
+    uint64_t miss_probes_max;
+
+    // Bloom filter
+    uint64_t bloom_bytes;
+    double bloom_fill;          // Fraction of bits set
+    double bloom_fp;            // Chance a miss gets past it
+
+    // Compression
+    uint64_t dict_bytes;
+    uint64_t block_bytes;       // Compressed, with the directory
+    uint64_t block_raw_bytes;
+    uint32_t blocks;
+};
+
+int cdb_stats(struct cdb_ctx *ctx, struct cdb_stats *st);
+void cdb_stats_print(FILE *f, struct cdb_stats *st, int kv);
+
+#endif
@@ -15,169 +15,621 @@
  */
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 
 #include "cgi.h"
 
-#define POST_MAX 4000
+const struct cgi_limits cgi_default_limits = {
+  65536,                        /* Slack sends a few KB at most */
+  256,
+  16
+};
 
-static int is_cgi  = 0;
-static char **argv = NULL;
+#define SKIP -2                 /* Parent of things in a JSON array */
+
+static int is_cgi = 0;
+
+/* Checks on eight bytes at once: is any byte of w less than n (at most
+ * 128), or equal to c?
+ */
+#define ONES 0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+#define HAS_LESS(w, n) (((w) - ONES * (n)) & ~(w) & HIGHS)
+#define HAS_BYTE(w, c) HAS_LESS((w) ^ (ONES * (c)), 1)
+
+static uint64_t
+word(const char *p)
+{
+  uint64_t w;
+
+  memcpy(&w, p, sizeof(w));
+  return w;
+}
 
 static int
-read_char_argv()
+tonum(int c)
 {
-  static int   arg = 0;
-  static char *p;
+  if ((c >= '0') && (c <= '9')) {
+    return c - '0';
+  }
+  if ((c >= 'a') && (c <= 'f')) {
+    return 10 + c - 'a';
+  }
+  if ((c >= 'A') && (c <= 'F')) {
+    return 10 + c - 'A';
+  }
+  return -1;
+}
+
+static int
+add_pair(struct cgi_form *f, char *key, size_t keylen, char *val, size_t vallen,
+         int parent, char type)
+{
+  struct cgi_pair *p;
 
-  if (NULL == argv) {
-    return EOF;
+  if (f->npairs == f->limits.items_max) {
+    return 413;
   }
+  p = &f->pairs[f->npairs++];
+  p->key = key;
+  p->keylen = keylen;
+  p->val = val;
+  p->vallen = vallen;
+  p->parent = parent;
+  p->type = type;
+  return 0;
+}
+
 
-  if (0 == arg) {
-    arg = 1;
-    p = argv[1];
+/*
+ * application/x-www-form-urlencoded
+ */
+
+/* Percent-decode len bytes at p, in place, and return the new length.
+ * Stretches with nothing to decode go by eight bytes at a time, and
+ * aren't moved until something before them has been.
+ */
+static size_t
+url_decode(char *p, size_t len)
+{
+  char *d = p;
+  size_t i = 0;
+
+  while (i < len) {
+    size_t run = i;
+
+    for (; i + 8 <= len; i += 8) {
+      uint64_t w = word(p + i);
+
+      if (HAS_BYTE(w, '%') | HAS_BYTE(w, '+')) {
+        break;
+      }
+    }
+    for (; (i < len) && ('%' != p[i]) && ('+' != p[i]); i += 1);
+    if (d != p + run) {
+      memmove(d, p + run, i - run);
+    }
+    d += i - run;
+
+    if (i == len) {
+      break;
+    } else if ('+' == p[i]) {
+      *(d++) = ' ';
+      i += 1;
+    } else if ((i + 2 < len) && (tonum(p[i + 1]) >= 0) && (tonum(p[i + 2]) >= 0)) {
+      *(d++) = tonum(p[i + 1]) * 16 + tonum(p[i + 2]);
+      i += 3;
+    } else {
+      *(d++) = '%';
+      i += 1;
+    }
   }
+  return d - p;
+}
+
+static int
+parse_form(struct cgi_form *f, char *buf, size_t len)
+{
+  char *end = buf + len;
+  char *p;
 
-  if (! p) {
-    return EOF;
-  } else if (! *p) {
-    arg += 1;
-    p = argv[arg];
-    return '&';
+  for (p = buf; p < end;) {
+    char *amp = memchr(p, '&', end - p);
+    char *eq;
+    char *val;
+    size_t keylen;
+    size_t vallen = 0;
+
+    if (! amp) {
+      amp = end;
+    }
+    if (! (eq = memchr(p, '=', amp - p))) {
+      eq = amp;
+    }
+
+    // Decoding only shrinks things, so there's always room for the NUL
+    keylen = url_decode(p, eq - p);
+    p[keylen] = '\0';
+    if (eq < amp) {
+      val = eq + 1;
+      vallen = url_decode(val, amp - val);
+      val[vallen] = '\0';
+    } else {
+      val = p + keylen;
+    }
+
+    if (keylen || vallen) {
+      int ret = add_pair(f, p, keylen, val, vallen, -1, 's');
+
+      if (ret) {
+        return ret;
+      }
+    }
+    p = amp + 1;
   }
+  return 0;
+}
+
+
+/*
+ * application/json
+ *
+ * Objects become pairs, each member pointing back at the object it's in,
+ * so "event.text" finds the text member of the event member.  Arrays are
+ * checked, but nothing in them is kept.
+ */
+
+struct json {
+  struct cgi_form *f;
+  char *p;
+  char *end;
+  char *nul;                    /* Where the last number ends, once read past */
+};
+
+static int json_value(struct json *j, char *key, size_t keylen, int parent, size_t depth);
 
-  return *(p++);
+/* The next character that isn't space, or 0 at the end */
+static int
+json_peek(struct json *j)
+{
+  for (; j->p < j->end; j->p += 1) {
+    switch (*j->p) {
+      case ' ':
+      case '\t':
+      case '\n':
+      case '\r':
+        continue;
+    }
+    return (unsigned char)*j->p;
+  }
+  return 0;
 }
 
+/* Like json_peek, but take it */
 static int
-read_char_stdin()
+json_next(struct json *j)
 {
-  static long inlen = -1;
+  int c = json_peek(j);
 
-  if (-1 == inlen) {
-    char *p = getenv("CONTENT_LENGTH");
-    if (p) {
-      inlen = atoi(p);
-      if (inlen > POST_MAX) {
-        inlen = POST_MAX;
-      }
-      if (inlen < 0) {
-        inlen = 0;
-      }
-    } else {
-      inlen = 0;
+  if (c) {
+    j->p += 1;
+  }
+  if (j->nul) {
+    *j->nul = '\0';
+    j->nul = NULL;
+  }
+  return c;
+}
+
+static long
+json_hex4(char *s, char *end)
+{
+  long n = 0;
+  int i;
+
+  if (end - s < 4) {
+    return -1;
+  }
+  for (i = 0; i < 4; i += 1) {
+    int d = tonum(s[i]);
+
+    if (d < 0) {
+      return -1;
     }
+    n = n * 16 + d;
+  }
+  return n;
+}
+
+static size_t
+utf8(char *d, long cp)
+{
+  if (cp < 0x80) {
+    d[0] = cp;
+    return 1;
+  } else if (cp < 0x800) {
+    d[0] = 0xc0 | (cp >> 6);
+    d[1] = 0x80 | (cp & 0x3f);
+    return 2;
+  } else if (cp < 0x10000) {
+    d[0] = 0xe0 | (cp >> 12);
+    d[1] = 0x80 | ((cp >> 6) & 0x3f);
+    d[2] = 0x80 | (cp & 0x3f);
+    return 3;
   }
+  d[0] = 0xf0 | (cp >> 18);
+  d[1] = 0x80 | ((cp >> 12) & 0x3f);
+  d[2] = 0x80 | ((cp >> 6) & 0x3f);
+  d[3] = 0x80 | (cp & 0x3f);
+  return 4;
+}
+
+/* Decode the string just past the opening quote at j->p, in place, so
+ * the closing quote becomes its NUL.  Returns its length, or -1 if it's
+ * no good.  Like url_decode, plain stretches go eight bytes at a time.
+ */
+static long
+json_string(struct json *j, char **start)
+{
+  char *s = j->p;
+  char *d = s;
+  char *end = j->end;
+
+  *start = s;
+  for (;;) {
+    char *run = s;
+    long cp;
+
+    for (; s + 8 <= end; s += 8) {
+      uint64_t w = word(s);
+
+      if (HAS_BYTE(w, '"') | HAS_BYTE(w, '\\') | HAS_LESS(w, 0x20)) {
+        break;
+      }
+    }
+    for (; (s < end) && ('"' != *s) && ('\\' != *s) && ((unsigned char)*s >= 0x20); s += 1);
+    if (d != run) {
+      memmove(d, run, s - run);
+    }
+    d += s - run;
+
+    if ((s == end) || ((unsigned char)*s < 0x20)) {
+      return -1;
+    } else if ('"' == *s) {
+      *d = '\0';
+      j->p = s + 1;
+      return d - *start;
+    } else if (++s == end) {
+      return -1;
+    }
+
+    switch (*(s++)) {
+      case '"':
+      case '\\':
+      case '/':
+        *(d++) = s[-1];
+        break;
+      case 'b':
+        *(d++) = '\b';
+        break;
+      case 'f':
+        *(d++) = '\f';
+        break;
+      case 'n':
+        *(d++) = '\n';
+        break;
+      case 'r':
+        *(d++) = '\r';
+        break;
+      case 't':
+        *(d++) = '\t';
+        break;
+      case 'u':
+        if ((cp = json_hex4(s, end)) < 0) {
+          return -1;
+        }
+        s += 4;
+        if ((cp >= 0xd800) && (cp < 0xdc00) && (end - s >= 2) &&
+            ('\\' == s[0]) && ('u' == s[1])) {
+          long lo = json_hex4(s + 2, end);
 
-  if (inlen) {
-    inlen -= 1;
-    return getchar();
+          if ((lo >= 0xdc00) && (lo < 0xe000)) {
+            cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+            s += 6;
+          }
+        }
+        if ((cp >= 0xd800) && (cp < 0xe000)) {
+          cp = 0xfffd;
+        }
+        d += utf8(d, cp);
+        break;
+      default:
+        return -1;
+    }
   }
-  return EOF;
 }
 
 static int
-read_char_query_string()
+json_object(struct json *j, int parent, size_t depth)
 {
-  static char *p = (char *)-1;
+  if ('}' == json_peek(j)) {
+    j->p += 1;
+    return 0;
+  }
+  for (;;) {
+    char *key;
+    long keylen;
+    int ret;
+    int c;
 
-  if ((char *)-1 == p) {
-    p = getenv("QUERY_STRING");
+    if ('"' != json_next(j)) {
+      return 400;
+    }
+    if ((keylen = json_string(j, &key)) < 0) {
+      return 400;
+    }
+    if (':' != json_next(j)) {
+      return 400;
+    }
+    ret = json_value(j, (SKIP == parent) ? NULL : key, keylen, parent, depth);
+    if (ret) {
+      return ret;
+    }
+
+    c = json_next(j);
+    if ('}' == c) {
+      return 0;
+    } else if (',' != c) {
+      return 400;
+    }
+  }
+}
+
+static int
+json_array(struct json *j, size_t depth)
+{
+  if (']' == json_peek(j)) {
+    j->p += 1;
+    return 0;
   }
+  for (;;) {
+    int ret = json_value(j, NULL, 0, SKIP, depth);
+    int c;
 
-  if (! p) {
-    return EOF;
-  } else if (! *p) {
-    return EOF;
-  } else {
-    return *(p++);
+    if (ret) {
+      return ret;
+    }
+    c = json_next(j);
+    if (']' == c) {
+      return 0;
+    } else if (',' != c) {
+      return 400;
+    }
   }
 }
 
-static int (* read_char)() = read_char_argv;
+/* Read one value, and keep it as key's, unless key is NULL */
+static int
+json_value(struct json *j, char *key, size_t keylen, int parent, size_t depth)
+{
+  int c = json_peek(j);
+  char *val = j->p;
+  size_t len;
+  int ret;
 
-int
-cgi_init(char *global_argv[])
+  switch (c) {
+    case '"':
+      j->p += 1;
+      if ((ret = json_string(j, &val)) < 0) {
+        return 400;
+      }
+      return key ? add_pair(j->f, key, keylen, val, ret, parent, 's') : 0;
+    case '[':
+    case '{':
+      if (depth == j->f->limits.depth_max) {
+        return 413;
+      }
+      j->p += 1;
+      if ('[' == c) {
+        return json_array(j, depth + 1);
+      } else if (! key) {
+        return json_object(j, SKIP, depth + 1);
+      } else if ((ret = add_pair(j->f, key, keylen, key + keylen, 0, parent, 'o'))) {
+        return ret;
+      }
+      return json_object(j, j->f->npairs - 1, depth + 1);
+  }
+
+  // Number, true, false or null; it's NUL-terminated once we're past it
+  while ((j->p < j->end) && *j->p && strchr("+-.0123456789Eeaflnrstu", *j->p)) {
+    j->p += 1;
+  }
+  len = j->p - val;
+  if (! len) {
+    return 400;
+  } else if (((c < '0') || (c > '9')) && ('-' != c) &&
+             ! ((4 == len) && (0 == memcmp(val, "true", 4))) &&
+             ! ((5 == len) && (0 == memcmp(val, "false", 5))) &&
+             ! ((4 == len) && (0 == memcmp(val, "null", 4)))) {
+    return 400;
+  }
+  j->nul = j->p;
+  return key ? add_pair(j->f, key, keylen, val, len, parent, 'v') : 0;
+}
+
+static int
+parse_json(struct cgi_form *f, char *buf, size_t len)
 {
-  char *rm = getenv("REQUEST_METHOD");
+  struct json j = {f, buf, buf + len, NULL};
+  int ret;
 
-  if (! rm) {
-    read_char = read_char_argv;
-    argv = global_argv;
-  } else if (0 == strcmp(rm, "POST")) {
-    read_char = read_char_stdin;
-    is_cgi = 1;
-  } else if (0 == strcmp(rm, "GET")) {
-    read_char = read_char_query_string;
-    is_cgi = 1;
-  } else {
-    printf(("405 Method not allowed\r\n"
-            "Allow: GET, POST\r\n"
-            "Content-type: text/plain\r\n"
-            "\r\n"
-            "%s is not allowed.\n"),
-           rm);
-    return -1;
+  f->json = 1;
+  if ('{' != json_next(&j)) {
+    return 400;
+  }
+  if ((ret = json_object(&j, -1, 1))) {
+    return ret;
   }
+  return json_peek(&j) || (j.p < j.end) ? 400 : 0;
+}
 
-  return 0;
+
+/*
+ * Requests
+ */
+
+int
+cgi_form_init(struct cgi_form *f, const struct cgi_limits *limits)
+{
+  memset(f, 0, sizeof(*f));
+  f->limits = limits ? *limits : cgi_default_limits;
+  f->pairs = calloc(f->limits.items_max + 1, sizeof(*f->pairs));
+  return f->pairs ? 0 : -1;
 }
 
-static char
-tonum(int c)
+void
+cgi_form_free(struct cgi_form *f)
 {
-  if ((c >= '0') && (c <= '9')) {
-    return c - '0';
+  free(f->pairs);
+  free(f->buf);
+  memset(f, 0, sizeof(*f));
+}
+
+/* Parse len bytes at buf, which must have room for one more, in place.
+ * Returns 0, or the HTTP status to refuse the request with.
+ */
+int
+cgi_parse(struct cgi_form *f, char *buf, size_t len, const char *content_type)
+{
+  f->npairs = 0;
+  f->json = 0;
+  if (len > f->limits.body_max) {
+    return 413;
   }
-  if ((c >= 'a') && (c <= 'f')) {
-    return 10 + c - 'a';
+  if (content_type && (0 == strncasecmp(content_type, "application/json", 16))) {
+    return parse_json(f, buf, len);
   }
-  if ((c >= 'A') && (c <= 'F')) {
-    return 10 + c - 'A';
+  return parse_form(f, buf, len);
+}
+
+static char *
+form_buf(struct cgi_form *f, size_t len)
+{
+  if (len + 1 > f->bufsize) {
+    char *buf = realloc(f->buf, len + 1);
+
+    if (! buf) {
+      return NULL;
+    }
+    f->buf = buf;
+    f->bufsize = len + 1;
   }
-  return 0;
+  return f->buf;
 }
 
-static char
-read_hex()
+/* Read the request a web server ran us for, or if there wasn't one, the
+ * items in argv, for testing from a shell.  Returns like cgi_parse.
+ */
+int
+cgi_read(struct cgi_form *f, char *global_argv[])
 {
-  int a = read_char();
-  int b = read_char();
+  char *rm = getenv("REQUEST_METHOD");
+  char *p;
+  size_t len = 0;
+
+  if (! rm) {
+    char **arg;
+
+    for (arg = global_argv + 1; *arg; arg += 1) {
+      len += strlen(*arg) + 1;
+    }
+    if (len > f->limits.body_max) {
+      return 413;
+    } else if (! form_buf(f, len)) {
+      return 500;
+    }
+    for (p = f->buf, arg = global_argv + 1; *arg; arg += 1) {
+      p = stpcpy(p, *arg);
+      *(p++) = '&';
+    }
+    return cgi_parse(f, f->buf, len, NULL);
+  }
+
+  is_cgi = 1;
+  if (0 == strcmp(rm, "POST")) {
+    long cl = (p = getenv("CONTENT_LENGTH")) ? atol(p) : 0;
 
-  return tonum(a)*16 + tonum(b);
+    if (cl < 0) {
+      return 400;
+    } else if ((size_t)cl > f->limits.body_max) {
+      return 413;
+    } else if (! form_buf(f, cl)) {
+      return 500;
+    } else if (fread(f->buf, 1, cl, stdin) != (size_t)cl) {
+      return 400;
+    }
+    return cgi_parse(f, f->buf, cl, getenv("CONTENT_TYPE"));
+  } else if (0 == strcmp(rm, "GET")) {
+    p = getenv("QUERY_STRING");
+    len = p ? strlen(p) : 0;
+    if (len > f->limits.body_max) {
+      return 413;
+    } else if (! form_buf(f, len)) {
+      return 500;
+    }
+    memcpy(f->buf, p ? p : "", len);
+    return cgi_parse(f, f->buf, len, NULL);
+  }
+  return 405;
 }
 
-/* Read a key or a value.  Since & and = aren't supposed to appear
-   outside of boundaries, we can use the same function for both.
-*/
-size_t
-cgi_item(char *str, size_t maxlen)
+/* Value of name, or NULL.  In JSON, name can be a path, like
+ * "event.text".
+ */
+const char *
+cgi_get(struct cgi_form *f, const char *name)
 {
-  int    c;
-  size_t pos = 0;
+  int parent = -1;
+  size_t len = f->json ? strcspn(name, ".") : strlen(name);
+  size_t i;
 
-  while (1) {
-    c = read_char();
-    switch (c) {
-      case EOF:
-      case '=':
-      case '&':
-        str[pos] = '\0';
-        return pos;
-      case '%':
-        c = read_hex();
-        break;
-      case '+':
-        c = ' ';
-        break;
+  for (i = 0; i < f->npairs; i += 1) {
+    struct cgi_pair *p = &f->pairs[i];
+
+    if ((p->parent != parent) || (p->keylen != len) || memcmp(p->key, name, len)) {
+      continue;
     }
-    if (pos < maxlen - 1) {
-      str[pos] = c;
-      pos += 1;
+    if (! name[len]) {
+      return p->val;
     }
+    parent = i;
+    name += len + 1;
+    len = strcspn(name, ".");
+  }
+  return NULL;
+}
+
+const char *
+cgi_reason(int status)
+{
+  switch (status) {
+    case 200:
+      return "OK";
+    case 400:
+      return "Bad Request";
+    case 405:
+      return "Method Not Allowed";
+    case 411:
+      return "Length Required";
+    case 413:
+      return "Payload Too Large";
+    case 431:
+      return "Request Header Fields Too Large";
   }
+  return "Internal Server Error";
 }
 
 void
@@ -187,3 +639,17 @@ cgi_header(char *content_type)
         printf("Content-type: %s\r\n\r\n", content_type);
     }
 }
+
+/* Refuse the request */
+void
+cgi_error(int status)
+{
+  if (is_cgi) {
+    printf("Status: %d %s\r\n", status, cgi_reason(status));
+    if (405 == status) {
+      printf("Allow: GET, POST\r\n");
+    }
+    printf("Content-type: text/plain\r\n\r\n");
+  }
+  printf("%s\n", cgi_reason(status));
+}
@@ -3,8 +3,43 @@
 
 #include <stddef.h>
 
-int cgi_init(char *global_argv[]);
-size_t cgi_item(char *str, size_t maxlen);
+/* What a request may hold.  Anything bigger is refused, not cut short. */
+struct cgi_limits {
+  size_t body_max;              /* Bytes of form or JSON */
+  size_t items_max;             /* Keys, counting JSON objects */
+  size_t depth_max;             /* JSON objects and arrays, one in another */
+};
+
+extern const struct cgi_limits cgi_default_limits;
+
+/* One key and its value.  Both point into the request buffer, decoded in
+ * place and NUL-terminated.
+ */
+struct cgi_pair {
+  const char *key;
+  size_t keylen;
+  const char *val;              /* Empty for a JSON object */
+  size_t vallen;
+  int parent;                   /* JSON object it's in, or -1 */
+  char type;                    /* 's'tring, 'o'bject, or 'v'alue (number, true...) */
+};
+
+struct cgi_form {
+  struct cgi_limits limits;
+  struct cgi_pair *pairs;
+  size_t npairs;
+  int json;
+  char *buf;                    /* What cgi_read() read */
+  size_t bufsize;
+};
+
+int cgi_form_init(struct cgi_form *f, const struct cgi_limits *limits);
+void cgi_form_free(struct cgi_form *f);
+int cgi_parse(struct cgi_form *f, char *buf, size_t len, const char *content_type);
+int cgi_read(struct cgi_form *f, char *global_argv[]);
+const char *cgi_get(struct cgi_form *f, const char *name);
+const char *cgi_reason(int status);
 void cgi_header(char *content_type);
+void cgi_error(int status);
 
 #endif
@@ -0,0 +1,221 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sysexits.h>
+#include "cgi.h"
+
+int
+usage(char *self)
+{
+    fprintf(stderr, "Usage: %s [OPTIONS]\n", self);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Time parsing made-up Slack requests: slash commands, which are\n");
+    fprintf(stderr, "forms, and Events API callbacks, which are JSON.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "-n COUNT    Parse COUNT requests of each kind (default 200000)\n");
+    fprintf(stderr, "-t BYTES    Length of the message text (default 200)\n");
+    fprintf(stderr, "-e PERCENT  How much of the text needs escaping (default 10)\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Results are one line per kind, of NAME=VALUE pairs.\n");
+
+    return EX_USAGE;
+}
+
+static uint64_t rng = 0x9e3779b97f4a7c15ull;
+
+static uint64_t
+next_rand(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static double
+now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* Message text: mostly words, with escape percent of it spaces,
+ * punctuation and accented letters
+ */
+static char *
+make_text(size_t len, unsigned escape)
+{
+    static const char *odd[] = {" ", ",", "?", "&", "é", "\"", "\n", "ü"};
+    char *text = malloc(len + 4);
+    size_t i = 0;
+
+    while (i < len) {
+        if (next_rand() % 100 < escape) {
+            const char *s = odd[next_rand() % 8];
+
+            memcpy(text + i, s, strlen(s));
+            i += strlen(s);
+        } else {
+            text[i++] = 'a' + next_rand() % 26;
+        }
+    }
+    text[i] = '\0';
+    return text;
+}
+
+static void
+url_encode(FILE *f, const char *s)
+{
+    for (; *s; s += 1) {
+        if (' ' == *s) {
+            fputc('+', f);
+        } else if (((*s >= 'a') && (*s <= 'z')) || ((*s >= '0') && (*s <= '9'))) {
+            fputc(*s, f);
+        } else {
+            fprintf(f, "%%%02X", (unsigned char)*s);
+        }
+    }
+}
+
+static void
+json_encode(FILE *f, const char *s)
+{
+    for (; *s; s += 1) {
+        if ('\n' == *s) {
+            fputs("\\n", f);
+        } else if (('"' == *s) || ('\\' == *s)) {
+            fprintf(f, "\\%c", *s);
+        } else if ((unsigned char)*s >= 0x80) {
+            // Slack sends these escaped; make it two bytes, one escape
+            fprintf(f, "\\u00%02x", ((s[0] & 0x1f) << 6) | (s[1] & 0x3f));
+            s += 1;
+        } else {
+            fputc(*s, f);
+        }
+    }
+}
+
+static char *
+make_form(const char *text, size_t *len)
+{
+    char *buf;
+    FILE *f = open_memstream(&buf, len);
+
+    fprintf(f, "token=gIkuvaNzQIHg97ATvDxqgjtO&team_id=T0001&team_domain=example"
+            "&enterprise_id=E0001&enterprise_name=Globular%%20Construct%%20Inc"
+            "&channel_id=C2147483705&channel_name=test&user_id=U2147483697"
+            "&user_name=Steve&command=%%2Fweather&text=");
+    url_encode(f, text);
+    fprintf(f, "&response_url=https%%3A%%2F%%2Fhooks.slack.com%%2Fcommands%%2F1234%%2F5678"
+            "&trigger_id=13345224609.738474920.8088930838d88f008e0&api_app_id=A123456");
+    fclose(f);
+    return buf;
+}
+
+static char *
+make_json(const char *text, size_t *len)
+{
+    char *buf;
+    FILE *f = open_memstream(&buf, len);
+
+    fprintf(f, "{\"token\":\"XXYYZZ\",\"team_id\":\"TXXXXXXXX\",\"api_app_id\":\"AXXXXXXXXX\","
+            "\"event\":{\"type\":\"message\",\"channel\":\"C2147483705\",\"user\":\"U2147483697\","
+            "\"text\":\"");
+    json_encode(f, text);
+    fprintf(f, "\",\"ts\":\"1355517523.000005\",\"event_ts\":\"1355517523.000005\","
+            "\"channel_type\":\"channel\",\"blocks\":[{\"type\":\"rich_text\",\"elements\":"
+            "[{\"type\":\"rich_text_section\",\"elements\":[{\"type\":\"text\",\"text\":\"hi\"}]}]}]},"
+            "\"type\":\"event_callback\",\"authed_users\":[\"UXXXXXXX1\",\"UXXXXXXX2\"],"
+            "\"event_id\":\"Ev08MFMKH6\",\"event_time\":1234567890}");
+    fclose(f);
+    return buf;
+}
+
+/* Parse body count times, from a fresh copy each time, since parsing
+ * decodes it in place
+ */
+static int
+run(const char *kind, struct cgi_form *form, const char *body, size_t len,
+        const char *content_type, const char *check, unsigned long count)
+{
+    char *buf = malloc(len + 1);
+    double start;
+    double us;
+    unsigned long i;
+
+    start = now_us();
+    for (i = 0; i < count; i += 1) {
+        memcpy(buf, body, len);
+        if (cgi_parse(form, buf, len, content_type) || ! cgi_get(form, check)) {
+            fprintf(stderr, "%s: didn't parse\n", kind);
+            free(buf);
+            return EX_SOFTWARE;
+        }
+    }
+    us = now_us() - start;
+    free(buf);
+
+    printf("kind=%s n=%lu bytes=%lu items=%lu ns_per_request=%.0f mb_per_s=%.0f\n",
+            kind, count, (unsigned long)len, (unsigned long)form->npairs,
+            us * 1e3 / count, len * (double)count / us);
+    return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct cgi_form form;
+    unsigned long count = 200000;
+    size_t textlen = 200;
+    unsigned escape = 10;
+    char *text;
+    char *body;
+    size_t len;
+    int ret;
+
+    for (;;) {
+        int opt = getopt(argc, argv, "hn:t:e:");
+
+        if (-1 == opt) {
+            break;
+        }
+        switch (opt) {
+            case 'n':
+                count = strtoul(optarg, NULL, 0);
+                break;
+            case 't':
+                textlen = strtoul(optarg, NULL, 0);
+                break;
+            case 'e':
+                escape = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                return usage(argv[0]);
+        }
+    }
+
+    if (cgi_form_init(&form, NULL)) {
+        perror("cgi_form_init");
+        return EX_OSERR;
+    }
+    form.limits.body_max = (size_t)-1;
+    text = make_text(textlen, escape);
+
+    body = make_form(text, &len);
+    ret = run("form", &form, body, len, NULL, "text", count);
+    free(body);
+    if (! ret) {
+        body = make_json(text, &len);
+        ret = run("json", &form, body, len, "application/json", "event.text", count);
+        free(body);
+    }
+
+    free(text);
+    cgi_form_free(&form);
+    return ret;
+}
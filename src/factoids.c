@@ -3,261 +3,2266 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <fnmatch.h>
-#include <ctype.h>
 #include <sys/time.h>
 #include <sysexits.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <pthread.h>
 #include "cdb.h"
 #include "cdbmake.h"
+#include "cdbstats.h"
+#include "keyidx.h"
+#include "ac.h"
+#include "casefold.h"
+#include "shard.h"
+
+/* Upper bound on shards rebuilt at once */
+#define MAX_THREADS 16
+
+/* With CDB.hits, note one lookup in this many there, and stop noting
+ * once it's this big, until -C folds it in
+ */
+#define HITS_SAMPLE 4
+#define HITS_MAX (16 << 20)
+
+enum action {
+    ACT_ONE,
+    ACT_ALL,
+    ACT_COUNT,
+    ACT_NTH,
+    ACT_ADD,
+    ACT_DEL,
+    ACT_NEW,
+    ACT_INDEX,
+    ACT_SUBSTRING,
+    ACT_PREFIX,
+    ACT_FUZZY,
+    ACT_IMPORT,
+    ACT_EXPORT,
+    ACT_COMPACT,
+    ACT_HITS,
+    ACT_STATS,
+    ACT_AUTOMATON,
+    ACT_SCAN
+};
+
+/* Long options with no short form */
+enum {
+    OPT_STATS = 256
+};
+
+static struct option long_options[] = {
+    {"stats", optional_argument, NULL, OPT_STATS},
+    {NULL, 0, NULL, 0}
+};
 
 int
 usage(char *self)
 {
-    fprintf(stderr, "Usage: %s [OPTIONS] CDB \"KEY\"\n", self);
-    fprintf(stderr, "\n");
-    fprintf(stderr, "Default:   Display one randomly-picked entry for KEY\n");
-    fprintf(stderr, "-n         Create database from scratch, ignoring KEY\n");
-    fprintf(stderr, "-l         Display all entries for KEY\n");
-    fprintf(stderr, "-a VAL     Append VAL to entries for KEY\n");
-    fprintf(stderr, "-r GLOB    Remove entries matching GLOB from KEY\n");
-    fprintf(stderr, "\n");
-    fprintf(stderr, "KEY is always converted to lowercase (Latin-1 only)\n");
+    fprintf(stderr, "Usage: %s [OPTIONS] CDB \"KEY\"\n", self);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Default:   Display one randomly-picked entry for KEY\n");
+    fprintf(stderr, "-n         Create database from scratch, ignoring KEY\n");
+    fprintf(stderr, "-g         With -n, store each KEY's entries together\n");
+    fprintf(stderr, "-z         With -n or -I, compress entries\n");
+    fprintf(stderr, "-l         Display all entries for KEY\n");
+    fprintf(stderr, "-c         Display the number of entries for KEY\n");
+    fprintf(stderr, "-i NUM     Display entry NUM (from 0) for KEY\n");
+    fprintf(stderr, "-a VAL     Append VAL to entries for KEY\n");
+    fprintf(stderr, "-r GLOB    Remove entries matching GLOB from KEY\n");
+    fprintf(stderr, "-x         Build a key index (CDB.idx), kept up to date after\n");
+    fprintf(stderr, "-s         Display keys containing KEY (needs -x)\n");
+    fprintf(stderr, "-p         Display keys starting with KEY (needs -x)\n");
+    fprintf(stderr, "-f         Display keys within 2 edits of KEY, closest first (needs -x)\n");
+    fprintf(stderr, "-K         Build a key automaton (CDB.ac), kept up to date after\n");
+    fprintf(stderr, "-S         Display every key found in KEY, or each line of stdin (needs -K)\n");
+    fprintf(stderr, "-I FMT     Replace database with records from stdin, ignoring KEY\n");
+    fprintf(stderr, "-E FMT     Write every record to stdout, ignoring KEY\n");
+    fprintf(stderr, "-M MB      With -I, hold at most MB megabytes of record metadata in memory\n");
+    fprintf(stderr, "-P NUM     With -n or -I, split the database into NUM shards\n");
+    fprintf(stderr, "-C         Rebuild the database (each shard in parallel), adding -g and -z\n");
+    fprintf(stderr, "-H         Count lookups (CDB.hits), so -C can put busy KEYs first\n");
+    fprintf(stderr, "--stats    Display table fill, probe lengths, and sizes, ignoring KEY\n");
+    fprintf(stderr, "--stats=kv Same, as name=value lines\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "FMT is \"cdb\" (+klen,dlen:key->data lines, then a blank line)\n");
+    fprintf(stderr, "or \"tsv\" (KEY, tab, VAL; \\t \\n and \\\\ escape those characters).\n");
+    fprintf(stderr, "With -g, importing is quickest with KEYs in sorted order.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "-S prints OFFSET, tab, LENGTH, tab, key for each key found, where\n");
+    fprintf(stderr, "OFFSET and LENGTH are in bytes of the text; reading stdin, a blank\n");
+    fprintf(stderr, "line follows each line's keys.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "A sharded CDB is a directory; each KEY lives in one shard, so reading\n");
+    fprintf(stderr, "or changing it only touches that shard.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "KEY is always case-folded (UTF-8)\n");
+
+    return EX_USAGE;
+}
+
+/* text, case-folded into a new string */
+static char *
+fold_key(char *text)
+{
+    size_t len = strlen(text);
+    char *ret = (char *)malloc(CASEFOLD_SIZE(len));
+
+    if (! ret) {
+        perror("Folding key");
+        return NULL;
+    }
+    ret[casefold(ret, text, len)] = '\0';
+
+    return ret;
+}
+
+static FILE *
+open_db(char *filename, struct cdb_ctx *c)
+{
+    FILE *f = fopen(filename, "rb");
+
+    if (! f) {
+        perror("Opening database");
+        return NULL;
+    }
+    if (cdb_init(c, f)) {
+        fprintf(stderr, "%s: unsupported database format\n", filename);
+        fclose(f);
+        return NULL;
+    }
+
+    return f;
+}
+
+static void
+close_db(FILE *f, struct cdb_ctx *c)
+{
+    cdb_fini(c);
+    fclose(f);
+}
+
+/* How many files filename is made of: its shards, or just itself */
+static uint32_t
+db_files(char *filename, struct shards *s)
+{
+    if (shards_open(s, filename)) {
+        s->n = 0;
+        return 1;
+    }
+    return s->n;
+}
+
+/* Name of file i of filename */
+static void
+db_file(char *filename, struct shards *s, uint32_t i, char *fn, size_t fnlen)
+{
+    if (s->n) {
+        shards_path(s, i, fn, fnlen);
+    } else {
+        snprintf(fn, fnlen, "%s", filename);
+    }
+}
+
+/* The file that holds key */
+static char *
+key_file(char *filename, char *key, char *fn, size_t fnlen)
+{
+    struct shards s;
+
+    if (shards_open(&s, filename)) {
+        return filename;
+    }
+    shards_path(&s, shards_pick(&s, key, strlen(key)), fn, fnlen);
+    return fn;
+}
+
+/* Run fn(0, arg) to fn(n - 1, arg), from up to MAX_THREADS threads */
+struct parallel {
+    pthread_mutex_t lock;
+    uint32_t next;
+    uint32_t n;
+    int (*fn)(uint32_t i, void *arg);
+    void *arg;
+    int ret;
+};
+
+static void *
+parallel_worker(void *arg)
+{
+    struct parallel *p = (struct parallel *)arg;
+
+    for (;;) {
+        uint32_t i;
+        int ret;
+
+        pthread_mutex_lock(&p->lock);
+        i = p->next++;
+        pthread_mutex_unlock(&p->lock);
+
+        if (i >= p->n) {
+            break;
+        }
+        if ((ret = p->fn(i, p->arg))) {
+            pthread_mutex_lock(&p->lock);
+            p->ret = ret;
+            pthread_mutex_unlock(&p->lock);
+        }
+    }
+
+    return NULL;
+}
+
+static int
+parallel(uint32_t n, int (*fn)(uint32_t i, void *arg), void *arg)
+{
+    pthread_t threads[MAX_THREADS];
+    struct parallel p;
+    int nthreads = 0;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+
+    pthread_mutex_init(&p.lock, NULL);
+    p.next = 0;
+    p.n = n;
+    p.fn = fn;
+    p.arg = arg;
+    p.ret = 0;
+    for (; (nthreads + 1 < (long)n) && (nthreads < ncpus - 1) && (nthreads < MAX_THREADS); nthreads += 1) {
+        if (pthread_create(&threads[nthreads], NULL, parallel_worker, &p)) {
+            break;
+        }
+    }
+    parallel_worker(&p);
+    for (i = 0; i < nthreads; i += 1) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&p.lock);
+
+    return p.ret;
+}
+
+/* Uniform random number in [0, n) */
+static uint32_t
+uniform(uint32_t n)
+{
+    unsigned long range = (unsigned long)RAND_MAX + 1;
+    unsigned long limit = range - (range % n);
+    unsigned long r;
+
+    do {
+        r = (unsigned long)rand();
+    } while (r >= limit);
+
+    return r % n;
+}
+
+static void
+hits_name(char *filename, char *fn, size_t fnlen)
+{
+    snprintf(fn, fnlen, "%s.hits", filename);
+}
+
+/* Now and then, note a lookup of key in CDB.hits, if there is one.
+ * Each line is "klen:key".
+ */
+static void
+note_hit(char *filename, char *key)
+{
+    char fn[8192];
+    char *line;
+    size_t len;
+    struct stat st;
+    int fd;
+
+    if (uniform(HITS_SAMPLE)) {
+        return;
+    }
+    hits_name(filename, fn, sizeof(fn));
+    if (-1 == (fd = open(fn, O_WRONLY | O_APPEND))) {
+        return;
+    }
+    if ((0 == fstat(fd, &st)) && (st.st_size < HITS_MAX)) {
+        len = strlen(key);
+        if ((line = (char *)malloc(len + 32))) {
+            // One write, so lines from parallel handlers don't interleave
+            len = snprintf(line, len + 32, "%lu:%s\n", (unsigned long)len, key);
+            if (-1 == write(fd, line, len)) {
+                perror("Noting lookup");
+            }
+            free(line);
+        }
+    }
+    close(fd);
+}
+
+int 
+choose(char *filename, char *key)
+{
+    struct cdb_ctx c;
+    size_t keylen = strlen(key);
+    uint32_t nresults;
+    FILE *f;
+
+    if (! (f = open_db(filename, &c))) {
+        return EX_NOINPUT;
+    }
+    note_hit(filename, key);
+
+    cdb_find(&c, key, keylen);
+    nresults = cdb_count(&c);
+
+    if (nresults > 0) {
+        uint32_t vallen;
+        char val[8192];
+
+        vallen = cdb_nth(&c, uniform(nresults), val, sizeof(val));
+        printf("%.*s\n", vallen, val);
+    }
+
+    close_db(f, &c);
+
+    return 0;
+}
+
+int
+count(char *filename, char *key)
+{
+    struct cdb_ctx c;
+    size_t keylen = strlen(key);
+    FILE *f;
+
+    if (! (f = open_db(filename, &c))) {
+        return EX_NOINPUT;
+    }
+    note_hit(filename, key);
+
+    cdb_find(&c, key, keylen);
+    printf("%u\n", cdb_count(&c));
+
+    close_db(f, &c);
+
+    return 0;
+}
+
+int
+nth(char *filename, char *key, uint32_t n)
+{
+    struct cdb_ctx c;
+    size_t keylen = strlen(key);
+    FILE *f;
+
+    if (! (f = open_db(filename, &c))) {
+        return EX_NOINPUT;
+    }
+    note_hit(filename, key);
+
+    cdb_find(&c, key, keylen);
+    if (n < cdb_count(&c)) {
+        uint32_t vallen;
+        char val[8192];
+
+        vallen = cdb_nth(&c, n, val, sizeof(val));
+        printf("%.*s\n", vallen, val);
+    }
+
+    close_db(f, &c);
+
+    return 0;
+}
+
+int
+list(char *filename, char *key)
+{
+    struct cdb_ctx c;
+    size_t keylen = strlen(key);
+    FILE *f;
+
+    if (! (f = open_db(filename, &c))) {
+        return EX_NOINPUT;
+    }
+    note_hit(filename, key);
+
+    cdb_find(&c, key, keylen);
+    for (;;) {
+        uint32_t vallen;
+        char val[8192];
+
+        vallen = cdb_next(&c, val, sizeof(val)); 
+        if (vallen == 0) {
+            break;
+        }
+        printf("%.*s\n", vallen, val);
+    }
+
+    close_db(f, &c);
+
+    return 0;
+}
+
+/* Does KEY already have exactly VAL? */
+static int
+has_value(struct cdb_ctx *c, char *key, size_t keylen, char *val, size_t vallen)
+{
+    char buf[8192];
+    uint32_t n;
+
+    if (vallen > sizeof(buf)) {
+        return 0;
+    }
+
+    cdb_find(c, key, keylen);
+    while ((n = cdb_next(c, buf, sizeof(buf)))) {
+        if ((n == vallen) && (0 == memcmp(buf, val, vallen))) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int
+setup_copy(char *infn, struct cdb_ctx *inc, FILE **inf,
+        char **outfn, struct cdbmake_ctx *outc, FILE **outf)
+{
+    static char tmpfn[8192];
+
+    if (! (*inf = open_db(infn, inc))) {
+        return EX_NOINPUT;
+    }
+
+    snprintf(tmpfn, sizeof(tmpfn), "%s.%d", infn, getpid());
+    *outf = fopen(tmpfn, "wb");
+    if (! *outf) {
+        perror("Creating temporary database");
+        return EX_CANTCREAT;
+    }
+
+    cdbmake_init(outc, *outf, inc->db.flags);
+
+    *outfn = strdup(tmpfn);
+
+    return 0;
+}
+
+/* Replace infn with the copy, unless the copy couldn't be written */
+static int
+finish_copy(char *infn, struct cdb_ctx *inc, FILE **inf,
+        char *outfn, struct cdbmake_ctx *outc, FILE **outf)
+{
+    int ret = 0;
+
+    if (cdbmake_finalize(outc)) {
+        ret = EX_IOERR;
+    }
+    fclose(*outf);
+    close_db(*inf, inc);
+
+    if (ret) {
+        remove(outfn);
+    } else {
+        rename(outfn, infn);
+    }
+    free(outfn);
+
+    return ret;
+}
+
+/* Files built from a database's keys, kept up to date once they exist */
+struct sidecar {
+    char *suffix;
+    char *what;
+    int (*build)(FILE *db, FILE *out);
+};
+
+static struct sidecar key_index = {".idx", "index", keyidx_build};
+static struct sidecar key_automaton = {".ac", "automaton", ac_build};
+
+static void
+sidecar_name(char *filename, struct sidecar *sc, char *fn, size_t fnlen)
+{
+    snprintf(fn, fnlen, "%s%s", filename, sc->suffix);
+}
+
+int
+rebuild_sidecar(char *filename, struct sidecar *sc)
+{
+    char scfn[8192];
+    char tmpfn[sizeof(scfn) + 16];
+    char msg[64];
+    FILE *db;
+    FILE *out;
+    int ret;
+
+    sidecar_name(filename, sc, scfn, sizeof(scfn));
+    snprintf(tmpfn, sizeof(tmpfn), "%s.%d", scfn, getpid());
+
+    if (! (db = fopen(filename, "rb"))) {
+        perror("Opening database");
+        return EX_NOINPUT;
+    }
+    if (! (out = fopen(tmpfn, "wb"))) {
+        snprintf(msg, sizeof(msg), "Creating temporary %s", sc->what);
+        perror(msg);
+        fclose(db);
+        return EX_CANTCREAT;
+    }
+
+    ret = sc->build(db, out);
+    if (fclose(out)) {
+        ret = -1;
+    }
+    fclose(db);
+
+    if (ret) {
+        fprintf(stderr, "%s: unable to build %s\n", filename, sc->what);
+        remove(tmpfn);
+        return EX_DATAERR;
+    }
+    rename(tmpfn, scfn);
+
+    return 0;
+}
+
+/* Rebuild the index and automaton, but only the ones there are */
+static void
+sync_index(char *filename)
+{
+    struct sidecar *scs[] = {&key_index, &key_automaton, NULL};
+    struct sidecar **sc;
+
+    for (sc = scs; *sc; sc += 1) {
+        char scfn[8192];
+
+        sidecar_name(filename, *sc, scfn, sizeof(scfn));
+        if (0 == access(scfn, F_OK)) {
+            rebuild_sidecar(filename, *sc);
+        }
+    }
+}
+
+/* Build sc for every file of filename */
+int
+rebuild_all(char *filename, struct sidecar *sc)
+{
+    struct shards s;
+    uint32_t n = db_files(filename, &s);
+    uint32_t i;
+    int ret = 0;
+
+    for (i = 0; (i < n) && ! ret; i += 1) {
+        char fn[8192];
+
+        db_file(filename, &s, i, fn, sizeof(fn));
+        ret = rebuild_sidecar(fn, sc);
+    }
+
+    return ret;
+}
+
+/* Keys found in shards, for sorting or skipping repeats */
+struct keylist {
+    char **keys;
+    size_t n;
+    size_t size;
+    size_t printed;
+};
+
+static void
+print_key(char *key, size_t keylen, void *arg)
+{
+    printf("%.*s\n", (int)keylen, key);
+}
+
+static void
+collect_key(char *key, size_t keylen, void *arg)
+{
+    struct keylist *l = (struct keylist *)arg;
+
+    if (l->n == l->size) {
+        size_t size = l->size ? l->size * 2 : 64;
+        char **k;
+
+        if (! (k = (char **)realloc(l->keys, size * sizeof(char *)))) {
+            return;
+        }
+        l->keys = k;
+        l->size = size;
+    }
+    if ((l->keys[l->n] = strndup(key, keylen))) {
+        l->n += 1;
+    }
+}
+
+static int
+cmp_keys(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static int
+search_one(char *idxfn, char *key, size_t keylen, enum action act, int maxdist,
+        keyidx_fn fn, void *arg)
+{
+    FILE *idx;
+    int ret;
+
+    if (! (idx = fopen(idxfn, "rb"))) {
+        perror("Opening index");
+        return EX_NOINPUT;
+    }
+
+    switch (act) {
+        case ACT_SUBSTRING:
+            ret = keyidx_substring(idx, key, keylen, fn, arg);
+            break;
+        case ACT_PREFIX:
+            ret = keyidx_prefix(idx, key, keylen, fn, arg);
+            break;
+        default:
+            ret = keyidx_fuzzy(idx, key, keylen, maxdist, fn, arg);
+            break;
+    }
+    fclose(idx);
+
+    return ret ? EX_DATAERR : 0;
+}
+
+int
+search(char *filename, char *key, enum action act)
+{
+    char idxfn[8192];
+    size_t keylen = strlen(key);
+    struct keylist found = {0};
+    struct shards s;
+    uint32_t n = db_files(filename, &s);
+    int dist = (ACT_FUZZY == act) ? 0 : 2;
+    int ret = 0;
+    size_t kept;
+    size_t i;
+
+    if (1 == n) {
+        char fn[8192];
+
+        db_file(filename, &s, 0, fn, sizeof(fn));
+        sidecar_name(fn, &key_index, idxfn, sizeof(idxfn));
+        return search_one(idxfn, key, keylen, act, 2, print_key, NULL);
+    }
+
+    // Fuzzy matches are closest first, then in order, so widen the search
+    // a step at a time across every shard
+    for (; (dist <= 2) && ! ret; dist += 1) {
+        for (i = 0; (i < n) && ! ret; i += 1) {
+            char fn[8192];
+
+            db_file(filename, &s, i, fn, sizeof(fn));
+            sidecar_name(fn, &key_index, idxfn, sizeof(idxfn));
+            ret = search_one(idxfn, key, keylen, act, dist, collect_key, &found);
+        }
+        qsort(found.keys + found.printed, found.n - found.printed, sizeof(char *), cmp_keys);
+
+        // Fuzzy matches come back again at every wider distance, so skip
+        // repeats, and what a closer pass printed (kept sorted, below)
+        for (i = kept = found.printed; i < found.n; i += 1) {
+            char *k = found.keys[i];
+
+            if (((kept > found.printed) && (0 == strcmp(k, found.keys[kept - 1]))) ||
+                    bsearch(&k, found.keys, found.printed, sizeof(char *), cmp_keys)) {
+                free(k);
+            } else {
+                found.keys[kept++] = k;
+            }
+        }
+        found.n = kept;
+        for (; found.printed < found.n; found.printed += 1) {
+            printf("%s\n", found.keys[found.printed]);
+        }
+        qsort(found.keys, found.n, sizeof(char *), cmp_keys);
+    }
+
+    for (i = 0; i < found.n; i += 1) {
+        free(found.keys[i]);
+    }
+    free(found.keys);
+
+    return ret;
+}
+
+/*
+ * Scanning text for every key in it
+ */
+
+struct match {
+    size_t start;
+    size_t len;
+    const char *key;
+    size_t keylen;
+};
+
+struct scanner {
+    struct ac *acs;
+    uint32_t n;
+    char *fold;         // Folded text
+    size_t *pos;        // Where each byte of fold came from
+    size_t size;
+    struct match *m;
+    size_t nm;
+    size_t msize;
+};
+
+static void
+collect_match(size_t offset, const char *key, size_t keylen, void *arg)
+{
+    struct scanner *sc = (struct scanner *)arg;
+
+    if (sc->nm == sc->msize) {
+        size_t size = sc->msize ? sc->msize * 2 : 64;
+        struct match *m = (struct match *)realloc(sc->m, size * sizeof(*m));
+
+        if (! m) {
+            return;
+        }
+        sc->m = m;
+        sc->msize = size;
+    }
+    // Offsets into the text as it was, not as it was folded
+    sc->m[sc->nm].start = sc->pos[offset];
+    sc->m[sc->nm].len = sc->pos[offset + keylen] - sc->pos[offset];
+    sc->m[sc->nm].key = key;
+    sc->m[sc->nm].keylen = keylen;
+    sc->nm += 1;
+}
+
+/* In order of where they start, longest first */
+static int
+cmp_matches(const void *a, const void *b)
+{
+    const struct match *ma = (const struct match *)a;
+    const struct match *mb = (const struct match *)b;
+
+    if (ma->start != mb->start) {
+        return (ma->start > mb->start) - (ma->start < mb->start);
+    }
+    return (ma->keylen < mb->keylen) - (ma->keylen > mb->keylen);
+}
+
+/* Print every key in text, and where it is */
+static int
+scan_text(struct scanner *sc, char *text, size_t len)
+{
+    const uint8_t *s = (const uint8_t *)text;
+    size_t i = 0;
+    size_t o = 0;
+    size_t end;
+    size_t j;
+
+    if (CASEFOLD_SIZE(len) + 1 > sc->size) {
+        sc->size = CASEFOLD_SIZE(len) + 1;
+        free(sc->fold);
+        free(sc->pos);
+        sc->fold = (char *)malloc(sc->size);
+        sc->pos = (size_t *)malloc(sc->size * sizeof(size_t));
+        if (! sc->fold || ! sc->pos) {
+            perror("Folding text");
+            sc->size = 0;
+            return EX_OSERR;
+        }
+    }
+
+    // Fold a character at a time, to know where each came from
+    while (i < len) {
+        if (s[i] < 0x80) {
+            sc->fold[o] = s[i] | ((s[i] >= 'A') && (s[i] <= 'Z') ? 0x20 : 0);
+            sc->pos[o++] = i++;
+            continue;
+        }
+        for (end = i + 1; (end < len) && ((s[end] & 0xc0) == 0x80); end += 1);
+        for (j = o + casefold(sc->fold + o, text + i, end - i); o < j; o += 1) {
+            sc->pos[o] = i;
+        }
+        i = end;
+    }
+    sc->pos[o] = len;
+
+    sc->nm = 0;
+    for (j = 0; j < sc->n; j += 1) {
+        ac_scan(&sc->acs[j], sc->fold, o, collect_match, sc);
+    }
+    qsort(sc->m, sc->nm, sizeof(struct match), cmp_matches);
+    for (j = 0; j < sc->nm; j += 1) {
+        printf("%lu\t%lu\t%.*s\n", (unsigned long)sc->m[j].start,
+                (unsigned long)sc->m[j].len, (int)sc->m[j].keylen, sc->m[j].key);
+    }
+
+    return 0;
+}
+
+/* Scan text, or each line of stdin if it's NULL */
+int
+scan(char *filename, char *text)
+{
+    struct scanner sc = {0};
+    struct shards s;
+    uint32_t n = db_files(filename, &s);
+    int ret = 0;
+    uint32_t i;
+
+    if (! (sc.acs = (struct ac *)calloc(n, sizeof(struct ac)))) {
+        perror("Opening automaton");
+        return EX_OSERR;
+    }
+    for (sc.n = 0; sc.n < n; sc.n += 1) {
+        char fn[8192];
+        char acfn[8192 + 8];
+        FILE *f;
+
+        db_file(filename, &s, sc.n, fn, sizeof(fn));
+        sidecar_name(fn, &key_automaton, acfn, sizeof(acfn));
+        if (! (f = fopen(acfn, "rb"))) {
+            perror("Opening automaton");
+            ret = EX_NOINPUT;
+            break;
+        }
+        if (ac_open(&sc.acs[sc.n], f)) {
+            fprintf(stderr, "%s: unsupported automaton format\n", acfn);
+            fclose(f);
+            ret = EX_DATAERR;
+            break;
+        }
+        fclose(f);
+    }
+
+    if (ret) {
+        // Nothing to scan with
+    } else if (text) {
+        ret = scan_text(&sc, text, strlen(text));
+    } else {
+        char *line = NULL;
+        size_t linesize = 0;
+        ssize_t len;
+
+        // One line in, its matches and a blank line out, for coprocesses
+        while (! ret && ((len = getline(&line, &linesize, stdin)) != -1)) {
+            if (len && ('\n' == line[len - 1])) {
+                len -= 1;
+            }
+            ret = scan_text(&sc, line, len);
+            putchar('\n');
+            fflush(stdout);
+        }
+        free(line);
+    }
+
+    for (i = 0; i < sc.n; i += 1) {
+        ac_close(&sc.acs[i]);
+    }
+    free(sc.acs);
+    free(sc.fold);
+    free(sc.pos);
+    free(sc.m);
+
+    return ret;
+}
+
+/*
+ * Writing
+ *
+ * Handlers run in parallel, so several writers may want the same
+ * database at once.  Each one appends its change to CDB.queue, then waits
+ * for CDB.lock.  Whoever gets the lock first becomes the leader: it
+ * applies everything in the queue in a single rewrite, and leaves each
+ * waiter its exit status and output in CDB.res.ID.  Waiters that find
+ * their result when they get the lock just print it and go.  Whatever
+ * the leader took from the queue is gone from it, even if the rewrite
+ * failed, so a bad batch fails once and isn't tried again by each
+ * writer after.
+ */
+
+struct mutation {
+    enum action act;
+    char *id;
+    char *key;
+    size_t keylen;
+    char *val;          // Value for ACT_ADD, glob for ACT_DEL
+    size_t vallen;
+
+    int skip;           // ACT_ADD: already there
+    int written;        // ACT_ADD: has been written out
+    int removed;        // ACT_DEL: number of entries removed
+    int kept;           // ACT_DEL: number of entries left for key
+    int newkey;         // ACT_ADD: key had no entries before
+
+    char *out;
+    size_t outlen;
+    FILE *outf;
+};
+
+static void
+write_name(char *filename, char *suffix, char *id, char *fn, size_t fnlen)
+{
+    if (id) {
+        snprintf(fn, fnlen, "%s.%s.%s", filename, suffix, id);
+    } else {
+        snprintf(fn, fnlen, "%s.%s", filename, suffix);
+    }
+}
+
+static int
+lock_file(char *filename, char *suffix)
+{
+    char fn[8192];
+    int fd;
+
+    write_name(filename, suffix, NULL, fn, sizeof(fn));
+    fd = open(fn, O_RDWR | O_CREAT, 0666);
+    if (-1 == fd) {
+        perror(fn);
+        return -1;
+    }
+    while (-1 == flock(fd, LOCK_EX)) {
+        if (EINTR != errno) {
+            perror("flock");
+            close(fd);
+            return -1;
+        }
+    }
+
+    return fd;
+}
+
+/* Append one change to the queue, in cdbmake-ish text: "+idlen,klen,vlen:id key val\n" */
+static int
+queue_push(char *filename, struct mutation *m)
+{
+    char *buf;
+    size_t buflen;
+    FILE *f = open_memstream(&buf, &buflen);
+    int fd;
+    ssize_t ret;
+
+    if (! f) {
+        perror("open_memstream");
+        return -1;
+    }
+    fprintf(f, "%c%u,%u,%u:", (m->act == ACT_ADD) ? '+' : '-',
+            (unsigned int)strlen(m->id), (unsigned int)m->keylen, (unsigned int)m->vallen);
+    fwrite(m->id, 1, strlen(m->id), f);
+    fwrite(m->key, 1, m->keylen, f);
+    fwrite(m->val, 1, m->vallen, f);
+    fputc('\n', f);
+    fclose(f);
+
+    if (-1 == (fd = lock_file(filename, "queue"))) {
+        free(buf);
+        return -1;
+    }
+    lseek(fd, 0, SEEK_END);
+    ret = write(fd, buf, buflen);
+    close(fd);
+    free(buf);
+
+    if (ret != (ssize_t)buflen) {
+        perror("Writing queue");
+        return -1;
+    }
+    return 0;
+}
+
+static char *
+read_field(FILE *f, size_t len)
+{
+    char *p = (char *)malloc(len + 1);
+
+    if (! p) {
+        return NULL;
+    }
+    if ((len > 0) && (1 != fread(p, len, 1, f))) {
+        free(p);
+        return NULL;
+    }
+    p[len] = '\0';
+
+    return p;
+}
+
+/* Everything in the queue right now.  *consumed says how much of it that was. */
+static struct mutation *
+queue_read(char *filename, size_t *n, long *consumed)
+{
+    struct mutation *muts = NULL;
+    size_t size = 0;
+    int fd;
+    FILE *f;
+
+    *n = 0;
+    *consumed = 0;
+    if (-1 == (fd = lock_file(filename, "queue"))) {
+        return NULL;
+    }
+    if (! (f = fdopen(fd, "rb"))) {
+        close(fd);
+        return NULL;
+    }
+
+    for (;;) {
+        struct mutation m = {0};
+        char op;
+        unsigned int idlen;
+        unsigned int klen;
+        unsigned int vlen;
+
+        if (4 != fscanf(f, "%c%u,%u,%u:", &op, &idlen, &klen, &vlen)) {
+            break;
+        }
+        m.act = ('+' == op) ? ACT_ADD : ACT_DEL;
+        m.id = read_field(f, idlen);
+        m.key = read_field(f, klen);
+        m.keylen = klen;
+        m.val = read_field(f, vlen);
+        m.vallen = vlen;
+        if (! m.id || ! m.key || ! m.val || ('\n' != fgetc(f))) {
+            free(m.id);
+            free(m.key);
+            free(m.val);
+            break;
+        }
+
+        if (*n == size) {
+            struct mutation *p;
+
+            size = size ? size * 2 : 16;
+            if (! (p = (struct mutation *)realloc(muts, size * sizeof(struct mutation)))) {
+                break;
+            }
+            muts = p;
+        }
+        muts[(*n)++] = m;
+        *consumed = ftell(f);
+    }
+    fclose(f);
+
+    return muts;
+}
+
+/* Drop the first consumed bytes of the queue, keeping anything added since */
+static void
+queue_consume(char *filename, long consumed)
+{
+    int fd = lock_file(filename, "queue");
+    struct stat st;
+    char *rest;
+    size_t restlen;
+
+    if (-1 == fd) {
+        return;
+    }
+    if ((0 == fstat(fd, &st)) && (st.st_size >= consumed)) {
+        restlen = st.st_size - consumed;
+        rest = (char *)malloc(restlen + 1);
+        if (rest &&
+                ((ssize_t)restlen == pread(fd, rest, restlen, consumed)) &&
+                ((ssize_t)restlen == pwrite(fd, rest, restlen, 0))) {
+            if (-1 == ftruncate(fd, restlen)) {
+                perror("Truncating queue");
+            }
+        }
+        free(rest);
+    }
+    close(fd);
+}
+
+static int
+key_is(struct mutation *m, char *key, size_t keylen)
+{
+    return (keylen == m->keylen) && (0 == memcmp(key, m->key, keylen));
+}
+
+/* First ACT_DEL after position after whose glob matches key and val */
+static struct mutation *
+deleter(struct mutation *muts, size_t n, long after,
+        char *key, size_t keylen, char *val)
+{
+    size_t i;
+
+    for (i = after + 1; i < n; i += 1) {
+        struct mutation *m = &muts[i];
+
+        if ((ACT_DEL == m->act) &&
+                key_is(m, key, keylen) &&
+                (0 == fnmatch(m->val, val, 0))) {
+            return m;
+        }
+    }
+
+    return NULL;
+}
+
+/* Write out key/val unless a later ACT_DEL removes it */
+static void
+apply_one(struct cdbmake_ctx *outc, struct mutation *muts, size_t n, long after,
+        char *key, size_t keylen, char *val, size_t vallen)
+{
+    struct mutation *d = deleter(muts, n, after, key, keylen, val);
+    size_t i;
+
+    if (d) {
+        fprintf(d->outf, "-%.*s\n", (int)vallen, val);
+        d->removed += 1;
+        return;
+    }
+
+    cdbmake_add(outc, key, keylen, val, vallen);
+    for (i = after + 1; i < n; i += 1) {
+        if ((ACT_DEL == muts[i].act) && key_is(&muts[i], key, keylen)) {
+            muts[i].kept += 1;
+        }
+    }
+}
+
+/* Write out the additions for key, right after its existing entries */
+static void
+apply_adds(struct cdbmake_ctx *outc, struct mutation *muts, size_t n,
+        char *key, size_t keylen)
+{
+    size_t i;
+
+    for (i = 0; i < n; i += 1) {
+        struct mutation *m = &muts[i];
+
+        if ((ACT_ADD == m->act) && ! m->skip && ! m->written &&
+                ((! key) || key_is(m, key, keylen))) {
+            apply_one(outc, muts, n, i, m->key, m->keylen, m->val, m->vallen);
+            m->written = 1;
+        }
+    }
+}
+
+/* Apply muts, in order, to filename, in one rewrite */
+static int
+apply(char *filename, struct mutation *muts, size_t n)
+{
+    struct cdb_ctx inc;
+    struct cdbmake_ctx outc;
+    FILE *inf;
+    FILE *outf;
+    char *outfn;
+    char *k = NULL;
+    size_t ksize = 0;
+    char *v = NULL;
+    size_t vsize = 0;
+    char *prev = NULL;
+    size_t prevsize = 0;
+    size_t prevlen = 0;
+    int keys_changed = 0;
+    int grouped;
+    size_t i;
+    int ret;
+
+    ret = setup_copy(filename, &inc, &inf, &outfn, &outc, &outf);
+    if (ret) {
+        return ret;
+    }
+    grouped = inc.db.flags & CDB_F_GROUPED;
+
+    // Skip additions that are already there, or asked for twice
+    for (i = 0; i < n; i += 1) {
+        struct mutation *m = &muts[i];
+        size_t j;
+
+        if (ACT_ADD != m->act) {
+            continue;
+        }
+        cdb_find(&inc, m->key, m->keylen);
+        m->newkey = (0 == cdb_count(&inc));
+        if (has_value(&inc, m->key, m->keylen, m->val, m->vallen) &&
+                ! deleter(muts, i, -1, m->key, m->keylen, m->val)) {
+            m->skip = 1;
+        }
+        for (j = 0; j < i; j += 1) {
+            if ((ACT_ADD == muts[j].act) && ! muts[j].skip &&
+                    key_is(&muts[j], m->key, m->keylen) &&
+                    (m->vallen == muts[j].vallen) &&
+                    (0 == memcmp(m->val, muts[j].val, m->vallen))) {
+                m->skip = 1;
+            }
+        }
+    }
+
+    for (;;) {
+        size_t klen;
+        size_t vlen;
+
+        if (EOF == cdb_dump_full(&inc, &k, &ksize, &klen, &v, &vsize, &vlen)) {
+            break;
+        }
+
+        // In a grouped file, put new values right after their key's
+        // others, to keep groups whole.  Otherwise they go at the end,
+        // as always, so existing values keep their numbers.
+        if (prev && ((klen != prevlen) || memcmp(k, prev, klen))) {
+            apply_adds(&outc, muts, n, prev, prevlen);
+        }
+        if (grouped && (klen + 1 > prevsize)) {
+            free(prev);
+            prevsize = klen + 1;
+            if (! (prev = (char *)malloc(prevsize))) {
+                perror("Allocating key");
+                prevsize = 0;
+            }
+        }
+        if (prev) {
+            memcpy(prev, k, klen);
+            prevlen = klen;
+        }
+
+        apply_one(&outc, muts, n, -1, k, klen, v, vlen);
+    }
+    if (prev) {
+        apply_adds(&outc, muts, n, prev, prevlen);
+    }
+    apply_adds(&outc, muts, n, NULL, 0);
+    free(k);
+    free(v);
+    free(prev);
+
+    if ((ret = finish_copy(filename, &inc, &inf, outfn, &outc, &outf))) {
+        return ret;
+    }
+
+    for (i = 0; i < n; i += 1) {
+        struct mutation *m = &muts[i];
+
+        if ((ACT_ADD == m->act) && ! m->skip && m->newkey) {
+            keys_changed = 1;
+        }
+        if ((ACT_DEL == m->act) && m->removed && ! m->kept) {
+            keys_changed = 1;
+        }
+    }
+    if (keys_changed) {
+        sync_index(filename);
+    }
+
+    return 0;
+}
+
+/* Hand a result to whoever is waiting for it */
+static void
+deliver(char *filename, struct mutation *m, int status)
+{
+    char fn[8192];
+    char tmpfn[sizeof(fn) + 8];
+    FILE *f;
+
+    write_name(filename, "res", m->id, fn, sizeof(fn));
+    snprintf(tmpfn, sizeof(tmpfn), "%s.tmp", fn);
+    if (! (f = fopen(tmpfn, "wb"))) {
+        perror("Writing result");
+        return;
+    }
+    fprintf(f, "%d\n", status);
+    if (0 == status) {
+        fwrite(m->out, 1, m->outlen, f);
+    }
+    fclose(f);
+    rename(tmpfn, fn);
+}
+
+/* Print our result, if the leader left us one, and return its exit
+ * status, or -1 if there's none yet
+ */
+static int
+collect(char *resfn)
+{
+    FILE *f = fopen(resfn, "rb");
+    char buf[8192];
+    int status = EX_SOFTWARE;
+    size_t r;
+
+    if (! f) {
+        return -1;
+    }
+    if (1 != fscanf(f, "%d\n", &status)) {
+        fprintf(stderr, "%s: no status\n", resfn);
+    } else if (status) {
+        fprintf(stderr, "Applying queued changes failed\n");
+    }
+    while ((r = fread(buf, 1, sizeof(buf), f)) > 0) {
+        fwrite(buf, 1, r, stdout);
+    }
+    fclose(f);
+    remove(resfn);
+
+    return status;
+}
+
+int
+mutate(char *filename, enum action act, char *key, char *val)
+{
+    struct mutation me = {0};
+    struct mutation *muts;
+    char id[64];
+    char resfn[8192];
+    struct timeval tv;
+    long consumed;
+    size_t n;
+    size_t i;
+    int lockfd;
+    int ret = 0;
+
+    if (access(filename, F_OK)) {
+        perror("Opening database");
+        return EX_NOINPUT;
+    }
+
+    gettimeofday(&tv, NULL);
+    snprintf(id, sizeof(id), "%d-%ld%06ld", getpid(), (long)tv.tv_sec, (long)tv.tv_usec);
+    write_name(filename, "res", id, resfn, sizeof(resfn));
+
+    me.act = act;
+    me.id = id;
+    me.key = key;
+    me.keylen = strlen(key);
+    me.val = val;
+    me.vallen = strlen(val);
+    if (queue_push(filename, &me)) {
+        return EX_IOERR;
+    }
+
+    if (-1 == (lockfd = lock_file(filename, "lock"))) {
+        return EX_IOERR;
+    }
+
+    // Did a leader do it for us while we waited?
+    if (-1 != (ret = collect(resfn))) {
+        close(lockfd);
+        return ret;
+    }
+    ret = 0;
+
+    // Guess it's up to us
+    muts = queue_read(filename, &n, &consumed);
+    for (i = 0; i < n; i += 1) {
+        muts[i].outf = open_memstream(&muts[i].out, &muts[i].outlen);
+    }
+    if (n > 0) {
+        ret = apply(filename, muts, n);
+    }
+    for (i = 0; i < n; i += 1) {
+        struct mutation *m = &muts[i];
+
+        fclose(m->outf);
+        if (strcmp(m->id, id)) {
+            deliver(filename, m, ret);
+        } else if (0 == ret) {
+            fwrite(m->out, 1, m->outlen, stdout);
+        }
+        free(m->out);
+        free(m->id);
+        free(m->key);
+        free(m->val);
+    }
+    free(muts);
+    queue_consume(filename, consumed);
+
+    close(lockfd);
+
+    return ret;
+}
+
+static int
+create_one(char *filename, uint32_t flags)
+{
+    FILE *f = fopen(filename, "wb");
+    struct cdbmake_ctx outc;
+
+    if (! f) {
+        perror("Creating database");
+        return EX_CANTCREAT;
+    }
+
+    cdbmake_init(&outc, f, flags);
+    cdbmake_finalize(&outc);
+    fclose(f);
+
+    return 0;
+}
+
+/* Make an empty database: nshards of them, if asked, or as many as it
+ * already has
+ */
+int
+create(char *filename, uint32_t flags, uint32_t nshards)
+{
+    struct shards s;
+    uint32_t i;
+    int ret = 0;
+
+    if (nshards) {
+        if (shards_create(&s, filename, nshards)) {
+            return EX_CANTCREAT;
+        }
+    } else if (shards_open(&s, filename)) {
+        return create_one(filename, flags);
+    }
+
+    for (i = 0; (i < s.n) && ! ret; i += 1) {
+        char fn[8192];
+
+        shards_path(&s, i, fn, sizeof(fn));
+        ret = create_one(fn, flags);
+    }
+
+    return ret;
+}
+
+/*
+ * Bulk import and export
+ */
+
+enum format {
+    FMT_CDB,
+    FMT_TSV
+};
+
+static int
+parse_format(char *name, enum format *fmt)
+{
+    if (0 == strcmp(name, "cdb")) {
+        *fmt = FMT_CDB;
+    } else if (0 == strcmp(name, "tsv")) {
+        *fmt = FMT_TSV;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/* Decimal number up to delim */
+static int
+read_num(FILE *f, int delim, size_t *num)
+{
+    int c;
+
+    *num = 0;
+    while (EOF != (c = getc_unlocked(f))) {
+        if (c == delim) {
+            return 0;
+        }
+        if ((c < '0') || (c > '9')) {
+            break;
+        }
+        *num = (*num * 10) + (c - '0');
+    }
+    return -1;
+}
+
+static int
+read_into(FILE *f, char **buf, size_t *size, size_t len)
+{
+    if (len + 1 > *size) {
+        char *p = (char *)realloc(*buf, len + 1);
+
+        if (! p) {
+            return -1;
+        }
+        *buf = p;
+        *size = len + 1;
+    }
+    if (len != fread(*buf, 1, len, f)) {
+        return -1;
+    }
+    (*buf)[len] = '\0';
+    return 0;
+}
+
+/* One "+klen,dlen:key->data\n" record; 1 at the blank line that ends them */
+static int
+read_cdb_record(FILE *f,
+        char **key, size_t *keysize, size_t *keylen,
+        char **val, size_t *valsize, size_t *vallen)
+{
+    int c = getc_unlocked(f);
+
+    if (('\n' == c) || (EOF == c)) {
+        return 1;
+    }
+    if (('+' != c) ||
+            read_num(f, ',', keylen) ||
+            read_num(f, ':', vallen) ||
+            read_into(f, key, keysize, *keylen) ||
+            ('-' != getc_unlocked(f)) ||
+            ('>' != getc_unlocked(f)) ||
+            read_into(f, val, valsize, *vallen) ||
+            ('\n' != getc_unlocked(f))) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Undo tsv escapes in place, returning the new length */
+static size_t
+unescape(char *s, size_t len)
+{
+    size_t i;
+    size_t o = 0;
+
+    for (i = 0; i < len; i += 1) {
+        char c = s[i];
+
+        if (('\\' == c) && (i + 1 < len)) {
+            switch (s[i + 1]) {
+                case 't':
+                    c = '\t';
+                    i += 1;
+                    break;
+                case 'n':
+                    c = '\n';
+                    i += 1;
+                    break;
+                case '\\':
+                    i += 1;
+                    break;
+            }
+        }
+        s[o++] = c;
+    }
+    return o;
+}
+
+/* One "key\tval\n" line; 1 at end of file */
+static int
+read_tsv_record(FILE *f,
+        char **line, size_t *linesize,
+        char **key, size_t *keylen,
+        char **val, size_t *vallen)
+{
+    ssize_t len = getline(line, linesize, f);
+    char *tab;
+
+    if (len < 0) {
+        return 1;
+    }
+    if ((len > 0) && ('\n' == (*line)[len - 1])) {
+        len -= 1;
+    }
+    if (! (tab = memchr(*line, '\t', len))) {
+        return -1;
+    }
+    *key = *line;
+    *keylen = unescape(*key, tab - *line);
+    *val = tab + 1;
+    *vallen = unescape(*val, len - (*val - *line));
+    (*val)[*vallen] = '\0';
+    return 0;
+}
+
+static void
+write_escaped(FILE *f, char *s, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i += 1) {
+        switch (s[i]) {
+            case '\t':
+                fputs("\\t", f);
+                break;
+            case '\n':
+                fputs("\\n", f);
+                break;
+            case '\\':
+                fputs("\\\\", f);
+                break;
+            default:
+                putc_unlocked(s[i], f);
+                break;
+        }
+    }
+}
+
+/* One file being written by import() or compact() */
+struct output {
+    char fn[8192];
+    char tmpfn[8192 + 16];
+    int lockfd;
+    FILE *f;
+    struct cdbmake_ctx c;
+
+    // Last key imported, to notice keys coming out of order
+    char *last;
+    size_t lastlen;
+    size_t lastsize;
+    int unsorted;
+};
+
+struct compaction {
+    char *filename;
+    struct shards *s;
+    uint32_t flags;             // To add
+};
+
+static int compact_one(uint32_t i, void *arg);
+
+static int
+output_open(struct output *o, uint32_t flags, size_t budget)
+{
+    // Writers queued behind the lock will apply their changes on top of ours
+    if (-1 == (o->lockfd = lock_file(o->fn, "lock"))) {
+        return EX_IOERR;
+    }
+
+    o->last = NULL;
+    o->lastlen = 0;
+    o->lastsize = 0;
+    o->unsorted = 0;
+
+    snprintf(o->tmpfn, sizeof(o->tmpfn), "%s.%d", o->fn, getpid());
+    if (! (o->f = fopen(o->tmpfn, "wb"))) {
+        perror("Creating temporary database");
+        close(o->lockfd);
+        o->lockfd = -1;
+        return EX_CANTCREAT;
+    }
+
+    cdbmake_init(&o->c, o->f, flags);
+    if (budget) {
+        cdbmake_set_budget(&o->c, budget);
+    }
+
+    return 0;
+}
+
+/* Finish writing o, and replace the real file with it if keep is set
+ * and it all got written
+ */
+static int
+output_close(struct output *o, int keep)
+{
+    int ret = 0;
 
-    return EX_USAGE;
+    if (o->f) {
+        if (cdbmake_finalize(&o->c)) {
+            keep = 0;
+            ret = EX_IOERR;
+        }
+        fclose(o->f);
+        o->f = NULL;
+        if (keep) {
+            rename(o->tmpfn, o->fn);
+            sync_index(o->fn);
+        } else {
+            remove(o->tmpfn);
+        }
+    }
+    if (-1 != o->lockfd) {
+        close(o->lockfd);
+        o->lockfd = -1;
+    }
+
+    return ret;
 }
 
-size_t
-lowercase(char *text)
+struct importing {
+    struct output *outs;
+    struct compaction regroup;
+};
+
+static int
+finish_import(uint32_t i, void *arg)
 {
-    size_t ret;
+    struct importing *imp = (struct importing *)arg;
+    int ret = output_close(&imp->outs[i], 1);
 
-    for (ret = 0; text[ret]; ret += 1) {
-        text[ret] = tolower(text[ret]);
+    // A key that came back after others went in as a second group, so
+    // rebuild to bring its values together
+    if ((0 == ret) && imp->outs[i].unsorted) {
+        ret = compact_one(i, &imp->regroup);
     }
 
     return ret;
 }
 
-int 
-choose(char *filename, char *key)
+/* Note key going into o, and whether it came after the one before */
+static int
+note_order(struct output *o, char *key, size_t keylen)
 {
-    struct cdb_ctx c;
-    FILE *f = fopen(filename, "r");
-    size_t keylen = lowercase(key);
-    uint32_t nresults;
+    size_t len = (keylen < o->lastlen) ? keylen : o->lastlen;
+    int c;
 
-    if (! f) {
-        perror("Opening database");
-        return EX_NOINPUT;
+    if (o->last) {
+        c = memcmp(key, o->last, len);
+        if (0 == c) {
+            c = (keylen > o->lastlen) - (keylen < o->lastlen);
+        }
+        if (0 == c) {
+            return 0;
+        }
+        if (c < 0) {
+            o->unsorted = 1;
+            return 0;
+        }
     }
+    if (keylen > o->lastsize) {
+        char *p = (char *)realloc(o->last, keylen);
 
-    cdb_init(&c, f);
+        if (! p) {
+            return -1;
+        }
+        o->last = p;
+        o->lastsize = keylen;
+    }
+    memcpy(o->last, key, keylen);
+    o->lastlen = keylen;
 
-    /* Count how many results there are */
-    cdb_find(&c, key, keylen);
-    for (nresults = 0; cdb_next(&c, NULL, 0); nresults += 1);
+    return 0;
+}
 
-    if (nresults > 0) {
-        /* This is horrible: say rand() returned between 0 and 2, and results
-         * was 2.  Possible values would be (0, 1, 0): not a uniform
-         * distribution.  But this is random enough for our purposes. */
-        uint32_t which = rand() % nresults;
-        uint32_t vallen;
-        char val[8192];
-        uint32_t i;
+int
+import(char *filename, char *fmtname, uint32_t flags, size_t budget, uint32_t nshards)
+{
+    struct output *outs;
+    struct importing imp;
+    struct shards s;
+    enum format fmt;
+    char *line = NULL;
+    size_t linesize = 0;
+    char *kbuf = NULL;
+    size_t ksize = 0;
+    char *vbuf = NULL;
+    size_t vsize = 0;
+    char *fold = NULL;
+    size_t foldsize = 0;
+    unsigned long records = 0;
+    uint32_t n;
+    uint32_t i;
+    int ret = 0;
+
+    if (parse_format(fmtname, &fmt)) {
+        fprintf(stderr, "%s: unknown format\n", fmtname);
+        return EX_USAGE;
+    }
 
-        cdb_find(&c, key, keylen);
-        for (i = 0; i < which; i += 1) {
-            cdb_next(&c, NULL, 0);
+    // Resharding would move keys out from under other writers
+    n = db_files(filename, &s);
+    if (nshards && (s.n != nshards)) {
+        if (s.n || (0 == access(filename, F_OK))) {
+            fprintf(stderr, "%s: already exists with %u shards; import into a new one\n",
+                    filename, s.n);
+            return EX_USAGE;
         }
-        vallen = cdb_next(&c, val, sizeof(val));
-        printf("%.*s\n", vallen, val);
+        if (shards_create(&s, filename, nshards)) {
+            return EX_CANTCREAT;
+        }
+        n = nshards;
     }
 
-    fclose(f);
+    if (! (outs = (struct output *)calloc(n, sizeof(struct output)))) {
+        perror("Allocating shards");
+        return EX_OSERR;
+    }
+    for (i = 0; i < n; i += 1) {
+        outs[i].lockfd = -1;
+    }
+    for (i = 0; (i < n) && ! ret; i += 1) {
+        db_file(filename, &s, i, outs[i].fn, sizeof(outs[i].fn));
+        ret = output_open(&outs[i], flags, budget / n);
+    }
 
-    return 0;
+    while (0 == ret) {
+        char *key;
+        size_t keylen;
+        char *val;
+        size_t vallen;
+        int r;
+
+        if (FMT_CDB == fmt) {
+            r = read_cdb_record(stdin, &kbuf, &ksize, &keylen, &vbuf, &vsize, &vallen);
+            key = kbuf;
+            val = vbuf;
+        } else {
+            r = read_tsv_record(stdin, &line, &linesize, &key, &keylen, &val, &vallen);
+        }
+        if (r > 0) {
+            break;
+        }
+        if (r < 0) {
+            fprintf(stderr, "stdin: bad record after %lu good ones\n", records);
+            ret = EX_DATAERR;
+            break;
+        }
+
+        if (CASEFOLD_SIZE(keylen) > foldsize) {
+            free(fold);
+            foldsize = CASEFOLD_SIZE(keylen);
+            if (! (fold = (char *)malloc(foldsize))) {
+                perror("Folding key");
+                foldsize = 0;
+                ret = EX_OSERR;
+                break;
+            }
+        }
+        keylen = casefold(fold, key, keylen);
+        i = s.n ? shards_pick(&s, fold, keylen) : 0;
+        if ((flags & CDB_F_GROUPED) && ! outs[i].unsorted && note_order(&outs[i], fold, keylen)) {
+            perror("Remembering key");
+            ret = EX_OSERR;
+            break;
+        }
+        cdbmake_add(&outs[i].c, fold, keylen, val, vallen);
+        records += 1;
+    }
+
+    // Shards are independent, so they can be finished at the same time
+    if (0 == ret) {
+        imp.outs = outs;
+        imp.regroup.filename = filename;
+        imp.regroup.s = &s;
+        imp.regroup.flags = 0;
+        ret = parallel(n, finish_import, &imp);
+    }
+    for (i = 0; i < n; i += 1) {
+        output_close(&outs[i], 0);
+        free(outs[i].last);
+    }
+
+    free(outs);
+    free(line);
+    free(kbuf);
+    free(vbuf);
+    free(fold);
+
+    return ret;
 }
 
 int
-list(char *filename, char *key)
+export(char *filename, char *fmtname)
 {
     struct cdb_ctx c;
-    size_t keylen = lowercase(key);
-    FILE *f = fopen(filename, "rb");
+    struct shards s;
+    enum format fmt;
+    char *key = NULL;
+    size_t keysize = 0;
+    char *val = NULL;
+    size_t valsize = 0;
+    size_t keylen;
+    size_t vallen;
+    uint32_t n;
+    uint32_t i;
+    FILE *f;
+    int ret = 0;
 
-    if (! f) {
-        perror("Opening database");
-        return EX_NOINPUT;
+    if (parse_format(fmtname, &fmt)) {
+        fprintf(stderr, "%s: unknown format\n", fmtname);
+        return EX_USAGE;
     }
 
-    cdb_init(&c, f);
-
-    cdb_find(&c, key, keylen);
-    for (;;) {
-        uint32_t vallen;
-        char val[8192];
+    n = db_files(filename, &s);
+    for (i = 0; i < n; i += 1) {
+        char fn[8192];
 
-        vallen = cdb_next(&c, val, sizeof(val)); 
-        if (vallen == 0) {
+        db_file(filename, &s, i, fn, sizeof(fn));
+        if (! (f = open_db(fn, &c))) {
+            ret = EX_NOINPUT;
             break;
         }
-        printf("%.*s\n", vallen, val);
+
+        while (EOF != cdb_dump_full(&c, &key, &keysize, &keylen, &val, &valsize, &vallen)) {
+            if (FMT_CDB == fmt) {
+                printf("+%lu,%lu:", (unsigned long)keylen, (unsigned long)vallen);
+                fwrite(key, 1, keylen, stdout);
+                fputs("->", stdout);
+                fwrite(val, 1, vallen, stdout);
+                putchar('\n');
+            } else {
+                write_escaped(stdout, key, keylen);
+                putchar('\t');
+                write_escaped(stdout, val, vallen);
+                putchar('\n');
+            }
+        }
+        close_db(f, &c);
+    }
+    if ((0 == ret) && (FMT_CDB == fmt)) {
+        putchar('\n');
     }
 
-    fclose(f);
+    free(key);
+    free(val);
 
-    return 0;
+    return ret;
+}
+
+/*
+ * Lookup counts, from CDB.hits
+ */
+
+struct hit {
+    char *key;
+    size_t keylen;
+    uint32_t count;
+};
+
+struct hits {
+    struct hit *slots;
+    size_t size;                // A power of two
+    size_t n;
+};
+
+static struct hit *
+hit_slot(struct hits *h, char *key, size_t keylen)
+{
+    uint32_t hash = 5381;
+    size_t i;
+
+    for (i = 0; i < keylen; i += 1) {
+        hash = ((hash << 5) + hash) ^ (uint8_t)key[i];
+    }
+    for (i = hash & (h->size - 1); h->slots[i].key; i = (i + 1) & (h->size - 1)) {
+        if ((h->slots[i].keylen == keylen) && (0 == memcmp(h->slots[i].key, key, keylen))) {
+            break;
+        }
+    }
+    return &h->slots[i];
 }
 
 static int
-setup_copy(char *infn, struct cdb_ctx *inc, FILE **inf,
-        char **outfn, struct cdbmake_ctx *outc, FILE **outf)
+hit_add(struct hits *h, char *key, size_t keylen)
 {
-    static char tmpfn[8192];
+    struct hit *slot;
 
-    *inf = fopen(infn, "rb");
-    if (! *inf) {
-        perror("Opening database");
-        return EX_NOINPUT;
+    // Keep it at most half full
+    if ((h->n + 1) * 2 > h->size) {
+        struct hits bigger = {NULL, h->size ? h->size * 2 : 1024, h->n};
+        size_t i;
+
+        if (! (bigger.slots = (struct hit *)calloc(bigger.size, sizeof(struct hit)))) {
+            return -1;
+        }
+        for (i = 0; i < h->size; i += 1) {
+            if (h->slots[i].key) {
+                *hit_slot(&bigger, h->slots[i].key, h->slots[i].keylen) = h->slots[i];
+            }
+        }
+        free(h->slots);
+        *h = bigger;
     }
 
-    snprintf(tmpfn, sizeof(tmpfn), "%s.%d", infn, getpid());
-    *outf = fopen(tmpfn, "wb");
-    if (! *outf) {
-        perror("Creating temporary database");
-        return EX_CANTCREAT;
+    slot = hit_slot(h, key, keylen);
+    if (! slot->key) {
+        if (! (slot->key = (char *)malloc(keylen + 1))) {
+            return -1;
+        }
+        memcpy(slot->key, key, keylen);
+        slot->keylen = keylen;
+        h->n += 1;
     }
+    slot->count += 1;
 
-    cdb_init(inc, *inf);
-    cdbmake_init(outc, *outf);
+    return 0;
+}
 
-    *outfn = strdup(tmpfn);
+static int
+hit_known(struct hits *h, char *key, size_t keylen)
+{
+    return h->n && (NULL != hit_slot(h, key, keylen)->key);
+}
+
+/* Count up the lookups noted for filename.  Returns -1 if it has no CDB.hits. */
+static int
+load_hits(char *filename, struct hits *h)
+{
+    char fn[8192];
+    char *key = NULL;
+    size_t keysize = 0;
+    size_t keylen;
+    FILE *f;
+
+    h->slots = NULL;
+    h->size = 0;
+    h->n = 0;
+    hits_name(filename, fn, sizeof(fn));
+    if (! (f = fopen(fn, "rb"))) {
+        return -1;
+    }
+    while ((0 == read_num(f, ':', &keylen)) &&
+            (0 == read_into(f, &key, &keysize, keylen)) &&
+            ('\n' == getc_unlocked(f))) {
+        if (hit_add(h, key, keylen)) {
+            break;
+        }
+    }
+    free(key);
+    fclose(f);
 
     return 0;
 }
 
 static void
-finish_copy(char *infn, struct cdb_ctx *inc, FILE **inf,
-        char *outfn, struct cdbmake_ctx *outc, FILE **outf)
+free_hits(struct hits *h)
 {
-    cdbmake_finalize(outc);
-    fclose(*outf);
-    fclose(*inf);
+    size_t i;
 
-    rename(outfn, infn);
-    free(outfn);
+    for (i = 0; i < h->size; i += 1) {
+        free(h->slots[i].key);
+    }
+    free(h->slots);
 }
 
-int
-add(char *filename, char *key, char *val)
+/* Busiest first; ties in key order, so rebuilds come out the same */
+static int
+cmp_hits(const void *a, const void *b)
 {
-    struct cdb_ctx inc;
-    struct cdbmake_ctx outc;
-    FILE *inf;
-    FILE *outf;
-    char *outfn;
-    int ret;
+    const struct hit *ha = *(const struct hit * const *)a;
+    const struct hit *hb = *(const struct hit * const *)b;
+    size_t len = (ha->keylen < hb->keylen) ? ha->keylen : hb->keylen;
+    int c;
 
-    ret = setup_copy(filename, &inc, &inf, &outfn, &outc, &outf);
-    if (ret) {
-        return ret;
+    if (ha->count != hb->count) {
+        return (ha->count < hb->count) ? 1 : -1;
+    }
+    if ((c = memcmp(ha->key, hb->key, len))) {
+        return c;
     }
+    return (ha->keylen > hb->keylen) - (ha->keylen < hb->keylen);
+}
 
-    for (;;) {
-        char key[8192];
-        char val[8192];
-        size_t keylen = sizeof(key);
-        size_t vallen = sizeof(val);
+/* Copy every value of key from c to out */
+static void
+copy_key(struct cdb_ctx *c, struct cdbmake_ctx *out, char *key, size_t keylen,
+        char **val, size_t *valsize)
+{
+    uint32_t n;
+    uint32_t i;
 
-        if (EOF == cdb_dump(&inc, key, &keylen, val, &vallen)) {
-            break;
+    cdb_find(c, key, keylen);
+    n = cdb_count(c);
+    for (i = 0; i < n; i += 1) {
+        uint32_t len = cdb_nth(c, i, NULL, 0);
+
+        if (len > *valsize) {
+            char *p = (char *)realloc(*val, len);
+
+            if (! p) {
+                perror("Allocating value");
+                return;
+            }
+            *val = p;
+            *valsize = len;
         }
-        cdbmake_add(&outc, key, keylen, val, vallen);
+        len = cdb_nth(c, i, *val, len);
+        cdbmake_add(out, key, keylen, *val, len);
     }
-    cdbmake_add(&outc, key, strlen(key), val, strlen(val));
+}
+
+/* Start counting lookups of every file of filename */
+int
+start_hits(char *filename)
+{
+    struct shards s;
+    uint32_t n = db_files(filename, &s);
+    uint32_t i;
 
-    finish_copy(filename, &inc, &inf, outfn, &outc, &outf);
+    for (i = 0; i < n; i += 1) {
+        char dbfn[8192];
+        char fn[8192 + 8];
+        int fd;
+
+        db_file(filename, &s, i, dbfn, sizeof(dbfn));
+        hits_name(dbfn, fn, sizeof(fn));
+        if (-1 == (fd = open(fn, O_WRONLY | O_CREAT, 0666))) {
+            perror(fn);
+            return EX_CANTCREAT;
+        }
+        close(fd);
+    }
 
     return 0;
 }
 
+/* Describe every file of filename */
 int
-del(char *filename, char *key, char *glob)
+stats(char *filename, int kv)
 {
-    size_t keylen = strlen(key);
-    struct cdb_ctx inc;
-    struct cdbmake_ctx outc;
-    FILE *inf;
-    FILE *outf;
-    char *outfn;
+    struct shards s;
+    uint32_t n = db_files(filename, &s);
+    uint32_t i;
+
+    for (i = 0; i < n; i += 1) {
+        struct cdb_ctx c;
+        struct cdb_stats st;
+        char fn[8192];
+        FILE *f;
+        int ret;
+
+        db_file(filename, &s, i, fn, sizeof(fn));
+        if (! (f = open_db(fn, &c))) {
+            return EX_NOINPUT;
+        }
+        ret = cdb_stats(&c, &st);
+        close_db(f, &c);
+        if (ret) {
+            fprintf(stderr, "%s: can't read all of it\n", fn);
+            return EX_DATAERR;
+        }
+
+        if (i) {
+            printf("\n");
+        }
+        if (kv) {
+            printf("file=%s\n", fn);
+        } else {
+            printf("%-22s %s\n", "file", fn);
+        }
+        cdb_stats_print(stdout, &st, kv);
+    }
+
+    return 0;
+}
+
+/* Rewrite file i of the database, adding the new flags */
+static int
+compact_one(uint32_t i, void *arg)
+{
+    struct compaction *job = (struct compaction *)arg;
+    struct output o;
+    struct cdb_ctx c;
+    struct cdb_ctx l;
+    char *key = NULL;
+    size_t keysize = 0;
+    char *val = NULL;
+    size_t valsize = 0;
+    size_t keylen;
+    size_t vallen;
+    struct hits hits;
+    int counting;
+    uint32_t flags;
+    FILE *f;
+    FILE *lf = NULL;
     int ret;
 
-    ret = setup_copy(filename, &inc, &inf, &outfn, &outc, &outf);
-    if (ret) {
+    db_file(job->filename, job->s, i, o.fn, sizeof(o.fn));
+
+    // Keep whatever the file already has; -g and -z only add to that
+    if (! (f = open_db(o.fn, &c))) {
+        return EX_NOINPUT;
+    }
+    flags = c.db.flags | job->flags;
+    close_db(f, &c);
+
+    if ((ret = output_open(&o, flags, 0))) {
         return ret;
     }
+    if (! (f = open_db(o.fn, &c))) {
+        output_close(&o, 0);
+        return EX_NOINPUT;
+    }
 
-    for (;;) {
-        char k[8192];
-        char v[8192];
-        size_t klen = sizeof(k);
-        size_t vlen = sizeof(v) - 1;
+    // Looked-up keys go first, busiest first, so they share pages at the
+    // front of the file and are first in line for their table slots
+    counting = (0 == load_hits(o.fn, &hits));
+    if (hits.n) {
+        struct hit **busy = (struct hit **)malloc(hits.n * sizeof(struct hit *));
+        size_t n = 0;
+        size_t j;
 
-        if (EOF == cdb_dump(&inc, k, &klen, v, &vlen)) {
-            break;
+        for (j = 0; busy && (j < hits.size); j += 1) {
+            if (hits.slots[j].key) {
+                busy[n++] = &hits.slots[j];
+            }
+        }
+        if (busy) {
+            qsort(busy, n, sizeof(struct hit *), cmp_hits);
+            for (j = 0; j < n; j += 1) {
+                copy_key(&c, &o.c, busy[j]->key, busy[j]->keylen, &val, &valsize);
+            }
+        } else {
+            free_hits(&hits);
+            hits.n = 0;
+            hits.size = 0;
         }
+        free(busy);
+    }
 
-        v[vlen] = '\0';
-        if ((klen == keylen) &&
-                (0 == memcmp(k, key, klen)) &&
-                (0 == fnmatch(glob, v, 0))) {
-            // Skip if it matches
-            printf("-%.*s\n", (int)vlen, v);
+    // Grouped, each key's values all go in the first time it turns up,
+    // looked up through l so the dump carries on, and one group comes out
+    // of however many records the key was split over
+    if ((flags & CDB_F_GROUPED) && ! (lf = open_db(o.fn, &l))) {
+        ret = EX_NOINPUT;
+    }
+    while ((0 == ret) && (EOF != cdb_dump_full(&c, &key, &keysize, &keylen, &val, &valsize, &vallen))) {
+        if (hit_known(&hits, key, keylen)) {
+            continue;
+        }
+        if (! lf) {
+            cdbmake_add(&o.c, key, keylen, val, vallen);
+        } else if (hit_add(&hits, key, keylen)) {
+            perror("Remembering keys");
+            ret = EX_OSERR;
         } else {
-            cdbmake_add(&outc, k, klen, v, vlen);
+            copy_key(&l, &o.c, key, keylen, &val, &valsize);
         }
     }
+    if (lf) {
+        close_db(lf, &l);
+    }
+    close_db(f, &c);
+    if (ret) {
+        output_close(&o, 0);
+    } else {
+        ret = output_close(&o, 1);
+    }
 
-    finish_copy(filename, &inc, &inf, outfn, &outc, &outf);
-    return 0;
+    // Counting starts over, against the new layout
+    if (counting && ! ret) {
+        char fn[8192];
+
+        hits_name(o.fn, fn, sizeof(fn));
+        if (truncate(fn, 0)) {
+            perror(fn);
+        }
+    }
+
+    free_hits(&hits);
+    free(key);
+    free(val);
+
+    return ret;
 }
 
 int
-create(char *filename)
+compact(char *filename, uint32_t flags)
 {
-    FILE *f = fopen(filename, "wb");
-    struct cdbmake_ctx outc;
-
-    if (! f) {
-        perror("Creating database");
-        return EX_CANTCREAT;
-    }
+    struct shards s;
+    struct compaction job;
 
-    cdbmake_init(&outc, f);
-    cdbmake_finalize(&outc);
+    job.filename = filename;
+    job.s = &s;
+    job.flags = flags;
 
-    return 0;
+    return parallel(db_files(filename, &s), compact_one, &job);
 }
 
-enum action {
-    ACT_ONE,
-    ACT_ALL,
-    ACT_ADD,
-    ACT_DEL,
-    ACT_NEW
-};
-
 int
 main(int argc, char *argv[])
 {
     char *filename;
-    char *key;
+    char *key = NULL;
     char *val;
+    uint32_t n = 0;
+    char *fmt;
+    uint32_t flags = CDB_F_SEEDED | CDB_F_BLOOM;
+    size_t budget = 0;
+    uint32_t nshards = 0;
+    char shardfn[8192];
     enum action act = ACT_ONE;
+    int kv = 0;
 
     for (;;) {
-        int opt = getopt(argc, argv, "hlna:r:");
+        int opt = getopt_long(argc, argv, "hlngzcxspfKSCHi:a:r:I:E:M:P:", long_options, NULL);
 
         if (-1 == opt) {
             break;
@@ -269,6 +2274,37 @@ main(int argc, char *argv[])
             case 'n':
                 act = ACT_NEW;
                 break;
+            case 'g':
+                flags |= CDB_F_GROUPED;
+                break;
+            case 'z':
+                flags |= CDB_F_COMPRESSED;
+                break;
+            case 'c':
+                act = ACT_COUNT;
+                break;
+            case 'x':
+                act = ACT_INDEX;
+                break;
+            case 's':
+                act = ACT_SUBSTRING;
+                break;
+            case 'p':
+                act = ACT_PREFIX;
+                break;
+            case 'f':
+                act = ACT_FUZZY;
+                break;
+            case 'K':
+                act = ACT_AUTOMATON;
+                break;
+            case 'S':
+                act = ACT_SCAN;
+                break;
+            case 'i':
+                act = ACT_NTH;
+                n = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
             case 'a':
                 act = ACT_ADD;
                 val = optarg;
@@ -277,6 +2313,33 @@ main(int argc, char *argv[])
                 act = ACT_DEL;
                 val = optarg;
                 break;
+            case 'I':
+                act = ACT_IMPORT;
+                fmt = optarg;
+                break;
+            case 'E':
+                act = ACT_EXPORT;
+                fmt = optarg;
+                break;
+            case 'M':
+                budget = strtoul(optarg, NULL, 10) << 20;
+                break;
+            case 'P':
+                nshards = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+            case 'C':
+                act = ACT_COMPACT;
+                break;
+            case 'H':
+                act = ACT_HITS;
+                break;
+            case OPT_STATS:
+                act = ACT_STATS;
+                if (optarg && strcmp(optarg, "kv")) {
+                    return usage(argv[0]);
+                }
+                kv = (NULL != optarg);
+                break;
             default:
                 return usage(argv[0]);
         }
@@ -285,13 +2348,21 @@ main(int argc, char *argv[])
     if (! (filename = argv[optind++])) {
         return usage(argv[0]);
     }
-    if ((act != ACT_NEW) &&
+    if ((ACT_SCAN == act) && argv[optind]) {
+        key = argv[optind++];
+    }
+    if ((act != ACT_NEW) && (act != ACT_INDEX) && (act != ACT_AUTOMATON) && (act != ACT_SCAN) &&
+            (act != ACT_IMPORT) && (act != ACT_EXPORT) && (act != ACT_COMPACT) && (act != ACT_HITS) && (act != ACT_STATS) &&
             (! (key = argv[optind++]))) {
         return usage(argv[0]);
     }
     if (argv[optind]) {
         return usage(argv[0]);
     }
+    // Text to scan is folded as it's scanned
+    if (key && (ACT_SCAN != act) && ! (key = fold_key(key))) {
+        return EX_OSERR;
+    }
 
     // Seed PRNG with some crap
     {
@@ -301,17 +2372,46 @@ main(int argc, char *argv[])
         srand((unsigned int)(tv.tv_sec * tv.tv_usec));
     }
 
+    // Everything about one key happens in its shard
+    if (key && (ACT_SUBSTRING != act) && (ACT_PREFIX != act) && (ACT_FUZZY != act) &&
+            (ACT_SCAN != act)) {
+        filename = key_file(filename, key, shardfn, sizeof(shardfn));
+    }
+
     switch (act) {
         case ACT_ONE:
             return choose(filename, key);
         case ACT_ALL:
             return list(filename, key);
+        case ACT_COUNT:
+            return count(filename, key);
+        case ACT_NTH:
+            return nth(filename, key, n);
         case ACT_ADD:
-            return add(filename, key, val);
         case ACT_DEL:
-            return del(filename, key, val);
+            return mutate(filename, act, key, val);
         case ACT_NEW:
-            return create(filename);
+            return create(filename, flags, nshards);
+        case ACT_INDEX:
+            return rebuild_all(filename, &key_index);
+        case ACT_AUTOMATON:
+            return rebuild_all(filename, &key_automaton);
+        case ACT_SCAN:
+            return scan(filename, key);
+        case ACT_SUBSTRING:
+        case ACT_PREFIX:
+        case ACT_FUZZY:
+            return search(filename, key, act);
+        case ACT_IMPORT:
+            return import(filename, fmt, flags, budget, nshards);
+        case ACT_EXPORT:
+            return export(filename, fmt);
+        case ACT_COMPACT:
+            return compact(filename, flags & (CDB_F_GROUPED | CDB_F_COMPRESSED));
+        case ACT_HITS:
+            return start_hits(filename);
+        case ACT_STATS:
+            return stats(filename, kv);
     }
 
     return 0;
@@ -0,0 +1,430 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "fq.h"
+
+#define FQ_VERSION 1
+#define HDR_SIZE 64
+#define HDR_SYNCED 56
+
+struct hdr {
+    uint64_t headseg;
+    uint64_t headoff;
+    uint64_t tailseg;
+    uint64_t tailoff;
+    uint64_t items;
+    uint64_t changes;
+};
+
+static uint32_t
+u32le(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t
+u64le(const unsigned char *p)
+{
+    return u32le(p) | ((uint64_t)u32le(p + 4) << 32);
+}
+
+static void
+put_u32le(unsigned char *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static void
+put_u64le(unsigned char *p, uint64_t v)
+{
+    put_u32le(p, v);
+    put_u32le(p + 4, v >> 32);
+}
+
+static int
+lock(int fd, int how)
+{
+    while (flock(fd, how)) {
+        if (EINTR != errno) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int
+read_hdr(struct fq *q, struct hdr *h)
+{
+    unsigned char buf[HDR_SIZE];
+
+    if (HDR_SIZE != pread(q->index, buf, HDR_SIZE, 0)) {
+        errno = EIO;
+        return -1;
+    }
+    if ((FQ_MAGIC != u32le(buf)) || (u32le(buf + 4) > FQ_VERSION)) {
+        errno = EINVAL;
+        return -1;
+    }
+    h->headseg = u64le(buf + 8);
+    h->headoff = u64le(buf + 16);
+    h->tailseg = u64le(buf + 24);
+    h->tailoff = u64le(buf + 32);
+    h->items = u64le(buf + 40);
+    h->changes = u64le(buf + 48);
+    return 0;
+}
+
+/* Everything but the count of changes on disk, which is fq_sync's */
+static int
+write_hdr(struct fq *q, struct hdr *h)
+{
+    unsigned char buf[HDR_SYNCED];
+
+    put_u32le(buf, FQ_MAGIC);
+    put_u32le(buf + 4, FQ_VERSION);
+    put_u64le(buf + 8, h->headseg);
+    put_u64le(buf + 16, h->headoff);
+    put_u64le(buf + 24, h->tailseg);
+    put_u64le(buf + 32, h->tailoff);
+    put_u64le(buf + 40, h->items);
+    put_u64le(buf + 48, h->changes);
+    return (HDR_SYNCED == pwrite(q->index, buf, HDR_SYNCED, 0)) ? 0 : -1;
+}
+
+static void
+segment_name(struct fq *q, uint64_t n, char *fn, size_t fnlen)
+{
+    snprintf(fn, fnlen, "%s/seg.%llu", q->dir, (unsigned long long)n);
+}
+
+/* Segment n, opened as the head or the tail.  Numbers are never reused,
+ * so an open segment stays good until it's replaced.
+ */
+static int
+segment(struct fq *q, uint64_t n, int tail)
+{
+    char fn[sizeof(q->dir) + 32];
+    int *fd = tail ? &q->tail : &q->head;
+    uint64_t *seg = tail ? &q->tailseg : &q->headseg;
+
+    if ((-1 != *fd) && (*seg == n)) {
+        return *fd;
+    }
+    if (-1 != *fd) {
+        close(*fd);
+    }
+    segment_name(q, n, fn, sizeof(fn));
+    *fd = open(fn, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    *seg = n;
+    return *fd;
+}
+
+static int
+sync_dir(struct fq *q)
+{
+    int fd = open(q->dir, O_RDONLY | O_CLOEXEC);
+    int ret;
+
+    if (-1 == fd) {
+        return -1;
+    }
+    ret = fsync(fd);
+    close(fd);
+    return ret;
+}
+
+/* Wait until change number changes is on disk.  Whoever gets the sync
+ * lock first syncs every change made so far, so processes changing the
+ * queue at the same moment share one fdatasync().
+ */
+static int
+fq_sync(struct fq *q, uint64_t changes)
+{
+    unsigned char buf[8];
+    struct hdr h;
+    int ret = 0;
+
+    if (-1 == q->synclock) {
+        char fn[sizeof(q->dir) + 16];
+
+        snprintf(fn, sizeof(fn), "%s/sync", q->dir);
+        if (-1 == (q->synclock = open(fn, O_RDWR | O_CREAT | O_CLOEXEC, 0666))) {
+            return -1;
+        }
+    }
+    if (lock(q->synclock, LOCK_EX)) {
+        return -1;
+    }
+    if (8 != pread(q->index, buf, 8, HDR_SYNCED)) {
+        ret = -1;
+    } else if (u64le(buf) < changes) {
+        int fd;
+
+        if (lock(q->index, LOCK_SH) || read_hdr(q, &h)) {
+            ret = -1;
+        }
+        flock(q->index, LOCK_UN);
+        if ((0 == ret) &&
+                ((-1 == (fd = segment(q, h.tailseg, 1))) ||
+                 fdatasync(fd) || fdatasync(q->index))) {
+            ret = -1;
+        }
+        if (0 == ret) {
+            put_u64le(buf, h.changes);
+            if (8 != pwrite(q->index, buf, 8, HDR_SYNCED)) {
+                ret = -1;
+            }
+        }
+    }
+    flock(q->synclock, LOCK_UN);
+    return ret;
+}
+
+/* Open the queue in dir, making it if it isn't there */
+int
+fq_open(struct fq *q, const char *dir, int flags)
+{
+    char fn[sizeof(q->dir) + 16];
+    struct stat st;
+
+    if (strlen(dir) >= sizeof(q->dir)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(q, 0, sizeof(*q));
+    strcpy(q->dir, dir);
+    q->flags = flags;
+    q->index = -1;
+    q->synclock = -1;
+    q->head = -1;
+    q->tail = -1;
+
+    if (mkdir(dir, 0777) && (EEXIST != errno)) {
+        return -1;
+    }
+    snprintf(fn, sizeof(fn), "%s/index", dir);
+    if (-1 == (q->index = open(fn, O_RDWR | O_CREAT | O_CLOEXEC, 0666))) {
+        return -1;
+    }
+    if (lock(q->index, LOCK_EX) || fstat(q->index, &st)) {
+        fq_close(q);
+        return -1;
+    }
+    if (0 == st.st_size) {
+        unsigned char buf[HDR_SIZE] = {0};
+        struct hdr h = {0};
+
+        if ((HDR_SIZE != pwrite(q->index, buf, HDR_SIZE, 0)) || write_hdr(q, &h) ||
+                (-1 == segment(q, 0, 1)) || ((flags & FQ_SYNC) && sync_dir(q))) {
+            fq_close(q);
+            return -1;
+        }
+    }
+    flock(q->index, LOCK_UN);
+    return 0;
+}
+
+void
+fq_close(struct fq *q)
+{
+    int *fds[] = {&q->index, &q->synclock, &q->head, &q->tail, NULL};
+    int **fd;
+
+    for (fd = fds; *fd; fd += 1) {
+        if (-1 != **fd) {
+            close(**fd);
+        }
+        **fd = -1;
+    }
+}
+
+/* Add len bytes at item to the tail */
+int
+fq_push(struct fq *q, const void *item, size_t len)
+{
+    unsigned char lenbuf[4];
+    struct iovec iov[2];
+    struct hdr h;
+    int ret = -1;
+    int fd;
+
+    if (len > FQ_ITEM_MAX) {
+        errno = EFBIG;
+        return -1;
+    }
+    if (lock(q->index, LOCK_EX)) {
+        return -1;
+    }
+    if (read_hdr(q, &h)) {
+        goto done;
+    }
+
+    if ((h.tailoff > 0) && (h.tailoff + 4 + len > FQ_SEGMENT)) {
+        // Start a new segment, cutting off anything a failed push left
+        if ((-1 == (fd = segment(q, h.tailseg, 1))) || ftruncate(fd, h.tailoff) ||
+                ((q->flags & FQ_SYNC) && fdatasync(fd))) {
+            goto done;
+        }
+        h.tailseg += 1;
+        h.tailoff = 0;
+        if ((-1 == segment(q, h.tailseg, 1)) || ((q->flags & FQ_SYNC) && sync_dir(q))) {
+            goto done;
+        }
+    }
+    if (-1 == (fd = segment(q, h.tailseg, 1))) {
+        goto done;
+    }
+
+    put_u32le(lenbuf, len);
+    iov[0].iov_base = lenbuf;
+    iov[0].iov_len = 4;
+    iov[1].iov_base = (void *)item;
+    iov[1].iov_len = len;
+    if ((ssize_t)(4 + len) != pwritev(fd, iov, 2, h.tailoff)) {
+        goto done;
+    }
+    h.tailoff += 4 + len;
+    h.items += 1;
+    h.changes += 1;
+    ret = write_hdr(q, &h);
+
+  done:
+    flock(q->index, LOCK_UN);
+    if ((0 == ret) && (q->flags & FQ_SYNC)) {
+        ret = fq_sync(q, h.changes);
+    }
+    return ret;
+}
+
+/* Read the head item into a new NUL-terminated buffer at *item, and if
+ * remove, take it off the queue.  Returns 1, 0 if the queue is empty,
+ * or -1.
+ */
+static int
+take(struct fq *q, char **item, size_t *len, int remove)
+{
+    char fn[sizeof(q->dir) + 32];
+    unsigned char lenbuf[4];
+    struct hdr h;
+    uint64_t end;
+    uint32_t n;
+    int ret = -1;
+    int fd;
+
+    if (lock(q->index, remove ? LOCK_EX : LOCK_SH)) {
+        return -1;
+    }
+    if (read_hdr(q, &h)) {
+        goto done;
+    }
+
+    // Skip over finished segments, deleting them if we're allowed
+    for (;;) {
+        struct stat st;
+
+        if (0 == h.items) {
+            ret = 0;
+            goto done;
+        }
+        if (-1 == (fd = segment(q, h.headseg, 0))) {
+            goto done;
+        }
+        if (h.headseg == h.tailseg) {
+            end = h.tailoff;
+        } else if (fstat(fd, &st)) {
+            goto done;
+        } else {
+            end = st.st_size;
+        }
+        if (h.headoff < end) {
+            break;
+        } else if (h.headseg == h.tailseg) {
+            errno = EIO;
+            goto done;
+        }
+        if (remove) {
+            segment_name(q, h.headseg, fn, sizeof(fn));
+            unlink(fn);
+        }
+        h.headseg += 1;
+        h.headoff = 0;
+    }
+
+    if ((4 != pread(fd, lenbuf, 4, h.headoff)) ||
+            ((n = u32le(lenbuf)) > end - h.headoff - 4)) {
+        errno = EIO;
+        goto done;
+    }
+    if (! (*item = malloc(n + 1))) {
+        goto done;
+    }
+    if (n != pread(fd, *item, n, h.headoff + 4)) {
+        free(*item);
+        *item = NULL;
+        errno = EIO;
+        goto done;
+    }
+    (*item)[n] = '\0';
+    *len = n;
+    ret = 1;
+
+    if (remove) {
+        h.headoff += 4 + n;
+        h.items -= 1;
+        h.changes += 1;
+        if ((0 == h.items) && (h.headseg == h.tailseg)) {
+            // Empty: start the segment over
+            h.headoff = 0;
+            h.tailoff = 0;
+        }
+        if (write_hdr(q, &h)) {
+            free(*item);
+            *item = NULL;
+            ret = -1;
+        }
+    }
+
+  done:
+    flock(q->index, LOCK_UN);
+    if ((1 == ret) && remove && (q->flags & FQ_SYNC) && fq_sync(q, h.changes)) {
+        free(*item);
+        *item = NULL;
+        ret = -1;
+    }
+    return ret;
+}
+
+int
+fq_pop(struct fq *q, char **item, size_t *len)
+{
+    return take(q, item, len, 1);
+}
+
+int
+fq_peek(struct fq *q, char **item, size_t *len)
+{
+    return take(q, item, len, 0);
+}
+
+int64_t
+fq_len(struct fq *q)
+{
+    struct hdr h;
+    int ret;
+
+    if (lock(q->index, LOCK_SH)) {
+        return -1;
+    }
+    ret = read_hdr(q, &h);
+    flock(q->index, LOCK_UN);
+    return ret ? -1 : (int64_t)h.items;
+}
@@ -0,0 +1,53 @@
+#ifndef __FQ_H__
+#define __FQ_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A persistent FIFO queue, safe for any number of processes at once.
+ *
+ * A queue is a directory.  Items are appended to segment files, seg.N,
+ * as a 32-bit little-endian length and the item; a new segment starts
+ * once one passes FQ_SEGMENT bytes, and a segment is deleted once
+ * everything in it has been popped.  The index file holds where the
+ * head and tail are, and how many items there are between them, so
+ * every operation costs a few reads and writes however long the queue
+ * is.  An exclusive flock() on the index serializes changes; a push that
+ * dies before updating the index leaves nothing behind.
+ *
+ * Index, little-endian:
+ *
+ *   0  u32 FQ_MAGIC
+ *   4  u32 version
+ *   8  u64 head segment        16 u64 head offset
+ *  24  u64 tail segment        32 u64 tail offset
+ *  40  u64 items
+ *  48  u64 changes made        56 u64 changes on disk (with FQ_SYNC)
+ */
+#define FQ_MAGIC 0x31305146     // "FQ01"
+#define FQ_SEGMENT (1 << 20)
+#define FQ_ITEM_MAX (1 << 24)
+
+// Open flags
+#define FQ_SYNC 1               // Don't return from a change until it's on disk
+
+struct fq {
+    char dir[4096];
+    int flags;
+    int index;                  // Index, and its lock
+    int synclock;               // Held while syncing
+    int head;                   // Segments, -1 until needed
+    uint64_t headseg;
+    int tail;
+    uint64_t tailseg;
+};
+
+int fq_open(struct fq *q, const char *dir, int flags);
+void fq_close(struct fq *q);
+int fq_push(struct fq *q, const void *item, size_t len);
+int fq_pop(struct fq *q, char **item, size_t *len);
+int fq_peek(struct fq *q, char **item, size_t *len);
+int64_t fq_len(struct fq *q);
+
+#endif
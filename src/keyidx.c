@@ -0,0 +1,832 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cdb.h"
+#include "cdbmake.h"
+#include "keyidx.h"
+
+/*
+ * Key index
+ *
+ * A sidecar database that answers "which keys look like this?" without
+ * reading every record of the main database.  It holds:
+ *
+ *   "n"            u32 number of keys
+ *   "K"            every key, sorted, each followed by a NUL
+ *   "k" u32 id     key number id, in sorted order
+ *   "t" 3 bytes    u32 ids of keys containing that trigram, ascending
+ *
+ * Trigrams are taken over each key padded with two NULs on either end,
+ * so every key has len + 2 of them, even short ones.  Substring queries
+ * use only the unpadded trigrams; fuzzy queries use all of them.
+ */
+
+#ifndef min
+#define min(a,b) ((a)<(b)?(a):(b))
+#endif
+
+static void
+put_u32le(uint8_t *p, uint32_t val)
+{
+    p[0] = (val >> 0)  & 0xff;
+    p[1] = (val >> 8)  & 0xff;
+    p[2] = (val >> 16) & 0xff;
+    p[3] = (val >> 24) & 0xff;
+}
+
+static uint32_t
+get_u32le(const uint8_t *p)
+{
+    return ((p[0] << 0) |
+            (p[1] << 8) |
+            (p[2] << 16) |
+            ((uint32_t)p[3] << 24));
+}
+
+static int
+keycmp(const char *a, size_t alen, const char *b, size_t blen)
+{
+    int r = memcmp(a, b, min(alen, blen));
+
+    if (r) {
+        return r;
+    }
+    return (alen > blen) - (alen < blen);
+}
+
+/* Distinct padded trigrams of s, as 24-bit numbers.  Returns how many. */
+static size_t
+trigrams(const char *s, size_t len, uint32_t *out, int padded)
+{
+    size_t n = 0;
+    size_t i;
+    size_t j;
+    uint32_t g = 0;
+
+    // Shift the string through, NULs first and last
+    for (i = 0; i < len + 4; i += 1) {
+        uint8_t c = ((i < 2) || (i >= len + 2)) ? 0 : (uint8_t)s[i - 2];
+
+        g = ((g << 8) | c) & 0xffffff;
+        if (i < 2) {
+            continue;
+        }
+        if (! padded && ((i < 4) || (i >= len + 2))) {
+            continue;
+        }
+        for (j = 0; j < n; j += 1) {
+            if (out[j] == g) {
+                break;
+            }
+        }
+        if (j == n) {
+            out[n++] = g;
+        }
+    }
+
+    return n;
+}
+
+/*
+ * Building
+ */
+
+struct keylist {
+    char *arena;
+    size_t arenalen;
+    size_t arenasize;
+    uint32_t *offsets;
+    uint32_t *lens;
+    uint32_t n;
+    uint32_t size;
+};
+
+static struct keylist *sorting;
+
+static int
+cmp_ids(const void *a, const void *b)
+{
+    uint32_t ia = *(uint32_t *)a;
+    uint32_t ib = *(uint32_t *)b;
+
+    return keycmp(sorting->arena + sorting->offsets[ia], sorting->lens[ia],
+            sorting->arena + sorting->offsets[ib], sorting->lens[ib]);
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+    uint64_t ua = *(uint64_t *)a;
+    uint64_t ub = *(uint64_t *)b;
+
+    return (ua > ub) - (ua < ub);
+}
+
+static int
+cmp_u32(const void *a, const void *b)
+{
+    uint32_t ua = *(uint32_t *)a;
+    uint32_t ub = *(uint32_t *)b;
+
+    return (ua > ub) - (ua < ub);
+}
+
+static int
+keylist_add(struct keylist *kl, char *key, size_t keylen)
+{
+    if (kl->n == kl->size) {
+        uint32_t size = kl->size ? kl->size * 2 : 1024;
+        uint32_t *offsets = (uint32_t *)realloc(kl->offsets, size * sizeof(uint32_t));
+        uint32_t *lens;
+
+        if (! offsets) {
+            return -1;
+        }
+        kl->offsets = offsets;
+        if (! (lens = (uint32_t *)realloc(kl->lens, size * sizeof(uint32_t)))) {
+            return -1;
+        }
+        kl->lens = lens;
+        kl->size = size;
+    }
+    if (kl->arenalen + keylen + 1 > kl->arenasize) {
+        size_t arenasize = kl->arenasize ? kl->arenasize : 65536;
+        char *arena;
+
+        while (arenasize < kl->arenalen + keylen + 1) {
+            arenasize *= 2;
+        }
+        if (! (arena = (char *)realloc(kl->arena, arenasize))) {
+            return -1;
+        }
+        kl->arena = arena;
+        kl->arenasize = arenasize;
+    }
+
+    memcpy(kl->arena + kl->arenalen, key, keylen);
+    kl->arena[kl->arenalen + keylen] = '\0';
+    kl->offsets[kl->n] = kl->arenalen;
+    kl->lens[kl->n] = keylen;
+    kl->arenalen += keylen + 1;
+    kl->n += 1;
+
+    return 0;
+}
+
+int
+keyidx_build(FILE *db, FILE *idx)
+{
+    struct cdb_ctx inc;
+    struct cdbmake_ctx outc;
+    struct keylist kl = {0};
+    uint32_t *order = NULL;
+    char *blob = NULL;
+    size_t bloblen = 0;
+    uint64_t *pairs = NULL;
+    size_t npairs = 0;
+    size_t pairsize = 0;
+    uint32_t *ids = NULL;
+    char *dkey = NULL;
+    size_t dkeysize = 0;
+    char *dval = NULL;
+    size_t dvalsize = 0;
+    uint32_t i;
+    int ret = -1;
+
+    if (cdb_init(&inc, db)) {
+        return -1;
+    }
+
+    // Gather every key once
+    for (;;) {
+        size_t keylen;
+        size_t vallen;
+
+        if (EOF == cdb_dump_full(&inc, &dkey, &dkeysize, &keylen, &dval, &dvalsize, &vallen)) {
+            break;
+        }
+        if (kl.n &&
+                (kl.lens[kl.n - 1] == keylen) &&
+                (0 == memcmp(kl.arena + kl.offsets[kl.n - 1], dkey, keylen))) {
+            continue;
+        }
+        if (keylist_add(&kl, dkey, keylen)) {
+            perror("Building key list");
+            goto done;
+        }
+    }
+
+    // Sort, dropping the duplicates that weren't next to each other
+    order = (uint32_t *)malloc((kl.n + 1) * sizeof(uint32_t));
+    blob = (char *)malloc(kl.arenalen + 1);
+    if (! order || ! blob) {
+        perror("Sorting keys");
+        goto done;
+    }
+    for (i = 0; i < kl.n; i += 1) {
+        order[i] = i;
+    }
+    sorting = &kl;
+    qsort(order, kl.n, sizeof(uint32_t), cmp_ids);
+    {
+        uint32_t n = 0;
+
+        for (i = 0; i < kl.n; i += 1) {
+            if (n && (0 == cmp_ids(&order[n - 1], &order[i]))) {
+                continue;
+            }
+            order[n++] = order[i];
+        }
+        kl.n = n;
+    }
+
+    // Trigram postings, as (trigram << 32 | id) so one sort groups them
+    for (i = 0; i < kl.n; i += 1) {
+        char *key = kl.arena + kl.offsets[order[i]];
+        uint32_t keylen = kl.lens[order[i]];
+        uint32_t grams[keylen + 2];
+        size_t ngrams = trigrams(key, keylen, grams, 1);
+        size_t j;
+
+        if (npairs + ngrams > pairsize) {
+            size_t size = pairsize ? pairsize : 65536;
+            uint64_t *p;
+
+            while (size < npairs + ngrams) {
+                size *= 2;
+            }
+            if (! (p = (uint64_t *)realloc(pairs, size * sizeof(uint64_t)))) {
+                perror("Building postings");
+                goto done;
+            }
+            pairs = p;
+            pairsize = size;
+        }
+        for (j = 0; j < ngrams; j += 1) {
+            pairs[npairs++] = ((uint64_t)grams[j] << 32) | i;
+        }
+    }
+    qsort(pairs, npairs, sizeof(uint64_t), cmp_u64);
+
+    cdbmake_init(&outc, idx, CDB_F_SEEDED);
+    {
+        uint8_t n[4];
+
+        put_u32le(n, kl.n);
+        cdbmake_add(&outc, "n", 1, (char *)n, sizeof(n));
+    }
+    for (i = 0; i < kl.n; i += 1) {
+        char *key = kl.arena + kl.offsets[order[i]];
+        uint32_t keylen = kl.lens[order[i]];
+        char k[5] = "k";
+
+        memcpy(blob + bloblen, key, keylen + 1);
+        bloblen += keylen + 1;
+
+        put_u32le((uint8_t *)k + 1, i);
+        cdbmake_add(&outc, k, sizeof(k), key, keylen);
+    }
+    cdbmake_add(&outc, "K", 1, blob, bloblen);
+
+    ids = (uint32_t *)pairs;   // Packed ids never outrun the pairs they came from
+    {
+        size_t p;
+        size_t start;
+
+        for (start = 0; start < npairs; start = p) {
+            uint32_t g = pairs[start] >> 32;
+            char k[4] = { 't', (g >> 16) & 0xff, (g >> 8) & 0xff, g & 0xff };
+            size_t nids = 0;
+
+            for (p = start; (p < npairs) && ((pairs[p] >> 32) == g); p += 1) {
+                put_u32le((uint8_t *)(ids + start + nids), (uint32_t)pairs[p]);
+                nids += 1;
+            }
+            cdbmake_add(&outc, k, sizeof(k), (char *)(ids + start), nids * 4);
+        }
+    }
+    cdbmake_finalize(&outc);
+    ret = 0;
+
+  done:
+    cdb_fini(&inc);
+    free(dkey);
+    free(dval);
+    free(pairs);
+    free(blob);
+    free(order);
+    free(kl.arena);
+    free(kl.offsets);
+    free(kl.lens);
+
+    return ret;
+}
+
+/*
+ * Querying
+ */
+
+/* The (only) value for key, NUL-terminated, or NULL */
+static char *
+get_value(struct cdb_ctx *c, char *key, size_t keylen, uint32_t *len)
+{
+    char *buf;
+
+    cdb_find(c, key, keylen);
+    if (0 == cdb_count(c)) {
+        return NULL;
+    }
+    *len = cdb_next(c, NULL, 0);
+    if (! (buf = (char *)malloc(*len + 1))) {
+        return NULL;
+    }
+    cdb_nth(c, 0, buf, *len);
+    buf[*len] = '\0';
+
+    return buf;
+}
+
+static char *
+key_by_id(struct cdb_ctx *c, uint32_t id, uint32_t *len)
+{
+    char k[5] = "k";
+
+    put_u32le((uint8_t *)k + 1, id);
+    return get_value(c, k, sizeof(k), len);
+}
+
+/* Posting list for trigram g, decoded in place */
+static uint32_t *
+postings(struct cdb_ctx *c, uint32_t g, uint32_t *n)
+{
+    char k[4] = { 't', (g >> 16) & 0xff, (g >> 8) & 0xff, g & 0xff };
+    uint32_t len;
+    uint32_t *ids = (uint32_t *)get_value(c, k, sizeof(k), &len);
+    uint32_t i;
+
+    *n = 0;
+    if (! ids) {
+        return NULL;
+    }
+    *n = len / 4;
+    for (i = 0; i < *n; i += 1) {
+        ids[i] = get_u32le((uint8_t *)(ids + i));
+    }
+
+    return ids;
+}
+
+/* Length of trigram g's posting list, without reading it */
+static uint32_t
+postings_len(struct cdb_ctx *c, uint32_t g)
+{
+    char k[4] = { 't', (g >> 16) & 0xff, (g >> 8) & 0xff, g & 0xff };
+
+    cdb_find(c, k, sizeof(k));
+    return cdb_next(c, NULL, 0) / 4;
+}
+
+struct gram_list {
+    uint32_t g;
+    uint32_t n;
+};
+
+static int
+cmp_lists(const void *a, const void *b)
+{
+    const struct gram_list *la = (const struct gram_list *)a;
+    const struct gram_list *lb = (const struct gram_list *)b;
+
+    return (la->n > lb->n) - (la->n < lb->n);
+}
+
+static int
+open_idx(struct cdb_ctx *c, FILE *idx)
+{
+    if (cdb_init(c, idx)) {
+        fprintf(stderr, "Unsupported index format\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* Call fn on every key in the index for which match() says so */
+static int
+scan(struct cdb_ctx *c,
+        int (*match)(char *key, size_t keylen, void *mctx), void *mctx,
+        keyidx_fn fn, void *arg)
+{
+    uint32_t len;
+    char *blob = get_value(c, "K", 1, &len);
+    char *p;
+
+    if (! blob) {
+        return 0;
+    }
+    for (p = blob; p < blob + len; p += strlen(p) + 1) {
+        if (match(p, strlen(p), mctx)) {
+            fn(p, strlen(p), arg);
+        }
+    }
+    free(blob);
+
+    return 0;
+}
+
+struct needle {
+    char *q;
+    size_t qlen;
+    int maxdist;
+};
+
+static int
+contains(char *key, size_t keylen, void *mctx)
+{
+    struct needle *n = (struct needle *)mctx;
+
+    return (NULL != memmem(key, keylen, n->q, n->qlen));
+}
+
+static int
+substring(struct cdb_ctx *c, char *q, size_t qlen, keyidx_fn fn, void *arg)
+{
+    struct needle needle = { q, qlen, 0 };
+    uint32_t grams[qlen + 2];
+    size_t ngrams;
+    uint32_t *result = NULL;
+    uint32_t nresult = 0;
+    size_t i;
+
+    // Too short to have a trigram: look at them all
+    if (qlen < 3) {
+        return scan(c, contains, &needle, fn, arg);
+    }
+
+    ngrams = trigrams(q, qlen, grams, 0);
+    for (i = 0; i < ngrams; i += 1) {
+        uint32_t n;
+        uint32_t *ids = postings(c, grams[i], &n);
+
+        if (! ids) {
+            free(result);
+            return 0;
+        }
+        if (! result) {
+            result = ids;
+            nresult = n;
+        } else {
+            uint32_t a = 0;
+            uint32_t b = 0;
+            uint32_t out = 0;
+
+            while ((a < nresult) && (b < n)) {
+                if (result[a] < ids[b]) {
+                    a += 1;
+                } else if (result[a] > ids[b]) {
+                    b += 1;
+                } else {
+                    result[out++] = result[a];
+                    a += 1;
+                    b += 1;
+                }
+            }
+            nresult = out;
+            free(ids);
+        }
+        if (0 == nresult) {
+            break;
+        }
+    }
+
+    // Having all the trigrams doesn't mean having them in order
+    for (i = 0; i < nresult; i += 1) {
+        uint32_t keylen;
+        char *key = key_by_id(c, result[i], &keylen);
+
+        if (key && contains(key, keylen, &needle)) {
+            fn(key, keylen, arg);
+        }
+        free(key);
+    }
+    free(result);
+
+    return 0;
+}
+
+int
+keyidx_substring(FILE *idx, char *q, size_t qlen, keyidx_fn fn, void *arg)
+{
+    struct cdb_ctx c;
+    int ret;
+
+    if (open_idx(&c, idx)) {
+        return -1;
+    }
+    ret = substring(&c, q, qlen, fn, arg);
+    cdb_fini(&c);
+
+    return ret;
+}
+
+static int
+prefix(struct cdb_ctx *c, char *q, size_t qlen, keyidx_fn fn, void *arg)
+{
+    uint32_t len;
+    uint32_t *np;
+    uint32_t lo = 0;
+    uint32_t hi;
+    uint32_t i;
+
+    if (! (np = (uint32_t *)get_value(c, "n", 1, &len))) {
+        return 0;
+    }
+    hi = get_u32le((uint8_t *)np);
+    free(np);
+
+    // Keys are sorted, so everything with this prefix is in one run
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        uint32_t keylen;
+        char *key = key_by_id(c, mid, &keylen);
+
+        if (key && (keycmp(key, keylen, q, qlen) < 0)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+        free(key);
+    }
+
+    for (i = lo; ; i += 1) {
+        uint32_t keylen;
+        char *key = key_by_id(c, i, &keylen);
+        int match;
+
+        if (! key) {
+            break;
+        }
+        match = (keylen >= qlen) && (0 == memcmp(key, q, qlen));
+        if (match) {
+            fn(key, keylen, arg);
+        }
+        free(key);
+        if (! match) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+int
+keyidx_prefix(FILE *idx, char *q, size_t qlen, keyidx_fn fn, void *arg)
+{
+    struct cdb_ctx c;
+    int ret;
+
+    if (open_idx(&c, idx)) {
+        return -1;
+    }
+    ret = prefix(&c, q, qlen, fn, arg);
+    cdb_fini(&c);
+
+    return ret;
+}
+
+/* Edit distance between a and b, or max + 1 if it's more than max */
+static int
+distance(const char *a, size_t alen, const char *b, size_t blen, int max)
+{
+    int row[2][blen + 1];
+    size_t i;
+    size_t j;
+
+    if ((alen > blen + max) || (blen > alen + max)) {
+        return max + 1;
+    }
+
+    for (j = 0; j <= blen; j += 1) {
+        row[0][j] = j;
+    }
+    for (i = 1; i <= alen; i += 1) {
+        int *prev = row[(i - 1) % 2];
+        int *cur = row[i % 2];
+        int best;
+
+        cur[0] = i;
+        best = cur[0];
+        for (j = 1; j <= blen; j += 1) {
+            int d = prev[j - 1] + (a[i - 1] != b[j - 1]);
+
+            d = min(d, prev[j] + 1);
+            d = min(d, cur[j - 1] + 1);
+            cur[j] = d;
+            best = min(best, d);
+        }
+        if (best > max) {
+            return max + 1;
+        }
+    }
+
+    return min(row[alen % 2][blen], max + 1);
+}
+
+struct fuzzy_hit {
+    char *key;
+    uint32_t keylen;
+    int dist;
+};
+
+struct fuzzy_ctx {
+    struct needle *needle;
+    struct fuzzy_hit *hits;
+    size_t nhits;
+    size_t size;
+};
+
+static int
+cmp_hits(const void *a, const void *b)
+{
+    const struct fuzzy_hit *ha = (const struct fuzzy_hit *)a;
+    const struct fuzzy_hit *hb = (const struct fuzzy_hit *)b;
+
+    if (ha->dist != hb->dist) {
+        return ha->dist - hb->dist;
+    }
+    return keycmp(ha->key, ha->keylen, hb->key, hb->keylen);
+}
+
+static int
+fuzzy_match(char *key, size_t keylen, void *mctx)
+{
+    struct fuzzy_ctx *fc = (struct fuzzy_ctx *)mctx;
+    struct needle *n = fc->needle;
+    int dist = distance(key, keylen, n->q, n->qlen, n->maxdist);
+
+    if (dist > n->maxdist) {
+        return 0;
+    }
+    if (fc->nhits == fc->size) {
+        size_t size = fc->size ? fc->size * 2 : 64;
+        struct fuzzy_hit *hits = (struct fuzzy_hit *)realloc(fc->hits, size * sizeof(*hits));
+
+        if (! hits) {
+            return 0;
+        }
+        fc->hits = hits;
+        fc->size = size;
+    }
+    if (! (fc->hits[fc->nhits].key = (char *)malloc(keylen + 1))) {
+        return 0;
+    }
+    memcpy(fc->hits[fc->nhits].key, key, keylen);
+    fc->hits[fc->nhits].keylen = keylen;
+    fc->hits[fc->nhits].dist = dist;
+    fc->nhits += 1;
+
+    return 0;
+}
+
+static void
+ignore(char *key, size_t keylen, void *arg)
+{
+}
+
+static int
+fuzzy(struct cdb_ctx *c, char *q, size_t qlen, int maxdist, keyidx_fn fn, void *arg)
+{
+    struct needle needle = { q, qlen, maxdist };
+    struct fuzzy_ctx fc = { &needle, NULL, 0, 0 };
+    uint32_t grams[qlen + 2];
+    size_t ngrams;
+    int threshold;
+    size_t i;
+
+    /* Each edit breaks at most 3 of the query's trigrams, so a close
+     * enough key shares at least this many of them.  If that's nothing,
+     * every key is a candidate.
+     */
+    ngrams = trigrams(q, qlen, grams, 1);
+    threshold = (int)ngrams - 3 * maxdist;
+
+    if (threshold < 1) {
+        scan(c, fuzzy_match, &fc, ignore, NULL);
+    } else {
+        struct gram_list lists[ngrams];
+        size_t nshort = ngrams - threshold + 1;
+        size_t unread = 0;
+        uint32_t *cand = NULL;
+        uint32_t *count = NULL;
+        size_t ncand = 0;
+        size_t nall = 0;
+        size_t start;
+        size_t p;
+
+        /* A close key is missing from at most ngrams - threshold lists,
+         * so it has to turn up in one of the nshort shortest.
+         */
+        for (i = 0; i < ngrams; i += 1) {
+            lists[i].g = grams[i];
+            lists[i].n = postings_len(c, grams[i]);
+        }
+        qsort(lists, ngrams, sizeof(struct gram_list), cmp_lists);
+
+        for (i = 0; i < nshort; i += 1) {
+            uint32_t n;
+            uint32_t *ids = postings(c, lists[i].g, &n);
+            uint32_t *a;
+
+            if (! ids) {
+                continue;
+            }
+            if (! (a = (uint32_t *)realloc(cand, (nall + n) * sizeof(uint32_t)))) {
+                free(ids);
+                break;
+            }
+            cand = a;
+            memcpy(cand + nall, ids, n * sizeof(uint32_t));
+            nall += n;
+            free(ids);
+        }
+        qsort(cand, nall, sizeof(uint32_t), cmp_u32);
+        count = (uint32_t *)malloc((nall + 1) * sizeof(uint32_t));
+        if (! count) {
+            nall = 0;
+        }
+        for (start = 0; start < nall; start = p) {
+            for (p = start; (p < nall) && (cand[p] == cand[start]); p += 1);
+            cand[ncand] = cand[start];
+            count[ncand] = p - start;
+            ncand += 1;
+        }
+
+        // Count the rest, unless they're so long that checking is cheaper
+        for (; i < ngrams; i += 1) {
+            uint32_t n;
+            uint32_t *ids;
+            size_t a = 0;
+            size_t b = 0;
+
+            if (lists[i].n > 16 * ncand) {
+                unread += 1;
+                continue;
+            }
+            if (! (ids = postings(c, lists[i].g, &n))) {
+                continue;
+            }
+            while ((a < ncand) && (b < n)) {
+                if (cand[a] < ids[b]) {
+                    a += 1;
+                } else if (cand[a] > ids[b]) {
+                    b += 1;
+                } else {
+                    count[a] += 1;
+                    a += 1;
+                    b += 1;
+                }
+            }
+            free(ids);
+        }
+
+        for (p = 0; p < ncand; p += 1) {
+            if (count[p] + unread >= threshold) {
+                uint32_t keylen;
+                char *key = key_by_id(c, cand[p], &keylen);
+
+                if (key) {
+                    fuzzy_match(key, keylen, &fc);
+                }
+                free(key);
+            }
+        }
+        free(count);
+        free(cand);
+    }
+
+    // Closest first
+    qsort(fc.hits, fc.nhits, sizeof(struct fuzzy_hit), cmp_hits);
+    for (i = 0; i < fc.nhits; i += 1) {
+        fn(fc.hits[i].key, fc.hits[i].keylen, arg);
+        free(fc.hits[i].key);
+    }
+    free(fc.hits);
+
+    return 0;
+}
+
+int
+keyidx_fuzzy(FILE *idx, char *q, size_t qlen, int maxdist, keyidx_fn fn, void *arg)
+{
+    struct cdb_ctx c;
+    int ret;
+
+    if (open_idx(&c, idx)) {
+        return -1;
+    }
+    ret = fuzzy(&c, q, qlen, maxdist, fn, arg);
+    cdb_fini(&c);
+
+    return ret;
+}
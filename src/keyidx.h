@@ -0,0 +1,14 @@
+#ifndef __KEYIDX_H__
+#define __KEYIDX_H__
+
+#include <stdio.h>
+#include <stdint.h>
+
+typedef void (*keyidx_fn)(char *key, size_t keylen, void *arg);
+
+int keyidx_build(FILE *db, FILE *idx);
+int keyidx_substring(FILE *idx, char *q, size_t qlen, keyidx_fn fn, void *arg);
+int keyidx_prefix(FILE *idx, char *q, size_t qlen, keyidx_fn fn, void *arg);
+int keyidx_fuzzy(FILE *idx, char *q, size_t qlen, int maxdist, keyidx_fn fn, void *arg);
+
+#endif
@@ -0,0 +1,351 @@
+#include <stdlib.h>
+#include <string.h>
+#include "lz.h"
+
+/*
+ * A small LZ77 compressor, in the spirit of LZ4.
+ *
+ * The output is a series of sequences, each
+ *
+ *   u8   token               (literal count << 4 | (match length - 4))
+ *   u8   more[]              (either half 15: add bytes until one isn't 255)
+ *   u8   literals[]
+ *   u16  offset              (little-endian; absent in the last sequence)
+ *   u8   more[]              (match length)
+ *
+ * The last sequence is literals only.  Matches may reach back past the
+ * start of the data into a dictionary, as if it came just before.
+ */
+
+#define MIN_MATCH 4
+#define HASH_BITS 14
+
+static uint32_t
+read32(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint32_t
+hash4(const uint8_t *p)
+{
+    return (read32(p) * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static uint8_t *
+put_length(uint8_t *op, size_t len)
+{
+    for (; len >= 255; len -= 255) {
+        *op++ = 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+static uint8_t *
+put_sequence(uint8_t *op, const uint8_t *lit, size_t litlen,
+        size_t offset, size_t matchlen)
+{
+    uint8_t *token = op++;
+
+    *token = ((litlen < 15) ? litlen : 15) << 4;
+    if (litlen >= 15) {
+        op = put_length(op, litlen - 15);
+    }
+    memcpy(op, lit, litlen);
+    op += litlen;
+
+    if (matchlen) {
+        matchlen -= MIN_MATCH;
+        *op++ = offset & 0xff;
+        *op++ = offset >> 8;
+        *token |= (matchlen < 15) ? matchlen : 15;
+        if (matchlen >= 15) {
+            op = put_length(op, matchlen - 15);
+        }
+    }
+    return op;
+}
+
+/* Compress len bytes of src into dst, which holds LZ_BOUND(len).
+ * Returns the compressed length.
+ */
+size_t
+lz_compress(const uint8_t *dict, size_t dictlen,
+        const uint8_t *src, size_t len, uint8_t *dst)
+{
+    // Positions are counted from the start of the dictionary, plus one
+    // so that 0 means nothing's there
+    uint32_t table[1 << HASH_BITS];
+    const uint8_t *ip = src;
+    const uint8_t *anchor = src;
+    const uint8_t *end = src + len;
+    uint8_t *op = dst;
+    size_t i;
+
+    memset(table, 0, sizeof(table));
+    if (dictlen > LZ_WINDOW) {
+        dict += dictlen - LZ_WINDOW;
+        dictlen = LZ_WINDOW;
+    }
+    for (i = 0; i + MIN_MATCH <= dictlen; i += 1) {
+        table[hash4(dict + i)] = i + 1;
+    }
+
+    if (len >= MIN_MATCH) {
+        // Leave room so that reading 4 bytes never runs off the end
+        const uint8_t *limit = end - MIN_MATCH;
+
+        while (ip <= limit) {
+            uint32_t h = hash4(ip);
+            size_t here = dictlen + (ip - src);
+            size_t there = table[h];
+            const uint8_t *ref;
+            const uint8_t *refend;
+            size_t matchlen;
+
+            table[h] = here + 1;
+            if ((0 == there) || (here - (there - 1) > LZ_WINDOW)) {
+                ip += 1;
+                continue;
+            }
+            there -= 1;
+            if (there < dictlen) {
+                ref = dict + there;
+                refend = dict + dictlen;
+            } else {
+                ref = src + (there - dictlen);
+                refend = end;
+            }
+            if ((refend - ref < MIN_MATCH) || (read32(ref) != read32(ip))) {
+                ip += 1;
+                continue;
+            }
+
+            // Matches in the dictionary stop at its end
+            matchlen = MIN_MATCH;
+            while ((ip + matchlen < end) && (ref + matchlen < refend) &&
+                    (ref[matchlen] == ip[matchlen])) {
+                matchlen += 1;
+            }
+            op = put_sequence(op, anchor, ip - anchor, here - there, matchlen);
+            ip += matchlen;
+            anchor = ip;
+        }
+    }
+    op = put_sequence(op, anchor, end - anchor, 0, 0);
+
+    return op - dst;
+}
+
+static int
+get_length(const uint8_t **ip, const uint8_t *end, size_t *len)
+{
+    uint8_t b;
+
+    do {
+        if (*ip >= end) {
+            return -1;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while (255 == b);
+    return 0;
+}
+
+/* Decompress len bytes of src into dst, which holds dstlen.
+ * Returns the decompressed length, or (size_t)-1 if src is corrupt.
+ */
+size_t
+lz_decompress(const uint8_t *dict, size_t dictlen,
+        const uint8_t *src, size_t len, uint8_t *dst, size_t dstlen)
+{
+    const uint8_t *ip = src;
+    const uint8_t *end = src + len;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + dstlen;
+
+    if (dictlen > LZ_WINDOW) {
+        dict += dictlen - LZ_WINDOW;
+        dictlen = LZ_WINDOW;
+    }
+
+    while (ip < end) {
+        uint8_t token = *ip++;
+        size_t litlen = token >> 4;
+        size_t matchlen = token & 15;
+        size_t offset;
+
+        if ((15 == litlen) && get_length(&ip, end, &litlen)) {
+            return (size_t)-1;
+        }
+        // Most runs are short: with room to spare, copy 16 regardless
+        if ((litlen <= 16) && (end - ip >= 16) && (oend - op >= 16)) {
+            memcpy(op, ip, 16);
+        } else if ((litlen <= (size_t)(end - ip)) && (litlen <= (size_t)(oend - op))) {
+            memcpy(op, ip, litlen);
+        } else {
+            return (size_t)-1;
+        }
+        ip += litlen;
+        op += litlen;
+
+        if (ip == end) {
+            break;
+        }
+
+        if (end - ip < 2) {
+            return (size_t)-1;
+        }
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if ((15 == matchlen) && get_length(&ip, end, &matchlen)) {
+            return (size_t)-1;
+        }
+        matchlen += MIN_MATCH;
+        if ((0 == offset) || (offset > (size_t)(op - dst) + dictlen) ||
+                (matchlen > (size_t)(oend - op))) {
+            return (size_t)-1;
+        }
+
+        if ((matchlen <= 16) && (offset >= 16) &&
+                (offset <= (size_t)(op - dst)) && (oend - op >= 16)) {
+            memcpy(op, op - offset, 16);
+            op += matchlen;
+            continue;
+        }
+
+        // The part of the match that's in the dictionary
+        if (offset > (size_t)(op - dst)) {
+            size_t back = offset - (op - dst);
+            size_t n = (matchlen < back) ? matchlen : back;
+
+            memcpy(op, dict + dictlen - back, n);
+            op += n;
+            matchlen -= n;
+        }
+
+        // A match that overlaps what it's copying repeats with period
+        // offset, so copy what's there, doubling each time
+        {
+            uint8_t *from = op - offset;
+
+            while (matchlen > 0) {
+                size_t n = op - from;
+
+                n = (n < matchlen) ? n : matchlen;
+                memcpy(op, from, n);
+                op += n;
+                matchlen -= n;
+            }
+        }
+    }
+
+    return op - dst;
+}
+
+/*
+ * Dictionary training
+ *
+ * Score each SEGMENT-byte piece of the sample by how common its KMER-byte
+ * substrings are across the whole sample, then take the best pieces,
+ * skipping ones whose substrings earlier picks already cover.
+ */
+
+#define KMER 8
+#define SEGMENT 64
+#define KMER_BITS 16
+
+struct segment {
+    uint32_t start;
+    uint32_t score;
+};
+
+static uint32_t
+hash_kmer(const uint8_t *p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, 8);
+    return (v * 0x9e3779b97f4a7c15ull) >> (64 - KMER_BITS);
+}
+
+static uint32_t
+score(const uint8_t *p, uint16_t *counts)
+{
+    uint32_t total = 0;
+    size_t i;
+
+    for (i = 0; i + KMER <= SEGMENT; i += 1) {
+        total += counts[hash_kmer(p + i)];
+    }
+    return total;
+}
+
+static int
+cmp_segments(const void *a, const void *b)
+{
+    const struct segment *sa = (const struct segment *)a;
+    const struct segment *sb = (const struct segment *)b;
+
+    return (sa->score < sb->score) - (sa->score > sb->score);
+}
+
+/* Build a dictionary of up to dictsize bytes from sample.
+ * Returns its length, 0 if the sample's too small to bother.
+ */
+size_t
+lz_train(const uint8_t *sample, size_t len, uint8_t *dict, size_t dictsize)
+{
+    uint16_t *counts;
+    struct segment *segs;
+    size_t nsegs = len / SEGMENT;
+    size_t dictlen = 0;
+    size_t i;
+
+    if ((len <= dictsize) || (nsegs < 2)) {
+        return 0;
+    }
+    counts = (uint16_t *)calloc(1 << KMER_BITS, sizeof(uint16_t));
+    segs = (struct segment *)malloc(nsegs * sizeof(struct segment));
+    if (! counts || ! segs) {
+        free(counts);
+        free(segs);
+        return 0;
+    }
+
+    for (i = 0; i + KMER <= len; i += 1) {
+        uint16_t *c = &counts[hash_kmer(sample + i)];
+
+        if (*c < 0xffff) {
+            *c += 1;
+        }
+    }
+    for (i = 0; i < nsegs; i += 1) {
+        segs[i].start = i * SEGMENT;
+        segs[i].score = score(sample + i * SEGMENT, counts);
+    }
+    qsort(segs, nsegs, sizeof(struct segment), cmp_segments);
+
+    for (i = 0; (i < nsegs) && (dictlen + SEGMENT <= dictsize); i += 1) {
+        const uint8_t *p = sample + segs[i].start;
+        size_t j;
+
+        if (score(p, counts) * 2 < segs[i].score) {
+            continue;
+        }
+        memcpy(dict + dictlen, p, SEGMENT);
+        dictlen += SEGMENT;
+        for (j = 0; j + KMER <= SEGMENT; j += 1) {
+            counts[hash_kmer(p + j)] = 0;
+        }
+    }
+
+    free(counts);
+    free(segs);
+
+    return dictlen;
+}
@@ -0,0 +1,19 @@
+#ifndef __LZ_H__
+#define __LZ_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Worst case compressed size for len bytes */
+#define LZ_BOUND(len) ((len) + (len) / 15 + 16)
+
+/* Matches reach back at most this far, dictionary included */
+#define LZ_WINDOW 0xffff
+
+size_t lz_train(const uint8_t *sample, size_t len, uint8_t *dict, size_t dictsize);
+size_t lz_compress(const uint8_t *dict, size_t dictlen,
+        const uint8_t *src, size_t len, uint8_t *dst);
+size_t lz_decompress(const uint8_t *dict, size_t dictlen,
+        const uint8_t *src, size_t len, uint8_t *dst, size_t dstlen);
+
+#endif
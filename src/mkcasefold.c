@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+
+/*
+ * Turn CaseFolding.txt (on stdin) into the lookup tables for casefold.c.
+ *
+ * Code points are split into blocks of CASEFOLD_BLOCK.  Each block is a
+ * list of deltas to add to a code point to fold it, and identical blocks
+ * (nearly all of them are all zero) are only written once.
+ */
+
+#define NCODES 0x110000
+#define BLOCK 128
+#define NBLOCKS (NCODES / BLOCK)
+
+int
+main(int argc, char *argv[])
+{
+    int32_t *delta = (int32_t *)calloc(NCODES, sizeof(int32_t));
+    uint16_t *stage1 = (uint16_t *)calloc(NBLOCKS, sizeof(uint16_t));
+    uint32_t *uniq = (uint32_t *)calloc(NBLOCKS, sizeof(uint32_t));
+    uint32_t nuniq = 0;
+    char line[512];
+    uint32_t b;
+    uint32_t i;
+
+    if (! delta || ! stage1 || ! uniq) {
+        perror("Allocating tables");
+        return EX_OSERR;
+    }
+
+    while (fgets(line, sizeof(line), stdin)) {
+        unsigned long from;
+        unsigned long to;
+        char status;
+
+        if (('#' == line[0]) || ('\n' == line[0])) {
+            continue;
+        }
+        if (3 != sscanf(line, "%lx; %c; %lx;", &from, &status, &to)) {
+            fprintf(stderr, "Bad line: %s", line);
+            return EX_DATAERR;
+        }
+        if ((from >= NCODES) || (to >= NCODES)) {
+            fprintf(stderr, "Out of range: %s", line);
+            return EX_DATAERR;
+        }
+        // Simple folding only: full (F) and Turkic (T) mappings don't apply
+        if (('C' == status) || ('S' == status)) {
+            delta[from] = (int32_t)to - (int32_t)from;
+        }
+    }
+
+    for (b = 0; b < NBLOCKS; b += 1) {
+        uint32_t u;
+
+        for (u = 0; u < nuniq; u += 1) {
+            if (0 == memcmp(delta + uniq[u] * BLOCK, delta + b * BLOCK, BLOCK * sizeof(int32_t))) {
+                break;
+            }
+        }
+        if (u == nuniq) {
+            uniq[nuniq++] = b;
+        }
+        stage1[b] = u;
+    }
+
+    printf("/* Generated by mkcasefold from CaseFolding.txt: do not edit */\n");
+    printf("\n");
+    printf("#define CASEFOLD_BLOCK %d\n", BLOCK);
+    printf("\n");
+    printf("static const uint16_t casefold_stage1[%d] = {", NBLOCKS);
+    for (b = 0; b < NBLOCKS; b += 1) {
+        printf("%s%u,", (b % 16) ? " " : "\n    ", stage1[b]);
+    }
+    printf("\n};\n");
+    printf("\n");
+    printf("static const int32_t casefold_stage2[%u][CASEFOLD_BLOCK] = {\n", nuniq);
+    for (b = 0; b < nuniq; b += 1) {
+        printf("    {");
+        for (i = 0; i < BLOCK; i += 1) {
+            printf("%s%d,", (i % 16) ? " " : "\n        ", delta[uniq[b] * BLOCK + i]);
+        }
+        printf("\n    },\n");
+    }
+    printf("};\n");
+
+    free(delta);
+    free(stage1);
+    free(uniq);
+
+    return 0;
+}
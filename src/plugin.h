@@ -0,0 +1,59 @@
+#ifndef __PLUGIN_H__
+#define __PLUGIN_H__
+
+#include <stdint.h>
+
+/*
+ * Handler plugins
+ *
+ * A plugin is a shared object that bot -p loads, exporting a struct
+ * bot_plugin named bot_plugin.  Its hooks run in bot's main loop, so
+ * they must not block: anything slow belongs in the handler.  Everything
+ * passed to a hook is only good until it returns.  With bot -l, a
+ * message reaches on_message only once its lane is free.
+ *
+ * Build one with
+ *
+ *   cc -shared -fPIC -Isrc -o plugin.so plugin.c
+ *
+ * bot refuses a plugin whose abi isn't BOT_PLUGIN_ABI.  Fields are only
+ * ever added to the end of these structs, with the version going up.
+ */
+#define BOT_PLUGIN_ABI 1
+
+/* What on_message returns */
+#define BOT_PASS 0              // Run the handler for this message too
+#define BOT_HANDLED 1           // Don't
+
+/* One message, split up like the handler's environment and arguments */
+struct irc_msg {
+    const char *line;           // As it came in
+    const char *prefix;         // Any of these may be NULL
+    const char *command;
+    const char *sender;
+    const char *forum;
+    const char *text;
+    int argc;                   // Parameters after the command
+    const char *const *argv;
+    uint64_t trace;
+};
+
+/* Send line (no newline) where the handler's output would go */
+typedef void (*emit_fn)(void *ctx, const char *line);
+
+struct bot_plugin {
+    int abi;
+    const char *name;
+
+    // At load, and at each reload (SIGHUP).  Nonzero refuses the load.
+    int (*init)(void);
+    void (*shutdown)(void);
+
+    int (*on_message)(const struct irc_msg *m, emit_fn emit, void *ctx);
+
+    // Every timer_ms milliseconds, if both are set
+    unsigned int timer_ms;
+    void (*on_timer)(emit_fn emit, void *ctx);
+};
+
+#endif
@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sysexits.h>
+#include "fq.h"
+
+enum action {
+    ACT_LEN,
+    ACT_PUSH,
+    ACT_POP,
+    ACT_PEEK
+};
+
+int
+usage(char *self)
+{
+    fprintf(stderr, "Usage: %s [OPTIONS] QUEUE [TEXT ...]\n", self);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Default:   Display the number of items in QUEUE\n");
+    fprintf(stderr, "-a         Append TEXT (the words, joined by spaces), or if there's\n");
+    fprintf(stderr, "           none, each line of stdin\n");
+    fprintf(stderr, "-p         Display the first item, and remove it\n");
+    fprintf(stderr, "-k         Display the first item, leaving it there\n");
+    fprintf(stderr, "-s         Don't finish a change until it's on disk\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "QUEUE is a directory, made if it isn't there.  Any number of handlers\n");
+    fprintf(stderr, "can use it at once.  -p and -k exit with 1 if it's empty.\n");
+
+    return EX_USAGE;
+}
+
+static int
+push_args(struct fq *q, int argc, char *argv[])
+{
+    char *text;
+    size_t len = 0;
+    int i;
+    int ret;
+
+    for (i = 0; i < argc; i += 1) {
+        len += strlen(argv[i]) + 1;
+    }
+    if (! (text = malloc(len))) {
+        perror("malloc");
+        return EX_OSERR;
+    }
+    for (len = 0, i = 0; i < argc; i += 1) {
+        if (i) {
+            text[len++] = ' ';
+        }
+        strcpy(text + len, argv[i]);
+        len += strlen(argv[i]);
+    }
+    ret = fq_push(q, text, len);
+    free(text);
+    return ret;
+}
+
+static int
+push_lines(struct fq *q)
+{
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    int ret = 0;
+
+    while ((0 == ret) && ((len = getline(&line, &size, stdin)) > 0)) {
+        if ('\n' == line[len - 1]) {
+            len -= 1;
+        }
+        ret = fq_push(q, line, len);
+    }
+    free(line);
+    return ret;
+}
+
+int
+main(int argc, char *argv[])
+{
+    enum action act = ACT_LEN;
+    int flags = 0;
+    char *qdir;
+    struct fq q;
+    char *item;
+    size_t len;
+    int64_t n;
+    int ret = 0;
+
+    for (;;) {
+        int opt = getopt(argc, argv, "hapks");
+
+        if (-1 == opt) {
+            break;
+        }
+        switch (opt) {
+            case 'a':
+                act = ACT_PUSH;
+                break;
+            case 'p':
+                act = ACT_POP;
+                break;
+            case 'k':
+                act = ACT_PEEK;
+                break;
+            case 's':
+                flags |= FQ_SYNC;
+                break;
+            default:
+                return usage(argv[0]);
+        }
+    }
+    if (optind >= argc) {
+        return usage(argv[0]);
+    }
+    qdir = argv[optind++];
+
+    if (fq_open(&q, qdir, flags)) {
+        perror(qdir);
+        return EX_CANTCREAT;
+    }
+
+    switch (act) {
+        case ACT_LEN:
+            if (-1 == (n = fq_len(&q))) {
+                ret = -1;
+            } else {
+                printf("%lld\n", (long long)n);
+            }
+            break;
+        case ACT_PUSH:
+            if (optind < argc) {
+                ret = push_args(&q, argc - optind, argv + optind);
+            } else {
+                ret = push_lines(&q);
+            }
+            break;
+        case ACT_POP:
+        case ACT_PEEK:
+            ret = (ACT_POP == act) ? fq_pop(&q, &item, &len) : fq_peek(&q, &item, &len);
+            if (1 == ret) {
+                fwrite(item, 1, len, stdout);
+                putchar('\n');
+                free(item);
+                ret = 0;
+            } else if (0 == ret) {
+                ret = 1;
+            }
+            break;
+    }
+    fq_close(&q);
+
+    if (-1 == ret) {
+        perror(qdir);
+        return EX_IOERR;
+    }
+    return ret;
+}
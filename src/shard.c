@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include "shard.h"
+#include "siphash.h"
+
+#define SHARD_VERSION 1
+
+static void
+manifest_name(const char *dir, char *fn, size_t fnlen)
+{
+    snprintf(fn, fnlen, "%s/manifest", dir);
+}
+
+/* Read dir's manifest.  Returns -1 if dir isn't a sharded database. */
+int
+shards_open(struct shards *s, const char *dir)
+{
+    char fn[sizeof(s->dir) + 16];
+    char hex[33];
+    unsigned int version;
+    FILE *f;
+    int i;
+
+    manifest_name(dir, fn, sizeof(fn));
+    if (! (f = fopen(fn, "r"))) {
+        return -1;
+    }
+    if ((3 != fscanf(f, "factoids-shards %u shards %u seed %32s",
+                    &version, &s->n, hex)) ||
+            (version > SHARD_VERSION) ||
+            (s->n < 1) || (s->n > SHARD_MAX) || (32 != strlen(hex))) {
+        fprintf(stderr, "%s: bad manifest\n", fn);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+
+    for (i = 0; i < 16; i += 1) {
+        unsigned int b;
+
+        sscanf(hex + i * 2, "%2x", &b);
+        s->seed[i] = b;
+    }
+    snprintf(s->dir, sizeof(s->dir), "%s", dir);
+
+    return 0;
+}
+
+/* Make dir, and a manifest for n shards in it */
+int
+shards_create(struct shards *s, const char *dir, uint32_t n)
+{
+    char fn[sizeof(s->dir) + 16];
+    char tmpfn[sizeof(fn) + 16];
+    FILE *f;
+    int i;
+
+    if ((n < 1) || (n > SHARD_MAX)) {
+        fprintf(stderr, "Shard count must be from 1 to %d\n", SHARD_MAX);
+        return -1;
+    }
+    if (mkdir(dir, 0777) && (EEXIST != errno)) {
+        perror(dir);
+        return -1;
+    }
+
+    // Any seed will do, as long as it's the same for good
+    if (! (f = fopen("/dev/urandom", "rb")) || (16 != fread(s->seed, 1, 16, f))) {
+        struct timeval tv;
+        uint8_t key[16] = {0};
+        uint64_t h;
+
+        gettimeofday(&tv, NULL);
+        h = ((uint64_t)tv.tv_sec << 32) ^ tv.tv_usec ^ ((uint64_t)getpid() << 16);
+        for (i = 0; i < 16; i += 1) {
+            h = siphash(key, &h, sizeof(h));
+            s->seed[i] = h & 0xff;
+        }
+    }
+    if (f) {
+        fclose(f);
+    }
+
+    manifest_name(dir, fn, sizeof(fn));
+    snprintf(tmpfn, sizeof(tmpfn), "%s.%d", fn, getpid());
+    if (! (f = fopen(tmpfn, "w"))) {
+        perror("Creating manifest");
+        return -1;
+    }
+    fprintf(f, "factoids-shards %d\nshards %u\nseed ", SHARD_VERSION, n);
+    for (i = 0; i < 16; i += 1) {
+        fprintf(f, "%02x", s->seed[i]);
+    }
+    fputc('\n', f);
+    if (fclose(f) || rename(tmpfn, fn)) {
+        perror("Writing manifest");
+        remove(tmpfn);
+        return -1;
+    }
+
+    s->n = n;
+    snprintf(s->dir, sizeof(s->dir), "%s", dir);
+
+    return 0;
+}
+
+/* Which shard key lives in */
+uint32_t
+shards_pick(const struct shards *s, const char *key, size_t keylen)
+{
+    return siphash(s->seed, key, keylen) % s->n;
+}
+
+void
+shards_path(const struct shards *s, uint32_t i, char *fn, size_t fnlen)
+{
+    snprintf(fn, fnlen, "%s/%u.cdb", s->dir, i);
+}
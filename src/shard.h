@@ -0,0 +1,31 @@
+#ifndef __SHARD_H__
+#define __SHARD_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A sharded database is a directory holding a manifest and N cdb files,
+ * 0.cdb to N-1.cdb.  Each key lives in the shard its seeded hash picks,
+ * so one key's lookups and changes only ever touch one file.
+ *
+ * The manifest is text:
+ *
+ *   factoids-shards 1
+ *   shards N
+ *   seed HEX                   (32 digits)
+ */
+#define SHARD_MAX 256
+
+struct shards {
+    char dir[4096];
+    uint32_t n;
+    uint8_t seed[16];
+};
+
+int shards_open(struct shards *s, const char *dir);
+int shards_create(struct shards *s, const char *dir, uint32_t n);
+uint32_t shards_pick(const struct shards *s, const char *key, size_t keylen);
+void shards_path(const struct shards *s, uint32_t i, char *fn, size_t fnlen);
+
+#endif
@@ -0,0 +1,75 @@
+#include <stddef.h>
+#include <stdint.h>
+#include "siphash.h"
+
+/*
+ * SipHash-2-4, by Jean-Philippe Aumasson and Daniel J. Bernstein.
+ *
+ * A keyed hash: without the key, nobody can pick inputs that collide.
+ */
+
+#define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND                                    \
+    do {                                            \
+        v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0;      \
+        v0 = ROTL(v0, 32);                          \
+        v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2;      \
+        v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0;      \
+        v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2;      \
+        v2 = ROTL(v2, 32);                          \
+    } while (0)
+
+static uint64_t
+get_u64le(const uint8_t *p)
+{
+    return (((uint64_t)p[0] << 0) |
+            ((uint64_t)p[1] << 8) |
+            ((uint64_t)p[2] << 16) |
+            ((uint64_t)p[3] << 24) |
+            ((uint64_t)p[4] << 32) |
+            ((uint64_t)p[5] << 40) |
+            ((uint64_t)p[6] << 48) |
+            ((uint64_t)p[7] << 56));
+}
+
+uint64_t
+siphash(const uint8_t key[16], const void *data, size_t len)
+{
+    const uint8_t *in = (const uint8_t *)data;
+    const uint8_t *end = in + len - (len % 8);
+    uint64_t k0 = get_u64le(key);
+    uint64_t k1 = get_u64le(key + 8);
+    uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+    uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+    uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+    uint64_t b = ((uint64_t)len) << 56;
+    uint64_t m;
+    int i;
+
+    for (; in != end; in += 8) {
+        m = get_u64le(in);
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+
+    for (i = len % 8; i > 0; i -= 1) {
+        b |= ((uint64_t)in[i - 1]) << (8 * (i - 1));
+    }
+
+    v3 ^= b;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= b;
+
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+
+    return v0 ^ v1 ^ v2 ^ v3;
+}
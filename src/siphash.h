@@ -0,0 +1,9 @@
+#ifndef __SIPHASH_H__
+#define __SIPHASH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint64_t siphash(const uint8_t key[16], const void *data, size_t len);
+
+#endif
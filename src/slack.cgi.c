@@ -1,99 +1,1273 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdbool.h>
-#include <unistd.h> // only for chdir
+#include <unistd.h>
 #include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sysexits.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 #include "cgi.h"
 
+/* With -l: how many requests are handled at once, the most one request
+ * (headers and body) can be, and how long an idle connection may hold
+ * on to a worker
+ */
+#define WORKERS 8
+#define REQUEST_MAX 65536
+#define IDLE_TIMEOUT 10
+
+extern char **environ;
+
 char const *botdir = "/home/neale/bot/zinc";
 
 void
-jputchar(char c)
+jputchar(FILE *out, char c)
 {
 	if (c == '\n') {
-		printf("\\n");
-	} else if (c < 0x20) {
-		printf("\%04x", c);
+		fprintf(out, "\\n");
+	} else if ((unsigned char)c < 0x20) {
+		fprintf(out, "\\u%04x", c);
 	} else if ((c == '\\') || (c == '"')) {
-		putchar('\\');
-		putchar(c);
+		fputc('\\', out);
+		fputc(c, out);
 	} else {
-		putchar(c);
+		fputc(c, out);
 	}
 }
 
-int
-main(int argc, char *argv[])
+static void
+setenv_or_not(char *name, const char *val)
 {
-	char key[80];
-	char val[2000];
+	if (val) {
+		setenv(name, val, true);
+	} else {
+		unsetenv(name);
+	}
+}
+
+/* Put the request's fields in the environment, for the handler.
+ * Returns true if it came from a bot, Slackbot or us, so mustn't be
+ * answered.
+ */
+bool
+read_form(struct cgi_form *f)
+{
+	const char *v;
 	
-	bool its_me = false;
+	if (f->json) {
+		// Events API
+		setenv_or_not("forum", cgi_get(f, "event.channel"));
+		setenv_or_not("sender", cgi_get(f, "event.user"));
+		setenv_or_not("text", cgi_get(f, "event.text"));
+		setenv_or_not("token", cgi_get(f, "token"));
+		unsetenv("response_url");
+		return (NULL != cgi_get(f, "event.bot_id"));
+	}
 	
-	cgi_init(argv);
+	if ((v = cgi_get(f, "channel_name"))) {
+		char chan[strlen(v) + 2];
+		
+		snprintf(chan, sizeof(chan), "#%s", v);
+		setenv("forum", chan, true);
+	} else {
+		unsetenv("forum");
+	}
+	setenv_or_not("sender", cgi_get(f, "user_name"));
+	setenv_or_not("text", cgi_get(f, "text"));
+	setenv_or_not("token", cgi_get(f, "token"));
+	setenv_or_not("response_url", cgi_get(f, "response_url"));
 	
-	for (;;) {
-		size_t len;
+	v = cgi_get(f, "user_id");
+	return v && (0 == strcmp(v, "USLACKBOT"));
+}
+
+/* Start ./handler, straight from here with no shell in between, with
+ * its output going to fd
+ */
+static pid_t
+start_handler(int fd, char **env)
+{
+	char *args[] = {"./handler", NULL};
+	posix_spawn_file_actions_t actions;
+	pid_t pid;
+	
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, fd, 1);
+	if (posix_spawn(&pid, args[0], &actions, NULL, args, env)) {
+		perror(args[0]);
+		pid = -1;
+	}
+	posix_spawn_file_actions_destroy(&actions);
+	return pid;
+}
+
+/*
+ * Bot bridge
+ *
+ * If a bot is listening on BOTDIR/bot.sock (bot -s), requests are sent
+ * to it as PRIVMSG lines, so its handler, and its limit on how many run
+ * at once, serve Slack too.
+ */
+
+char const *botsock = "bot.sock";
+
+static char *
+env_get(char **env, char *name)
+{
+	size_t len = strlen(name);
+	
+	for (; *env; env += 1) {
+		if ((0 == strncmp(*env, name, len)) && ('=' == (*env)[len])) {
+			return *env + len + 1;
+		}
+	}
+	return NULL;
+}
+
+/* Where bot_forward() sends the request in env: its forum, as a
+ * channel, or if it has none, its sender
+ */
+static void
+bot_target(char **env, char *buf, size_t size)
+{
+	char *sender = env_get(env, "sender");
+	char *forum = env_get(env, "forum");
+	
+	if (forum && *forum) {
+		snprintf(buf, size, "%s%s", strchr("#&+!", *forum) ? "" : "#", forum);
+	} else {
+		snprintf(buf, size, "%s", sender ? sender : "*");
+	}
+}
+
+/* The text of line, one the bot's handler printed, if it's a PRIVMSG
+ * or NOTICE to target; NULL for anything else, which Slack can't do
+ */
+static char *
+irc_text(char *line, const char *target)
+{
+	char *p = line;
+	char *cmd;
+	char *to;
+	
+	line[strcspn(line, "\r\n")] = '\0';
+	if (':' == *p) {
+		p += strcspn(p, " ");
+	}
+	p += strspn(p, " ");
+	cmd = strsep(&p, " ");
+	if (strcasecmp(cmd, "PRIVMSG") && strcasecmp(cmd, "NOTICE")) {
+		return NULL;
+	}
+	if (! p) {
+		return NULL;
+	}
+	p += strspn(p, " ");
+	to = strsep(&p, " ");
+	if (! p || strcasecmp(to, target)) {
+		return NULL;
+	}
+	p += strspn(p, " ");
+	if (':' == *p) {
+		return p + 1;
+	}
+	p[strcspn(p, " ")] = '\0';
+	return p;
+}
+
+/* Write what a handler printed to out, as a Slack reply, to post to
+ * channel if it's set.  If target is set, in is IRC lines from the bot,
+ * and only the text of its PRIVMSG and NOTICE lines to target is kept.
+ */
+static void
+format_reply(FILE *in, FILE *out, const char *channel, const char *target)
+{
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	int newlines = 0;
+	
+	fprintf(out, "{");
+	if (channel) {
+		fprintf(out, "\"channel\": \"");
+		for (; *channel; channel += 1) {
+			jputchar(out, *channel);
+		}
+		fprintf(out, "\", ");
+	}
+	fprintf(out, "\"text\": \"");
+	while (-1 != (len = getline(&line, &size, in))) {
+		char *text = line;
+		char *end = line + len;
 		
-		len = cgi_item(key, sizeof(key));
-		len = cgi_item(val, sizeof(val));
+		if (target) {
+			if (! (text = irc_text(line, target))) {
+				continue;
+			}
+			end = text + strlen(text);
+		} else if ((end > line) && ('\n' == end[-1])) {
+			end -= 1;
+		}
+		if (text < end) {
+			for (; newlines > 0; newlines -= 1) {
+				jputchar(out, '\n');
+			}
+			for (; text < end; text += 1) {
+				jputchar(out, *text);
+			}
+		}
+		newlines += 1;
+	}
+	fprintf(out, "\"}\n");
+	free(line);
+}
+
+/* Send the request in env to the bot.  Returns a descriptor to read
+ * what its handler prints from, or -1 if there's no bot, or the request
+ * won't fit on one of its lines.
+ */
+static int
+bot_forward(char **env)
+{
+	struct sockaddr_un addr = {0};
+	char *sender = env_get(env, "sender");
+	char *text = env_get(env, "text");
+	char target[2048];
+	char *line = NULL;
+	size_t len = 0;
+	size_t off;
+	FILE *f;
+	int fd;
+	
+	if (strlen(botsock) >= sizeof(addr.sun_path)) {
+		return -1;
+	}
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, botsock);
+	if (-1 == (fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0))) {
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		close(fd);
+		return -1;
+	}
+	
+	// :sender!slack@slack PRIVMSG #forum :text, with any newlines in text made spaces
+	if (! (f = open_memstream(&line, &len))) {
+		close(fd);
+		return -1;
+	}
+	if (sender) {
+		fprintf(f, ":%s!slack@slack ", sender);
+	}
+	bot_target(env, target, sizeof(target));
+	fprintf(f, "PRIVMSG %s :", target);
+	for (; text && *text; text += 1) {
+		fputc((('\r' == *text) || ('\n' == *text)) ? ' ' : *text, f);
+	}
+	fputc('\n', f);
+	fclose(f);
+	
+	// bot takes lines of up to 2047 bytes
+	for (off = 0; (len < 2048) && (off < len);) {
+		ssize_t r = send(fd, line + off, len - off, MSG_NOSIGNAL);
 		
-		if (0 == len) {
+		if (r <= 0) {
 			break;
 		}
+		off += r;
+	}
+	free(line);
+	if (off < len) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Run ./handler, or have the bot run it, and write what it prints to
+ * out as a Slack reply
+ */
+void
+reply(FILE *out)
+{
+	pid_t pid = -1;
+	char target[2048];
+	char *bridged = NULL;
+	int fds[2];
+	
+	setenv("command", "PRIVMSG", true);
+	
+	if (-1 != (fds[0] = bot_forward(environ))) {
+		bot_target(environ, target, sizeof(target));
+		bridged = target;
+	} else {
+		if (pipe2(fds, O_CLOEXEC)) {
+			perror("pipe");
+			fprintf(out, "{\"text\": \"\"}\n");
+			return;
+		}
+		pid = start_handler(fds[1], environ);
+		close(fds[1]);
+	}
+	
+	{
+		FILE *p = fdopen(fds[0], "r");
 		
-		if (0 == strcmp(key, "user_id")) {
-			if (0 == strcmp(val, "USLACKBOT")) {
-				its_me = true;
+		format_reply(p, out, NULL, bridged);
+		fclose(p);
+	}
+	if (pid > 0) {
+		waitpid(pid, NULL, 0);
+	}
+}
+
+/*
+ * Async mode
+ *
+ * If BOTDIR has a spool directory, a slash command is only written down
+ * there and answered at once, with nothing; "slack.cgi -D" runs the
+ * handler later and posts what it prints to the command's response_url,
+ * so a slow handler holds up neither the web server nor Slack.  The spool
+ * works like a maildir: a job is written in tmp, renamed into new, and
+ * claimed by renaming it into cur.
+ *
+ * Slack pays no mind to what an Events API callback is answered with, so
+ * events are spooled too, and their replies posted to the channel with
+ * chat.postMessage, as the bot whose token "slack.cgi -D" was given in
+ * SLACK_BOT_TOKEN.
+ */
+
+char const *spooldir = "spool";
+char const *curl = "curl";
+char const *post_message = "https://slack.com/api/chat.postMessage";
+
+/* curl's -H for the bot's token, which it reads from a file so the token
+ * isn't on its command line; empty if there's no token
+ */
+static char auth_header[PATH_MAX + 1];
+
+/* How many replies one curl posts, how many times to try posting one,
+ * and how many handlers may run at once
+ */
+#define BATCH 16
+#define TRIES 6
+#define JOBS_MAX 64
+
+static char *job_vars[] = {"forum", "sender", "text", "token", "response_url", NULL};
+
+/* Write the request, now in the environment, to the spool.  False if
+ * it has nowhere to reply to, or there's no spool.
+ */
+static bool
+spool_job(void)
+{
+	static unsigned long seq = 0;
+	char name[NAME_MAX + 1];
+	char tmp[PATH_MAX];
+	char new[PATH_MAX];
+	struct timeval tv;
+	char **var;
+	FILE *f;
+	int fd;
+	
+	// Slash commands have a response_url, events a channel
+	if (! getenv("response_url") && ! getenv("forum")) {
+		return false;
+	}
+	
+	gettimeofday(&tv, NULL);
+	snprintf(name, sizeof(name), "%ld%06ld-%d-%lu",
+			(long)tv.tv_sec, (long)tv.tv_usec, (int)getpid(), seq++);
+	snprintf(tmp, sizeof(tmp), "%s/tmp/%s", spooldir, name);
+	snprintf(new, sizeof(new), "%s/new/%s", spooldir, name);
+	if (! (f = fopen(tmp, "w"))) {
+		return false;
+	}
+	for (var = job_vars; *var; var += 1) {
+		char *val = getenv(*var);
+		
+		if (val) {
+			fprintf(f, "%s=%s%c", *var, val, '\0');
+		}
+	}
+	if (fclose(f) || rename(tmp, new)) {
+		unlink(tmp);
+		return false;
+	}
+	
+	// Nudge the deliverer, if it's there
+	snprintf(tmp, sizeof(tmp), "%s/wake", spooldir);
+	if (-1 != (fd = open(tmp, O_WRONLY | O_NONBLOCK))) {
+		if (write(fd, "", 1)) {
+			// Full means it's already been nudged
+		}
+		close(fd);
+	}
+	return true;
+}
+
+struct job {
+	char name[NAME_MAX + 1];
+	char *url;
+	char *channel;              // For Events API replies, posted as the bot
+	pid_t pid;                  // Handler, while it runs
+	int tries;
+	time_t due;
+};
+
+static struct job jobs[JOBS_MAX];
+static int njobs = 0;
+static int wake_fd = -1;
+
+static void
+on_child(int sig)
+{
+	int e = errno;
+	
+	if (write(wake_fd, "", 1)) {
+		// Nothing to do either way
+	}
+	errno = e;
+}
+
+static void
+job_path(char *path, struct job *job, char *suffix)
+{
+	snprintf(path, PATH_MAX, "%s/cur/%s%s", spooldir, job->name, suffix);
+}
+
+static void
+drop_job(struct job *job)
+{
+	char path[PATH_MAX];
+	
+	job_path(path, job, ".json");
+	unlink(path);
+	job_path(path, job, "");
+	unlink(path);
+	free(job->url);
+	free(job->channel);
+	*job = jobs[--njobs];
+}
+
+static struct job *
+new_job(char *name)
+{
+	struct job *job = &jobs[njobs++];
+	
+	memset(job, 0, sizeof(*job));
+	snprintf(job->name, sizeof(job->name), "%s", name);
+	return job;
+}
+
+/* Read the job's variables into buf, and where to post its reply into
+ * job: its response_url, or for an event, its channel.
+ * Returns an environment for its handler, with them and the rest of
+ * ours, to be freed; NULL if the job is no good.
+ */
+static char **
+job_env(struct job *job, char *buf, size_t size)
+{
+	char path[PATH_MAX];
+	char **envp;
+	char **e;
+	char *forum = NULL;
+	size_t len;
+	size_t n = 0;
+	size_t i;
+	FILE *f;
+	
+	job_path(path, job, "");
+	if (! (f = fopen(path, "r"))) {
+		perror(path);
+		return NULL;
+	}
+	len = fread(buf, 1, size - 1, f);
+	fclose(f);
+	buf[len] = '\0';
+	
+	for (e = environ; *e; e += 1);
+	if (! (envp = calloc(len + (e - environ) + 2, sizeof(*envp)))) {
+		return NULL;
+	}
+	for (i = 0; i < len; i += strlen(buf + i) + 1) {
+		envp[n++] = buf + i;
+		if (0 == strncmp(buf + i, "response_url=", 13)) {
+			free(job->url);
+			job->url = strdup(buf + i + 13);
+		} else if (0 == strncmp(buf + i, "forum=", 6)) {
+			forum = buf + i + 6;
+		}
+	}
+	if (! job->url && forum) {
+		if (*auth_header) {
+			free(job->channel);
+			job->channel = strdup(forum);
+			job->url = strdup(post_message);
+		} else {
+			fprintf(stderr, "%s: no SLACK_BOT_TOKEN to post %s with\n", spooldir, job->name);
+		}
+	}
+	envp[n++] = "command=PRIVMSG";
+	for (e = environ; *e; e += 1) {
+		char **var;
+		
+		for (var = job_vars; *var; var += 1) {
+			size_t l = strlen(*var);
+			
+			if ((0 == strncmp(*e, *var, l)) && ('=' == (*e)[l])) {
+				break;
 			}
-		} else if (0 == strcmp(key, "channel_name")) {
-			char chan[40];
+		}
+		if (! *var && strncmp(*e, "command=", 8)) {
+			envp[n++] = *e;
+		}
+	}
+	
+	if (! job->url) {
+		free(envp);
+		return NULL;
+	}
+	return envp;
+}
+
+/* Start the job's handler.  False if it couldn't be. */
+static bool
+start_job(struct job *job)
+{
+	char path[PATH_MAX];
+	char buf[REQUEST_MAX * 2];
+	char **envp = job_env(job, buf, sizeof(buf));
+	int sock;
+	int fd;
+	
+	if (! envp) {
+		return false;
+	}
+	job_path(path, job, ".out");
+	if (-1 == (fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666))) {
+		perror(path);
+		free(envp);
+		return false;
+	}
+	if (-1 != (sock = bot_forward(envp))) {
+		// Someone has to copy the text of the bot's replies into the file
+		if (0 == (job->pid = fork())) {
+			FILE *in = fdopen(sock, "r");
+			FILE *f = fdopen(fd, "w");
+			char target[2048];
+			char *line = NULL;
+			size_t size = 0;
+			char *text;
 			
-			snprintf(chan, sizeof(chan), "#%s", val);
-			setenv("forum", chan, true);
-		} else if (0 == strcmp(key, "user_name")) {
-			setenv("sender", val, true);
-		} else if (0 == strcmp(key, "text")) {
-			setenv("text", val, true);
-		} else if (0 == strcmp(key, "token")) {
-			setenv("token", val, true);
+			if (! in || ! f) {
+				_exit(EX_OSERR);
+			}
+			bot_target(envp, target, sizeof(target));
+			while (-1 != getline(&line, &size, in)) {
+				if ((text = irc_text(line, target))) {
+					fprintf(f, "%s\n", text);
+				}
+			}
+			_exit(fclose(f) ? EX_IOERR : 0);
 		}
+		close(sock);
+	} else {
+		job->pid = start_handler(fd, envp);
 	}
+	close(fd);
+	free(envp);
+	return (job->pid > 0);
+}
+
+/* Turn what the handler printed into the reply to post */
+static void
+finish_job(struct job *job)
+{
+	char out[PATH_MAX];
+	char json[PATH_MAX];
+	FILE *in;
+	FILE *f;
 	
-	cgi_header("text/json");
+	job->pid = 0;
+	job->due = time(NULL);
+	job_path(out, job, ".out");
+	job_path(json, job, ".json");
+	if ((in = fopen(out, "r")) && (f = fopen(json, "w"))) {
+		int c = fgetc(in);
+		
+		if (EOF == c) {
+			// Nothing to say
+			fclose(f);
+			unlink(json);
+			job->tries = TRIES;
+		} else {
+			ungetc(c, in);
+			format_reply(in, f, job->channel, NULL);
+			if (fclose(f)) {
+				perror(json);
+			}
+		}
+	}
+	if (in) {
+		fclose(in);
+	}
+	unlink(out);
+}
+
+/* Post replies with one curl, so they share a connection, and drop
+ * those that got through, or never will
+ */
+static void
+post_batch(struct job **batch, int n)
+{
+	char *args[2 + n * 16];
+	char data[BATCH][PATH_MAX + 1];
+	char line[80];
+	posix_spawn_file_actions_t actions;
+	time_t now = time(NULL);
+	pid_t pid;
+	int fds[2];
+	int argc = 0;
+	int i;
+	FILE *p;
 	
-	if (its_me) {
-		printf("{}");
-		return 0;
+	args[argc++] = (char *)curl;
+	for (i = 0; i < n; i += 1) {
+		data[i][0] = '@';
+		job_path(data[i] + 1, batch[i], ".json");
+		if (i > 0) {
+			args[argc++] = "--next";
+		}
+		args[argc++] = "-s";
+		args[argc++] = "-o";
+		args[argc++] = "/dev/null";
+		args[argc++] = "-w";
+		args[argc++] = "%{http_code}\n";
+		args[argc++] = "-m";
+		args[argc++] = "10";
+		args[argc++] = "-H";
+		args[argc++] = "Content-Type: application/json; charset=utf-8";
+		if (batch[i]->channel) {
+			args[argc++] = "-H";
+			args[argc++] = auth_header;
+		}
+		args[argc++] = "--data-binary";
+		args[argc++] = data[i];
+		args[argc++] = batch[i]->url;
 	}
+	args[argc] = NULL;
 	
-	setenv("command", "PRIVMSG", true);
+	if (pipe2(fds, O_CLOEXEC)) {
+		perror("pipe");
+		return;
+	}
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, fds[1], 1);
+	if (posix_spawnp(&pid, curl, &actions, NULL, args, environ)) {
+		perror(curl);
+		pid = -1;
+	}
+	posix_spawn_file_actions_destroy(&actions);
+	close(fds[1]);
 	
-	chdir(botdir);
-	{
-		FILE *p = popen("./handler", "r");
-		int newlines = 0;
+	// One status per reply, 000 if it didn't get an answer
+	p = fdopen(fds[0], "r");
+	for (i = 0; i < n; i += 1) {
+		struct job *job = batch[i];
+		int status = fgets(line, sizeof(line), p) ? atoi(line) : 0;
 		
-		printf("{\"text\": \"");
-		for (;;) {
-			int c = fgetc(p);
+		job->tries += 1;
+		if ((status >= 200) && (status < 300)) {
+			job->tries = 0;
+		} else if ((job->tries < TRIES) &&
+				((status < 400) || (status >= 500) || (429 == status))) {
+			job->due = now + (1 << job->tries);
+			continue;
+		} else {
+			fprintf(stderr, "%s: giving up on %s (HTTP %d)\n", spooldir, job->name, status);
+		}
+		job->due = 0;
+	}
+	fclose(p);
+	if (pid > 0) {
+		waitpid(pid, NULL, 0);
+	}
+}
+
+/* Jobs a dead deliverer left in cur: post the replies it got to, and put
+ * the rest back in new
+ */
+static void
+recover(void)
+{
+	char path[PATH_MAX];
+	char new[PATH_MAX];
+	struct dirent *ent;
+	DIR *d;
+	
+	snprintf(path, sizeof(path), "%s/cur", spooldir);
+	if (! (d = opendir(path))) {
+		return;
+	}
+	while ((ent = readdir(d))) {
+		struct job job = {{0}};
+		
+		if (strchr(ent->d_name, '.')) {
+			continue;
+		}
+		snprintf(job.name, sizeof(job.name), "%s", ent->d_name);
+		job_path(path, &job, ".json");
+		if ((0 == access(path, F_OK)) && (njobs < JOBS_MAX)) {
+			struct job *j = new_job(ent->d_name);
+			char buf[REQUEST_MAX * 2];
+			char **envp = job_env(j, buf, sizeof(buf));
 			
-			if (EOF == c) {
-				break;
-			} else if ('\n' == c) {
-				newlines += 1;
-			} else {
-				for (; newlines > 0; newlines -= 1) {
-					jputchar('\n');
+			free(envp);
+			j->due = envp ? time(NULL) : 0;
+		} else {
+			job_path(path, &job, "");
+			snprintf(new, sizeof(new), "%s/new/%s", spooldir, job.name);
+			rename(path, new);
+		}
+	}
+	closedir(d);
+}
+
+int
+deliver(void)
+{
+	char path[PATH_MAX];
+	char *subdirs[] = {"", "/tmp", "/new", "/cur", NULL};
+	char **sub;
+	char *token;
+	int fd;
+	
+	if (chdir(botdir)) {
+		perror(botdir);
+		return EX_NOINPUT;
+	}
+	for (sub = subdirs; *sub; sub += 1) {
+		snprintf(path, sizeof(path), "%s%s", spooldir, *sub);
+		if (mkdir(path, 0777) && (EEXIST != errno)) {
+			perror(path);
+			return EX_CANTCREAT;
+		}
+	}
+	// Only we can read the bot's token, and handlers don't get it
+	snprintf(path, sizeof(path), "%s/auth", spooldir);
+	unlink(path);
+	if ((token = getenv("SLACK_BOT_TOKEN"))) {
+		FILE *f;
+		
+		if ((-1 == (fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600))) ||
+				! (f = fdopen(fd, "w"))) {
+			perror(path);
+			return EX_CANTCREAT;
+		}
+		fprintf(f, "Authorization: Bearer %s\n", token);
+		if (fclose(f)) {
+			perror(path);
+			return EX_IOERR;
+		}
+		snprintf(auth_header, sizeof(auth_header), "@%s", path);
+		unsetenv("SLACK_BOT_TOKEN");
+	}
+	snprintf(path, sizeof(path), "%s/wake", spooldir);
+	if ((mkfifo(path, 0666) && (EEXIST != errno)) ||
+			(-1 == (wake_fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC)))) {
+		perror(path);
+		return EX_CANTCREAT;
+	}
+	signal(SIGCHLD, on_child);
+	recover();
+	
+	for (;;) {
+		struct job *batch[BATCH];
+		struct timeval tv = {1, 0};
+		time_t now;
+		fd_set rfds;
+		pid_t pid;
+		char junk[64];
+		int nbatch = 0;
+		int i;
+		
+		// Handlers that finished
+		while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+			for (i = 0; i < njobs; i += 1) {
+				if (jobs[i].pid == pid) {
+					finish_job(&jobs[i]);
 				}
-				jputchar(c);
 			}
 		}
-		printf("\"}\n");
 		
-		pclose(p);
+		// New jobs
+		if (njobs < JOBS_MAX) {
+			DIR *d;
+			struct dirent *ent;
+			
+			snprintf(path, sizeof(path), "%s/new", spooldir);
+			d = opendir(path);
+			while (d && (njobs < JOBS_MAX) && (ent = readdir(d))) {
+				char cur[PATH_MAX];
+				struct job *job;
+				
+				if ('.' == ent->d_name[0]) {
+					continue;
+				}
+				snprintf(path, sizeof(path), "%s/new/%s", spooldir, ent->d_name);
+				snprintf(cur, sizeof(cur), "%s/cur/%s", spooldir, ent->d_name);
+				if (rename(path, cur)) {
+					continue;
+				}
+				job = new_job(ent->d_name);
+				if (! start_job(job)) {
+					job->pid = 0;
+					job->due = 0;
+				}
+			}
+			if (d) {
+				closedir(d);
+			}
+		}
+		
+		// Replies that are due, and jobs that are done
+		now = time(NULL);
+		for (i = 0; i < njobs; i += 1) {
+			struct job *job = &jobs[i];
+			
+			if (job->pid) {
+				continue;
+			} else if (! job->due || (job->tries >= TRIES)) {
+				drop_job(job);
+				i -= 1;
+			} else if (job->due <= now) {
+				batch[nbatch++] = job;
+				if (BATCH == nbatch) {
+					post_batch(batch, nbatch);
+					nbatch = 0;
+				}
+			} else if (job->due - now < tv.tv_sec) {
+				tv.tv_sec = job->due - now;
+			}
+		}
+		if (nbatch) {
+			post_batch(batch, nbatch);
+			continue;
+		}
+		
+		FD_ZERO(&rfds);
+		FD_SET(wake_fd, &rfds);
+		if ((-1 == select(wake_fd + 1, &rfds, NULL, NULL, &tv)) && (EINTR != errno)) {
+			perror("select");
+			return EX_OSERR;
+		}
+		while (read(wake_fd, junk, sizeof(junk)) > 0);
+	}
+}
+
+/* Write the answer to the request in f */
+void
+answer(FILE *out, struct cgi_form *f)
+{
+	const char *v = cgi_get(f, "type");
+	
+	if (f->json && v && (0 == strcmp(v, "url_verification"))) {
+		// Slack making sure the Events API URL is ours
+		fprintf(out, "{\"challenge\": \"");
+		for (v = cgi_get(f, "challenge"); v && *v; v += 1) {
+			jputchar(out, *v);
+		}
+		fprintf(out, "\"}\n");
+	} else if (read_form(f)) {
+		fprintf(out, "{}");
+	} else if (! spool_job()) {
+		reply(out);
+	}
+}
+
+/*
+ * Server mode
+ *
+ * A few preforked workers take turns accepting connections on a local
+ * port, and each serves HTTP/1.1 requests on its connection, one after
+ * another, until the client closes it or goes quiet.  Put it behind the
+ * web server, instead of starting a new process for every request.
+ */
+
+/* Send all of iov to socket fd.  A client that went away is an error
+ * here, not a SIGPIPE, so handlers still start with SIGPIPE as usual.
+ */
+static bool
+write_all(int fd, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt > 0) {
+		struct msghdr msg = {0};
+		ssize_t r;
+		
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+		r = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if (r < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			return false;
+		}
+		for (; (iovcnt > 0) && ((size_t)r >= iov->iov_len); iov += 1, iovcnt -= 1) {
+			r -= iov->iov_len;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + r;
+			iov->iov_len -= r;
+		}
+	}
+	return true;
+}
+
+/* Send one response, headers and body in a single write */
+static bool
+respond(int fd, int status, const char *reason, char *body, size_t bodylen, bool keepalive)
+{
+	char head[256];
+	struct iovec iov[2];
+	int headlen;
+	
+	headlen = snprintf(head, sizeof(head),
+			"HTTP/1.1 %d %s\r\n"
+			"Content-Type: %s\r\n"
+			"Content-Length: %lu\r\n"
+			"%s"
+			"\r\n",
+			status, reason,
+			(200 == status) ? "text/json" : "text/plain",
+			(unsigned long)bodylen,
+			keepalive ? "" : "Connection: close\r\n");
+	iov[0].iov_base = head;
+	iov[0].iov_len = headlen;
+	iov[1].iov_base = body;
+	iov[1].iov_len = bodylen;
+	return write_all(fd, iov, 2);
+}
+
+static void
+fail(int fd, int status)
+{
+	const char *reason = cgi_reason(status);
+	
+	respond(fd, status, reason, (char *)reason, strlen(reason), false);
+}
+
+/* Value of header name, in the header lines after h, or NULL */
+static char *
+header(char *h, char *name)
+{
+	size_t len = strlen(name);
+	
+	for (h = strstr(h, "\r\n"); h; h = strstr(h, "\r\n")) {
+		h += 2;
+		if ((0 == strncasecmp(h, name, len)) && (':' == h[len])) {
+			for (h += len + 1; (' ' == *h) || ('\t' == *h); h += 1);
+			return h;
+		}
+	}
+	return NULL;
+}
+
+/* Read at least until buf holds want bytes.  False at EOF or timeout. */
+static bool
+fill(int fd, char *buf, size_t *len, size_t want)
+{
+	while (*len < want) {
+		ssize_t r = read(fd, buf + *len, REQUEST_MAX - *len);
+		
+		if (r <= 0) {
+			return false;
+		}
+		*len += r;
+	}
+	return true;
+}
+
+/* Serve every request that comes in on fd */
+static void
+serve_conn(int fd, struct cgi_form *form)
+{
+	static char buf[REQUEST_MAX + 1];
+	struct timeval tv = {IDLE_TIMEOUT, 0};
+	size_t len = 0;
+	
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	
+	for (;;) {
+		char *end;
+		char *method;
+		char *target;
+		char *version;
+		char *v;
+		size_t hdrlen;
+		size_t bodylen = 0;
+		size_t reqlen;
+		char next;
+		int status;
+		bool keepalive;
+		char *out = NULL;
+		size_t outlen = 0;
+		FILE *f;
+		
+		// Headers
+		while (! (end = memmem(buf, len, "\r\n\r\n", 4))) {
+			if (REQUEST_MAX == len) {
+				fail(fd, 431);
+				return;
+			}
+			if (! fill(fd, buf, &len, len + 1)) {
+				return;
+			}
+		}
+		hdrlen = end - buf + 4;
+		end[2] = '\0';
+		
+		// METHOD TARGET HTTP/1.x
+		method = buf;
+		if (! (target = strchr(method, ' ')) || ! (version = strchr(target + 1, ' '))) {
+			fail(fd, 400);
+			return;
+		}
+		*(target++) = '\0';
+		*(version++) = '\0';
+		
+		keepalive = (0 == strncmp(version, "HTTP/1.1", 8));
+		if ((v = header(version, "Connection"))) {
+			if (0 == strncasecmp(v, "close", 5)) {
+				keepalive = false;
+			} else if (0 == strncasecmp(v, "keep-alive", 10)) {
+				keepalive = true;
+			}
+		}
+		if (header(version, "Transfer-Encoding")) {
+			fail(fd, 411);
+			return;
+		}
+		if ((v = header(version, "Content-Length"))) {
+			bodylen = strtoul(v, NULL, 10);
+		}
+		if (bodylen > REQUEST_MAX - hdrlen) {
+			fail(fd, 413);
+			return;
+		}
+		
+		// Body
+		reqlen = hdrlen + bodylen;
+		if ((len < reqlen) && (v = header(version, "Expect")) &&
+				(0 == strncasecmp(v, "100-continue", 12))) {
+			struct iovec iov = {"HTTP/1.1 100 Continue\r\n\r\n", 25};
+			
+			write_all(fd, &iov, 1);
+		}
+		if (! fill(fd, buf, &len, reqlen)) {
+			return;
+		}
+		
+		// The form is decoded where it lies, which puts a NUL just past
+		// it, on the first byte of any pipelined request
+		next = buf[reqlen];
+		if (0 == strcmp(method, "POST")) {
+			status = cgi_parse(form, buf + hdrlen, bodylen, header(version, "Content-Type"));
+		} else if (0 == strcmp(method, "GET")) {
+			char *query = strchr(target, '?');
+			
+			query = query ? query + 1 : "";
+			status = cgi_parse(form, query, strlen(query), NULL);
+		} else {
+			status = 405;
+		}
+		if (status) {
+			fail(fd, status);
+			return;
+		}
+		
+		if (! (f = open_memstream(&out, &outlen))) {
+			fail(fd, 500);
+			return;
+		}
+		answer(f, form);
+		fclose(f);
+		buf[reqlen] = next;
+		
+		if (! respond(fd, 200, "OK", out, outlen, keepalive)) {
+			keepalive = false;
+		}
+		free(out);
+		if (! keepalive) {
+			return;
+		}
+		
+		// Whatever's left is the start of the next request
+		memmove(buf, buf + reqlen, len - reqlen);
+		len -= reqlen;
+	}
+}
+
+static void
+worker(int sock)
+{
+	struct cgi_form form;
+	
+	if (cgi_form_init(&form, NULL)) {
+		perror("cgi_form_init");
+		exit(EX_OSERR);
 	}
+	for (;;) {
+		int fd = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+		
+		if (-1 == fd) {
+			if ((EINTR == errno) || (ECONNABORTED == errno)) {
+				continue;
+			}
+			perror("accept");
+			exit(EX_OSERR);
+		}
+		serve_conn(fd, &form);
+		close(fd);
+	}
+}
+
+int
+serve(char *port, int workers)
+{
+	struct sockaddr_in addr = {0};
+	int one = 1;
+	int running = 0;
+	int sock;
+	
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(atoi(port));
+	if ((-1 == (sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0))) ||
+			setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) ||
+			bind(sock, (struct sockaddr *)&addr, sizeof(addr)) ||
+			listen(sock, 128)) {
+		perror(port);
+		return EX_UNAVAILABLE;
+	}
+	if (chdir(botdir)) {
+		perror(botdir);
+		return EX_NOINPUT;
+	}
+	// Replace any worker that dies
+	for (;;) {
+		for (; running < workers; running += 1) {
+			pid_t pid = fork();
+			
+			if (0 == pid) {
+				worker(sock);
+			} else if (-1 == pid) {
+				perror("fork");
+				break;
+			}
+		}
+		if (-1 != wait(NULL)) {
+			running -= 1;
+		} else if (EINTR != errno) {
+			perror("wait");
+			return EX_OSERR;
+		}
+	}
+}
+
+int
+usage(char *self)
+{
+	fprintf(stderr, "Usage: %s [-l PORT [-w WORKERS] | -D] [-d BOTDIR] [KEY=VAL ...]\n", self);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Run as a CGI, or with -l, as an HTTP server on 127.0.0.1:PORT.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "-l PORT     Serve HTTP/1.1 on PORT, with WORKERS processes (default %d)\n", WORKERS);
+	fprintf(stderr, "            Each keeps one connection, so give at least as many as the\n");
+	fprintf(stderr, "            web server keeps open to it\n");
+	fprintf(stderr, "-d BOTDIR   Run BOTDIR/handler (default %s)\n", botdir);
+	fprintf(stderr, "-D          Run handlers for the slash commands and events queued in\n");
+	fprintf(stderr, "            BOTDIR/%s, and post their replies; queueing starts once\n", spooldir);
+	fprintf(stderr, "            this has run.  Replies to events are posted as the bot whose\n");
+	fprintf(stderr, "            token is in SLACK_BOT_TOKEN\n");
+	
+	return EX_USAGE;
+}
+
+int
+main(int argc, char *argv[])
+{
+	char *port = NULL;
+	int workers = WORKERS;
+	bool delivery = false;
+	struct cgi_form form;
+	int status;
+	
+	// Under a web server, arguments are the query, not options
+	if (! getenv("REQUEST_METHOD")) {
+		for (;;) {
+			int opt = getopt(argc, argv, "+hDl:w:d:");
+			
+			if (-1 == opt) {
+				break;
+			}
+			switch (opt) {
+				case 'l':
+					port = optarg;
+					break;
+				case 'w':
+					workers = atoi(optarg);
+					break;
+				case 'd':
+					botdir = optarg;
+					break;
+				case 'D':
+					delivery = true;
+					break;
+				default:
+					return usage(argv[0]);
+			}
+		}
+		argv += optind - 1;
+	}
+	if (delivery) {
+		return deliver();
+	} else if (port) {
+		return serve(port, (workers > 0) ? workers : 1);
+	}
+	
+	if (cgi_form_init(&form, NULL)) {
+		perror("cgi_form_init");
+		return EX_OSERR;
+	}
+	if ((status = cgi_read(&form, argv))) {
+		cgi_error(status);
+		return 0;
+	}
+	
+	cgi_header("text/json");
+	chdir(botdir);
+	answer(stdout, &form);
+	cgi_form_free(&form);
 
 	return 0;
 }